@@ -43,6 +43,9 @@
 #include <vector>
 #include <map>
 #include <utility>
+#include <thread>
+#include <cstring>
+#include <cstdint>
 #include "itk_to_nifti_xform.h"
 #include "itksys/SystemTools.hxx"
 
@@ -282,6 +285,170 @@ void do_dgemv(vnl_matrix<double> &A, vnl_vector<double> &b, vnl_vector<double> &
          &incx, &beta, result.data_block(), &incy);
 }
 
+/**
+ * Compute y = exp(x) for an array of values. The exponential is computed by
+ * range reduction x = k log(2) + r, a polynomial for exp(r) and a scaling by
+ * 2^k done on the exponent bits. The loops have no branches and no library
+ * calls so that the compiler can vectorize them. x and y may be the same.
+ * The error is below 3 ulp; values below -708 (including -inf and NaN) give
+ * zero.
+ */
+void vectorized_exp(const double *x, double *y, unsigned int n)
+{
+  const double log2e = 1.4426950408889634, shifter = 6755399441055744.0;
+  const double ln2_hi = 6.93147180369123816490e-01, ln2_lo = 1.90821492927058770002e-10;
+
+  // Clamp the input to the range where the result is a normal number. The
+  // values that give zero (including NaN) are mapped to -709
+  for(unsigned int k = 0; k < n; k++)
+    {
+    double xk = x[k] > -708.0 ? x[k] : -709.0;
+    y[k] = xk < 709.0 ? xk : 709.0;
+    }
+
+  for(unsigned int k = 0; k < n; k++)
+    {
+    // After adding the shifter, the low bits of t hold the integer k
+    double xk = y[k];
+    double t = xk * log2e + shifter;
+    double nk = t - shifter;
+    double r = (xk - nk * ln2_hi) - nk * ln2_lo;
+
+    // Taylor polynomial for |r| <= log(2)/2
+    double p = 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+
+    // Construct 2^k from the bits of t, or zero for the clamped values
+    uint64_t bits;
+    double scale;
+    memcpy(&bits, &t, sizeof(double));
+    bits = xk > -708.5 ? (bits + 1023) << 52 : 0;
+    memcpy(&scale, &bits, sizeof(double));
+
+    y[k] = p * scale;
+    }
+}
+
+/**
+ * Log-sum-exp of the vector u + a, where a is one row of a matrix. The sum
+ * is computed in a single pass over tiles of the row, keeping a running
+ * maximum and rescaling the running sum whenever the maximum increases.
+ */
+double row_log_sum_exp(const double *u, const double *a, unsigned int n)
+{
+  const unsigned int tile = 256, lanes = 8;
+  double v[tile], lane_acc[lanes];
+  double vmax = -std::numeric_limits<double>::infinity(), sum_exp = 0.0;
+
+  for(unsigned int j0 = 0; j0 < n; j0 += tile)
+    {
+    // Fill the tile, padding to a multiple of the number of lanes
+    unsigned int nt = std::min(tile, n - j0);
+    unsigned int nt_pad = (nt + lanes - 1) / lanes * lanes;
+    for(unsigned int k = 0; k < nt; k++)
+      v[k] = u[j0 + k] + a[j0 + k];
+    for(unsigned int k = nt; k < nt_pad; k++)
+      v[k] = -std::numeric_limits<double>::infinity();
+
+    // Maximum over the tile
+    for(unsigned int l = 0; l < lanes; l++)
+      lane_acc[l] = v[l];
+    for(unsigned int k = lanes; k < nt_pad; k += lanes)
+      for(unsigned int l = 0; l < lanes; l++)
+        lane_acc[l] = std::max(lane_acc[l], v[k + l]);
+    double tmax = *std::max_element(lane_acc, lane_acc + lanes);
+
+    // Update the running maximum. Entries are skipped while it is -inf
+    if(tmax > vmax)
+      {
+      sum_exp *= exp(vmax - tmax);
+      vmax = tmax;
+      }
+    if(!std::isfinite(vmax))
+      continue;
+
+    // Sum of exponentials over the tile
+    for(unsigned int k = 0; k < nt_pad; k++)
+      v[k] -= vmax;
+    vectorized_exp(v, v, nt_pad);
+    std::fill(lane_acc, lane_acc + lanes, 0.0);
+    for(unsigned int k = 0; k < nt_pad; k += lanes)
+      for(unsigned int l = 0; l < lanes; l++)
+        lane_acc[l] += v[k + l];
+    for(unsigned int l = 0; l < lanes; l++)
+      sum_exp += lane_acc[l];
+    }
+
+  return log(sum_exp) + vmax;
+}
+
+/**
+ * Log-sum-exp of u + A[:,j] for the columns j0 <= j < j0 + nt of a row-major
+ * matrix A with n_rows rows and n_cols columns, nt <= 256. The matrix is read
+ * in blocks of rows that stay in cache. For each block, the column maxima are
+ * found first and then the exponentials are summed, so that each column keeps
+ * a running maximum and sum as in row_log_sum_exp.
+ */
+void column_log_sum_exp(const double *u, const double *A,
+                        unsigned int n_rows, unsigned int n_cols,
+                        unsigned int j0, unsigned int nt, double *result)
+{
+  const unsigned int tile = 256, block = 64;
+  double vmax[tile], sum_exp[tile], bmax[tile], v[tile];
+  std::fill(vmax, vmax + nt, -std::numeric_limits<double>::infinity());
+  std::fill(sum_exp, sum_exp + nt, 0.0);
+
+  for(unsigned int i0 = 0; i0 < n_rows; i0 += block)
+    {
+    unsigned int i1 = std::min(i0 + block, n_rows);
+
+    // Maxima over the block of rows
+    std::fill(bmax, bmax + nt, -std::numeric_limits<double>::infinity());
+    for(unsigned int i = i0; i < i1; i++)
+      {
+      const double *a_row = A + (size_t) n_cols * i + j0;
+      for(unsigned int k = 0; k < nt; k++)
+        bmax[k] = std::max(bmax[k], u[i] + a_row[k]);
+      }
+
+    // Rescale the sums for the columns whose maximum increased
+    for(unsigned int k = 0; k < nt; k++)
+      {
+      v[k] = bmax[k] > vmax[k] ? vmax[k] - bmax[k] : 0.0;
+      vmax[k] = std::max(vmax[k], bmax[k]);
+      }
+    vectorized_exp(v, v, nt);
+    for(unsigned int k = 0; k < nt; k++)
+      sum_exp[k] *= v[k];
+
+    // Add the exponentials. Columns with an infinite maximum give NaN, which
+    // vectorized_exp maps to zero
+    for(unsigned int i = i0; i < i1; i++)
+      {
+      const double *a_row = A + (size_t) n_cols * i + j0;
+      for(unsigned int k = 0; k < nt; k++)
+        v[k] = u[i] + a_row[k] - vmax[k];
+      vectorized_exp(v, v, nt);
+      for(unsigned int k = 0; k < nt; k++)
+        sum_exp[k] += v[k];
+      }
+    }
+
+  for(unsigned int k = 0; k < nt; k++)
+    result[k] = log(sum_exp[k]) + vmax[k];
+}
+
 /**
  * Optimal Mass Transport using Generalized Sinkhorn Iteration
  * Code based on Karlsson and Ringh paper (https://arxiv.org/pdf/1612.02273.pdf)
@@ -299,13 +466,17 @@ public:
 
 
   /**
-   * The constructor takes a source mesh, a target mesh, and a set of parameters
+   * The constructor takes a source mesh, a target mesh, and a set of parameters.
+   * If sparse_tol is positive, the kernel is truncated to the entries where the
+   * transport plan is at least sparse_tol, and only these entries are stored.
+   * Sparse iteration is always performed in the log domain.
    */
   SinkhornIteration(TriangleMesh *source, TriangleMesh *target,
                     const std::vector<SMLVec3d> &Xtarget,
-                    bool flip_target_normal, bool log_domain)
+                    bool flip_target_normal, bool log_domain,
+                    double sparse_tol = 0.0)
     : m_Source(source), m_Target(target),
-      m_LogDomain(log_domain)
+      m_LogDomain(log_domain || sparse_tol > 0.0), m_SparseTol(sparse_tol)
     {
     unsigned int n0 = m_Source->triangles.size(), n1 = m_Target->triangles.size();
 
@@ -363,11 +534,20 @@ public:
     m_U0.set_size(n0);
     m_U0.fill(m_LogDomain ? 0. : 1.);
 
-    // Initialize the matrix K
-    m_C.set_size(n0, n1);
-    m_K.set_size(n0, n1);
+    // The dense matrices C and K are allocated on first use
     }
 
+  /**
+   * Set the number of coarser epsilon levels used before each sparse Sinkhorn
+   * run. The levels use epsilon multiplied by factor, factor^2, etc., and each
+   * level starts from the potentials of the previous one.
+   */
+  void SetEpsilonScaling(int n_levels, double factor = 2.0)
+  {
+    m_EpsScalingLevels = n_levels;
+    m_EpsScalingFactor = factor;
+  }
+
   /** Set labels that restrict matching between source and target triangles */
   void SetLabels(const std::vector<int> &source_labels, const std::vector<int> &target_labels)
   {
@@ -380,25 +560,49 @@ public:
     return m_LogDomain ? exp(m_U0(i) + m_U1(j) + m_K(i, j)) : m_U0(i) * m_K(i, j) * m_U1(j);
     }
 
+  /**
+   * Call f(j, C_ij, gamma_ij) for every target triangle j that receives mass
+   * from source triangle i. In sparse mode, only the stored entries are visited.
+   */
+  template <class TFunc>
+  void ForEachTransport(unsigned int i, TFunc f)
+    {
+    if(m_SparseTol > 0.0)
+      {
+      for(size_t q = m_SpRowPtr[i]; q < m_SpRowPtr[i+1]; q++)
+        {
+        int j = m_SpCol[q];
+        f(j, m_SpC[q], exp(m_U0[i] + m_U1[j] + m_SpLogK[q]));
+        }
+      }
+    else
+      {
+      unsigned int n1 = m_Target->triangles.size();
+      for(unsigned int j = 0; j < n1; j++)
+        {
+        double m_ij = GetJointDensity(i,j);
+        if(m_ij > 0)
+          f(j, m_C(i,j), m_ij);
+        }
+      }
+    }
+
   bool PrintLoss(int iter, double tol)
     {
-    unsigned int n0 = m_Source->triangles.size(), n1 = m_Target->triangles.size();
+    unsigned int n0 = m_Source->triangles.size();
 
     // Check if the iterations are correct
     double loss = 0.0, entropy = 0.0;
     vnl_vector<double> mu0_test = m_Mu0, mu1_test = m_Mu1;
     for(unsigned int i = 0; i < n0; i++)
       {
-      for(unsigned int j = 0; j < n1; j++)
+      ForEachTransport(i, [&](int j, double c_ij, double m_ij)
         {
-        // Compute the actual joint probability value for i,j
-        double m_ij = GetJointDensity(i,j);
-        if(m_ij > 0)
-          loss += m_C(i,j) * m_ij;
+        loss += c_ij * m_ij;
         entropy -= m_ij < 1.e-15 ? 0.0 : m_ij * log(m_ij);
         mu0_test[i] -= m_ij;
         mu1_test[j] -= m_ij;
-        }
+        });
       }
 
     printf("Sinkhorn Iter %03d   MC: %8g   Entropy: %8g   Err0: %8g   Err1: %8g\n",
@@ -426,56 +630,353 @@ public:
   }
 
   /**
-   * Compute log-sum-exp for a single vector
+   * Sinkhorn iteration in log domain - slower but robust for small epsilon.
+   * Both passes are threaded, the rows are split between the threads in the
+   * horizontal pass and tiles of columns in the vertical pass
    */
-  double LogSumExp(vnl_vector<double> &x)
+  void IterateLogDomain()
   {
-    double xmax = x.max_value();
-    if(!std::isfinite(xmax))
-      xmax = 0.0;
+    unsigned int n0 = m_Source->triangles.size(), n1 = m_Target->triangles.size();
+    unsigned int n_threads = std::thread::hardware_concurrency();
+    const double *K = m_K.data_block();
 
-    double sum_exp = 0.0;
-    for(unsigned int j = 0; j < x.size(); j++)
-      sum_exp += exp(x[j] - xmax);
+    // First log-sum-exp pass - horizontal
+    qcqp::parallel_blocks(n0, n_threads, 16, [&](unsigned int, size_t i0, size_t i1)
+      {
+      for(size_t i = i0; i < i1; i++)
+        m_U0[i] = log(m_Mu0[i]) - row_log_sum_exp(m_U1.data_block(), K + (size_t) n1 * i, n1);
+      });
 
-    return log(sum_exp) + xmax;
+    // Second log-sum-exp pass - vertical
+    const unsigned int tile = 256;
+    size_t n_tiles = (n1 + tile - 1) / tile;
+    qcqp::parallel_blocks(n_tiles, n_threads, 1, [&](unsigned int, size_t t0, size_t t1)
+      {
+      double lse[tile];
+      for(size_t t = t0; t < t1; t++)
+        {
+        unsigned int j0 = t * tile, nt = std::min(tile, n1 - j0);
+        column_log_sum_exp(m_U0.data_block(), K, n0, n1, j0, nt, lse);
+        for(unsigned int k = 0; k < nt; k++)
+          m_U1[j0 + k] = log(m_Mu1[j0 + k]) - lse[k];
+        }
+      });
   }
 
 
   /**
-   * Sinkhorn iteration in log domain - fast but has numerical issues for small epsilon
+   * Sinkhorn iteration in log domain with the truncated kernel. The rows and
+   * the columns are updated in parallel
    */
-  void IterateLogDomain()
+  void IterateSparse()
   {
     unsigned int n0 = m_Source->triangles.size(), n1 = m_Target->triangles.size();
+    unsigned int n_threads = std::thread::hardware_concurrency();
 
-    // We need these temporary arrays
-    m_V0.set_size(n0);
-    m_V1.set_size(n1);
+    // Horizontal pass
+    qcqp::parallel_blocks(n0, n_threads, 256, [&](unsigned int, size_t i0, size_t i1)
+      {
+      for(size_t i = i0; i < i1; i++)
+        {
+        size_t q0 = m_SpRowPtr[i], q1 = m_SpRowPtr[i+1];
+        if(q0 == q1)
+          continue;
+
+        double vmax = -std::numeric_limits<double>::infinity();
+        for(size_t q = q0; q < q1; q++)
+          vmax = std::max(vmax, m_U1[m_SpCol[q]] + m_SpLogK[q]);
+
+        double sum_exp = 0.0;
+        for(size_t q = q0; q < q1; q++)
+          sum_exp += exp(m_U1[m_SpCol[q]] + m_SpLogK[q] - vmax);
+
+        m_U0[i] = log(m_Mu0[i]) - (log(sum_exp) + vmax);
+        }
+      });
+
+    // Vertical pass, visiting the entries through the column index
+    qcqp::parallel_blocks(n1, n_threads, 256, [&](unsigned int, size_t j0, size_t j1)
+      {
+      for(size_t j = j0; j < j1; j++)
+        {
+        size_t p0 = m_SpColPtr[j], p1 = m_SpColPtr[j+1];
+        if(p0 == p1)
+          continue;
+
+        double vmax = -std::numeric_limits<double>::infinity();
+        for(size_t p = p0; p < p1; p++)
+          {
+          size_t q = m_SpColEntries[p];
+          vmax = std::max(vmax, m_U0[m_SpRow[q]] + m_SpLogK[q]);
+          }
+
+        double sum_exp = 0.0;
+        for(size_t p = p0; p < p1; p++)
+          {
+          size_t q = m_SpColEntries[p];
+          sum_exp += exp(m_U0[m_SpRow[q]] + m_SpLogK[q] - vmax);
+          }
+
+        m_U1[j] = log(m_Mu1[j]) - (log(sum_exp) + vmax);
+        }
+      });
+  }
+
+  /** Compute the cost between source triangle i and target triangle j */
+  double ComputeCost(unsigned int i, unsigned int j, Mode mode, double alpha)
+  {
+    if(mode == CURRENTS_LIKE)
+      {
+      double dist = 0.0;
+      double cos_theta = 0.0;
+      for(unsigned int d = 0; d < 3; d++)
+        {
+        double del = m_ZSrcCenters[i][d] - m_ZTrgCenters[j][d];
+        dist += del * del;
+        cos_theta += m_ZSrcNormals[i][d] * m_ZTrgNormals[j][d];
+        }
+      return dist * (1.0 + alpha * (1.0 - cos_theta));
+      }
+    else
+      {
+      double dist = 0.0;
+      for(unsigned int d = 0; d < 3; d++)
+        {
+        double del_x = m_ZSrcCenters[i][d] - m_ZTrgCenters[j][d];
+        double del_n = m_ZSrcNormals[i][d] - m_ZTrgNormals[j][d];
+        dist += del_x * del_x + alpha * del_n * del_n;
+        }
+      return dist;
+      }
+  }
+
+  /**
+   * Build the truncated kernel for a given epsilon. An entry (i,j) is kept if
+   * the current potentials give it a transport of at least m_SparseTol, i.e.,
+   *   C_ij <= eps * (U0_i + U1_j - log(tol))
+   * Both costs are bounded below by the squared distance between the triangle
+   * centers, so the candidates for row i are found by a range query on a
+   * uniform grid of target centers. Rows and columns that would be empty get
+   * their best entry, so that the marginals can always be matched.
+   */
+  void BuildSparseKernel(Mode mode, double alpha, double eps)
+  {
+    unsigned int n0 = m_Source->triangles.size(), n1 = m_Target->triangles.size();
+    unsigned int n_threads = std::thread::hardware_concurrency();
+    double theta = -eps * log(m_SparseTol);
+    double u1_max = m_U1.max_value();
+
+    // Bounding box of the target centers
+    SMLVec3d bmin(std::numeric_limits<double>::max()), bmax(-std::numeric_limits<double>::max());
+    for(unsigned int j = 0; j < n1; j++)
+      for(unsigned int d = 0; d < 3; d++)
+        {
+        bmin[d] = std::min(bmin[d], m_ZTrgCenters[j][d]);
+        bmax[d] = std::max(bmax[d], m_ZTrgCenters[j][d]);
+        }
+
+    // The grid spacing is the query radius for zero potentials, but there
+    // should not be many more cells than target triangles
+    double h = std::max(sqrt(theta), 1.0e-6);
+    int dim[3];
+    while(true)
+      {
+      for(unsigned int d = 0; d < 3; d++)
+        dim[d] = 1 + (int) ((bmax[d] - bmin[d]) / h);
+      if((double) dim[0] * dim[1] * dim[2] <= 4.0 * n1 + 64)
+        break;
+      h *= 1.25;
+      }
+
+    // Sort the target triangles into the grid cells
+    auto cell_of = [&](const SMLVec3d &x, unsigned int d)
+      { return std::min(dim[d] - 1, std::max(0, (int) ((x[d] - bmin[d]) / h))); };
+    size_t n_cells = (size_t) dim[0] * dim[1] * dim[2];
+    std::vector<size_t> cell_ptr(n_cells + 1, 0), cell_trg(n1), trg_cell(n1);
+    for(unsigned int j = 0; j < n1; j++)
+      {
+      const SMLVec3d &y = m_ZTrgCenters[j];
+      trg_cell[j] = (cell_of(y, 2) * (size_t) dim[1] + cell_of(y, 1)) * dim[0] + cell_of(y, 0);
+      cell_ptr[trg_cell[j] + 1]++;
+      }
+    for(size_t c = 0; c < n_cells; c++)
+      cell_ptr[c+1] += cell_ptr[c];
+    std::vector<size_t> cell_fill(cell_ptr.begin(), cell_ptr.end() - 1);
+    for(unsigned int j = 0; j < n1; j++)
+      cell_trg[cell_fill[trg_cell[j]]++] = j;
+
+    // Find the entries of each row in parallel
+    std::vector< std::vector< std::pair<int, double> > > rows(n0);
+    qcqp::parallel_blocks(n0, n_threads, 64, [&](unsigned int, size_t i0, size_t i1)
+      {
+      for(size_t i = i0; i < i1; i++)
+        {
+        double r2 = theta + eps * (m_U0[i] + u1_max);
+        if(!(r2 >= 0.0))
+          continue;
+
+        double r = sqrt(r2);
+        const SMLVec3d &x = m_ZSrcCenters[i];
+        int c0[3], c1[3];
+        for(unsigned int d = 0; d < 3; d++)
+          {
+          c0[d] = std::max(0, (int) floor((x[d] - r - bmin[d]) / h));
+          c1[d] = std::min(dim[d] - 1, (int) floor((x[d] + r - bmin[d]) / h));
+          }
+
+        for(int cz = c0[2]; cz <= c1[2]; cz++)
+          for(int cy = c0[1]; cy <= c1[1]; cy++)
+            for(int cx = c0[0]; cx <= c1[0]; cx++)
+              {
+              size_t c = (cz * (size_t) dim[1] + cy) * dim[0] + cx;
+              for(size_t p = cell_ptr[c]; p < cell_ptr[c+1]; p++)
+                {
+                int j = cell_trg[p];
+                if(m_SourceLabels[i] != m_TargetLabels[j])
+                  continue;
+                double c_ij = ComputeCost(i, j, mode, alpha);
+                if(c_ij <= eps * (m_U0[i] + m_U1[j]) + theta)
+                  rows[i].push_back(std::make_pair(j, c_ij));
+                }
+              }
+        }
+      });
+
+    // Give empty rows their best entry
+    std::vector<char> col_used(n1, 0);
+    for(unsigned int i = 0; i < n0; i++)
+      for(auto &e : rows[i])
+        col_used[e.first] = 1;
 
-    // First log-sum-exp pass - horizontal
     for(unsigned int i = 0; i < n0; i++)
       {
-      double *k_row = m_K.data_block() + n1 * i;
+      if(rows[i].size())
+        continue;
+      int j_best = -1;
+      double v_best = 0.0, c_best = 0.0;
       for(unsigned int j = 0; j < n1; j++)
-        m_V1[j] = m_U1[j] + k_row[j];
-
-      // TODO: needless log computation
-      m_U0[i] = log(m_Mu0[i]) - LogSumExp(m_V1);
+        {
+        if(m_SourceLabels[i] != m_TargetLabels[j])
+          continue;
+        double c_ij = ComputeCost(i, j, mode, alpha);
+        double v = c_ij - eps * m_U1[j];
+        if(j_best < 0 || v < v_best)
+          { j_best = j; v_best = v; c_best = c_ij; }
+        }
+      if(j_best >= 0)
+        {
+        rows[i].push_back(std::make_pair(j_best, c_best));
+        col_used[j_best] = 1;
+        }
       }
 
-    // Second log-sum-exp pass - vertical
+    // Give empty columns their best entry
     for(unsigned int j = 0; j < n1; j++)
       {
-      // TODO: slow access into K
+      if(col_used[j])
+        continue;
+      int i_best = -1;
+      double v_best = 0.0, c_best = 0.0;
       for(unsigned int i = 0; i < n0; i++)
-        m_V0[i] = m_U0[i] + m_K(i,j);
+        {
+        if(m_SourceLabels[i] != m_TargetLabels[j])
+          continue;
+        double c_ij = ComputeCost(i, j, mode, alpha);
+        double v = c_ij - eps * m_U0[i];
+        if(i_best < 0 || v < v_best)
+          { i_best = i; v_best = v; c_best = c_ij; }
+        }
+      if(i_best >= 0)
+        rows[i_best].push_back(std::make_pair(j, c_best));
+      }
 
-      // TODO: needless log computation
-      m_U1[j] = log(m_Mu1[j]) - LogSumExp(m_V0);
+    // Store the kernel in CSR format, with sorted columns in each row
+    m_SpRowPtr.assign(n0 + 1, 0);
+    for(unsigned int i = 0; i < n0; i++)
+      {
+      std::sort(rows[i].begin(), rows[i].end());
+      m_SpRowPtr[i+1] = m_SpRowPtr[i] + rows[i].size();
       }
+
+    size_t nnz = m_SpRowPtr[n0];
+    m_SpRow.resize(nnz); m_SpCol.resize(nnz); m_SpC.resize(nnz); m_SpLogK.resize(nnz);
+    m_SpColPtr.assign(n1 + 1, 0);
+    for(unsigned int i = 0; i < n0; i++)
+      {
+      size_t q = m_SpRowPtr[i];
+      for(auto &e : rows[i])
+        {
+        m_SpRow[q] = i;
+        m_SpCol[q] = e.first;
+        m_SpC[q] = e.second;
+        m_SpLogK[q] = -e.second / eps;
+        m_SpColPtr[e.first + 1]++;
+        q++;
+        }
+      std::vector< std::pair<int, double> >().swap(rows[i]);
+      }
+
+    // Index of the entries in each column
+    for(unsigned int j = 0; j < n1; j++)
+      m_SpColPtr[j+1] += m_SpColPtr[j];
+    m_SpColEntries.resize(nnz);
+    std::vector<size_t> col_fill(m_SpColPtr.begin(), m_SpColPtr.end() - 1);
+    for(size_t q = 0; q < nnz; q++)
+      m_SpColEntries[col_fill[m_SpCol[q]]++] = q;
+
+    printf("Sparse Sinkhorn kernel (eps = %g): %zu entries, %.1f per source triangle\n",
+           eps, nnz, nnz * 1.0 / n0);
   }
 
+  /**
+   * Sinkhorn iteration with epsilon scaling and a truncated kernel
+   */
+  void PerformSparseIteration(Mode mode, double alpha, double eps,
+                              int max_iter, double tolerance, bool reset_starting_point)
+  {
+    // Start from zero potentials, or convert the previous scalings to the
+    // first epsilon level
+    double eps_level = eps * pow(m_EpsScalingFactor, m_EpsScalingLevels);
+    if(reset_starting_point || m_SparseEps <= 0.0)
+      {
+      m_U0.fill(0.0);
+      m_U1.fill(0.0);
+      }
+    else
+      {
+      m_U0 *= m_SparseEps / eps_level;
+      m_U1 *= m_SparseEps / eps_level;
+      }
+
+    itk::TimeProbe probe;
+    for(int level = m_EpsScalingLevels; level >= 0; level--)
+      {
+      BuildSparseKernel(mode, alpha, eps_level);
+      for(unsigned int iter = 0; iter < max_iter; iter++)
+        {
+        if(iter % 20 == 0)
+          if(PrintLoss(iter, tolerance))
+            break;
+
+        probe.Start();
+        this->IterateSparse();
+        probe.Stop();
+        }
+
+      // Go to the next finer level, keeping the potentials eps * U
+      m_SparseEps = eps_level;
+      if(level > 0)
+        {
+        eps_level /= m_EpsScalingFactor;
+        m_U0 *= m_EpsScalingFactor;
+        m_U1 *= m_EpsScalingFactor;
+        }
+      }
+
+    // The final kernel should reflect the converged potentials
+    BuildSparseKernel(mode, alpha, eps);
+    printf("Sinkhorn runtime: %8.4f ms per iteration\n", probe.GetMean() * 1000.0);
+  }
 
   /**
    * Perform Sinkhorn iteration
@@ -518,6 +1019,20 @@ public:
     // Compute the mass vectors mu and the initial scaling vectors u
     m_Mu0 = m_ZSrcAreas / m_ZSrcTotalArea;
 
+    // In sparse mode, the dense matrices are never formed
+    if(m_SparseTol > 0.0)
+      {
+      PerformSparseIteration(mode, alpha, eps, max_iter, tolerance, reset_starting_point);
+      return;
+      }
+
+    // Allocate the dense matrices
+    if(m_C.rows() != n0 || m_C.columns() != n1)
+      {
+      m_C.set_size(n0, n1);
+      m_K.set_size(n0, n1);
+      }
+
     // Compute the matrix K. TODO: this can be threaded
     for(unsigned int i = 0; i < n0; i++)
       {
@@ -536,29 +1051,7 @@ public:
           }
         else
           {
-          if(mode == CURRENTS_LIKE)
-            {
-            double dist = 0.0;
-            double cos_theta = 0.0;
-            for(unsigned int d = 0; d < 3; d++)
-              {
-              double del = m_ZSrcCenters[i][d] - m_ZTrgCenters[j][d];
-              dist += del * del;
-              cos_theta += m_ZSrcNormals[i][d] * m_ZTrgNormals[j][d];
-              }
-            m_C(i,j) = dist * (1.0 + alpha * (1.0 - cos_theta));
-            }
-          else
-            {
-            double dist = 0.0;
-            for(unsigned int d = 0; d < 3; d++)
-              {
-              double del_x = m_ZSrcCenters[i][d] - m_ZTrgCenters[j][d];
-              double del_n = m_ZSrcNormals[i][d] - m_ZTrgNormals[j][d];
-              dist += del_x * del_x + alpha * del_n * del_n;
-              }
-            m_C(i,j) = dist;
-            }
+          m_C(i,j) = ComputeCost(i, j, mode, alpha);
 
           // What we store in K depends on whether we use the log-domain implementation or not
           m_K(i,j) = m_LogDomain ? -m_C(i,j) / eps : exp(-m_C(i,j) / eps);
@@ -596,21 +1089,18 @@ public:
   /** Compute the matched target locations for source faces */
   void ComputeTriangleCenterMatches(std::vector<SMLVec3d> &XMatches)
     {
-    unsigned int n0 = m_Source->triangles.size(), n1 = m_Target->triangles.size();
+    unsigned int n0 = m_Source->triangles.size();
     XMatches.resize(n0);
     for(unsigned int i = 0; i < n0; i++)
       {
       SMLVec3d match(0.0);
       double mass = 0.0;
-      for(unsigned int j = 0; j < n1; j++)
+      ForEachTransport(i, [&](int j, double, double m_ij)
         {
-        // Compute the actual joint probability value for i,j
-        double m_ij = GetJointDensity(i,j);
-
         // Use as weight against target centers
         match += m_ij * m_ZTrgCenters[j];
         mass += m_ij;
-        }
+        });
 
       XMatches[i] = match * (m_TrgScale / mass) + m_TrgCenter;
       }
@@ -639,7 +1129,7 @@ protected:
   vnl_matrix<double> m_C, m_K;
 
   // The mass vectors and the scaling vectors
-  vnl_vector<double> m_Mu0, m_Mu1, m_U0, m_U1, m_V0, m_V1;
+  vnl_vector<double> m_Mu0, m_Mu1, m_U0, m_U1;
 
   // The mode used for the cost computation
   Mode m_Mode = CURRENTS_LIKE;
@@ -649,6 +1139,21 @@ protected:
 
   // First run of perform iteration
   bool m_LogDomain;
+
+  // Truncation threshold for the sparse kernel (zero for dense kernel)
+  double m_SparseTol;
+
+  // Epsilon scaling for the sparse kernel, and the epsilon of the current
+  // scaling vectors
+  int m_EpsScalingLevels = 3;
+  double m_EpsScalingFactor = 2.0, m_SparseEps = 0.0;
+
+  // The truncated kernel in CSR format. For each entry, the source and target
+  // triangles, the cost and the log of the kernel are stored. The entries of
+  // each column are listed in m_SpColEntries for the vertical pass
+  std::vector<size_t> m_SpRowPtr, m_SpColPtr, m_SpColEntries;
+  std::vector<int> m_SpRow, m_SpCol;
+  std::vector<double> m_SpC, m_SpLogK;
 };
 
 
@@ -2082,6 +2587,10 @@ int usage()
       "                                   mean sharper point to point assignments (0.04) \n"
       "  -omt-eps-anneal                : For OMT, epsilon annealing factor for the Sinkhorn algorithm (1.0)\n"
       "  -omt-log-domain                : For OMT, perform Sinkhorn iteration in log domain (slower, more robust)\n"
+      "  -omt-sparse tol                : For OMT, truncate the Sinkhorn kernel to entries where the transport\n"
+      "                                   plan exceeds tol (e.g., 1e-12). Uses much less memory for large meshes\n"
+      "  -omt-eps-scaling N             : For OMT with -omt-sparse, number of coarser epsilon levels to run\n"
+      "                                   before the target epsilon (3)\n"
       "  -omt-quad                      : For OMT, use the alternative quadratic formula, which has fewer \n"
       "                                   optimization variables but seems more adhoc compared to currents"
       "  -omt-match-labels              : When matching triangles between shapes, require them to have the same label\n"
@@ -2122,6 +2631,8 @@ struct RegularizationOptions
 
   double OMTAlpha = 0.5, OMTEpsilon = 0.04, OMTEpsilonAnneal = 1.0;
   bool OMTQuadratic = false, OMTFlipNormal = false, OMTLogDomain = false;
+  double OMTSparseTol = 0.0;
+  int OMTEpsScalingLevels = 3;
 
   bool OMTMatchLabels = false;
 
@@ -2901,7 +3412,6 @@ void BCMRepQuadraticProblemBuilder::BuildFacesLeastSquaresObjective(const std::v
 void BCMRepQuadraticProblemBuilder::BuildOMTObjective(SinkhornIteration &si)
 {
   int n0 = bmesh->triangles.size();
-  int n1 = si.m_U1.size();
 
   // The objective is of the form |X_i - Y_j|^2 * (1 + alpha - alpha <N_i,M_j>)
   // where X,N are the model triangle centers and normals, and Y,M are the target
@@ -2963,12 +3473,10 @@ void BCMRepQuadraticProblemBuilder::BuildOMTObjective(SinkhornIteration &si)
       vnl_vector_fixed<double, 3> w_Xd(0.0), w_XXd(0.0), w_Nq(0.0);
       vnl_matrix_fixed<double, 3, 3> w_XXd_Nq(0.0), w_Xd_Nq(0.0);
 
-      // Compute these sums going over the target triangles
+      // Compute these sums going over the target triangles that receive mass
       double mass_i = 0.0;
-      for(int j = 0; j < n1; j++)
+      si.ForEachTransport(i, [&](int j, double c_ij, double gamma_ij)
         {
-        // Get the transport probability between i and j
-        double gamma_ij = si.GetJointDensity(i, j);
         mass_i += gamma_ij;
 
         // Get the target triangle center in native coordinates
@@ -2990,8 +3498,8 @@ void BCMRepQuadraticProblemBuilder::BuildOMTObjective(SinkhornIteration &si)
           }
 
         // Add the expected value
-        loss_exp_value += gamma_ij * si.m_C(i,j) * si.m_TrgScale * si.m_TrgScale;
-        }
+        loss_exp_value += gamma_ij * c_ij * si.m_TrgScale * si.m_TrgScale;
+        });
 
       // Time to assign weights to all the variables. However, since the weights for the X's above
       // refer to the triangle centers, each weight has to be distributed among the vertices
@@ -3067,12 +3575,10 @@ void BCMRepQuadraticProblemBuilder::BuildOMTObjective(SinkhornIteration &si)
       // Scaling factor for the normals
       double n_scale = si.m_Alpha * si.m_TrgScale * si.m_TrgScale;
 
-      // Compute these sums going over the target triangles
+      // Compute these sums going over the target triangles that receive mass
       double mass_i = 0.0;
-      for(int j = 0; j < n1; j++)
+      si.ForEachTransport(i, [&](int j, double c_ij, double gamma_ij)
         {
-        // Get the transport probability between i and j
-        double gamma_ij = si.GetJointDensity(i,j);
         mass_i += gamma_ij;
 
         // Get the target triangle center in native coordinates
@@ -3091,8 +3597,8 @@ void BCMRepQuadraticProblemBuilder::BuildOMTObjective(SinkhornIteration &si)
           }
 
         // Add the expected value
-        loss_exp_value += gamma_ij * si.m_C(i,j) * si.m_TrgScale * si.m_TrgScale;
-        }
+        loss_exp_value += gamma_ij * c_ij * si.m_TrgScale * si.m_TrgScale;
+        });
 
       // Time to assign weights to all the variables. However, since the weights for the X's above
       // refer to the triangle centers, each weight has to be distributed among the vertices
@@ -3498,6 +4004,14 @@ int main(int argc, char *argv[])
       {
       regOpts.OMTLogDomain = true;
       }
+    else if(cmd == "-omt-sparse")
+      {
+      regOpts.OMTSparseTol = atof(argv[++p]);
+      }
+    else if(cmd == "-omt-eps-scaling")
+      {
+      regOpts.OMTEpsScalingLevels = atoi(argv[++p]);
+      }
     else if(cmd == "-omt-match-labels")
       {
       regOpts.OMTMatchLabels = true;
@@ -3889,7 +4403,9 @@ int main(int argc, char *argv[])
       // Generate the Sinkhorn object
       sinkhorn = std::shared_ptr<SinkhornIteration>(
             new SinkhornIteration(&tmpl.bmesh, target_mesh.get(),
-                                  x_target, regOpts.OMTFlipNormal, regOpts.OMTLogDomain));
+                                  x_target, regOpts.OMTFlipNormal, regOpts.OMTLogDomain,
+                                  regOpts.OMTSparseTol));
+      sinkhorn->SetEpsilonScaling(regOpts.OMTEpsScalingLevels);
 
       // Get the target labels
       if(regOpts.OMTMatchLabels)
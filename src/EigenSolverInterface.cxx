@@ -17,10 +17,15 @@ class EigenSolverInterfaceInternal
 {
 public:
 
+  EigenSolverInterfaceInternal(bool spd) : m_SPD(spd) {}
+
   void SetMatrix(size_t n, TIndex *idxRows, TIndex *idxCols, double *xMatrix)
   {
     int nnz = idxRows[n];
+    if(m_SparseMatrix)
+      delete m_SparseMatrix;
     m_SparseMatrix = new SparseMap(n, n, nnz, idxRows, idxCols, xMatrix);
+    m_PatternAnalyzed = false;
   }
 
   void UpdateMatrix(double *xMatrix)
@@ -38,7 +43,26 @@ public:
 
   void Compute()
   {
-    m_Solver.compute(*m_SparseMatrix);
+    if(m_SPD)
+      {
+      // The upper triangle in CSR order is the lower triangle in CSC order,
+      // so the same arrays can be passed to the Cholesky solver as is
+      SymmetricMap lower(m_SparseMatrix->rows(), m_SparseMatrix->cols(), m_SparseMatrix->nonZeros(),
+                         m_SparseMatrix->outerIndexPtr(), m_SparseMatrix->innerIndexPtr(),
+                         m_SparseMatrix->valuePtr());
+
+      // The non-zero structure does not change between numeric factorizations
+      if(!m_PatternAnalyzed)
+        {
+        m_SymmetricSolver.analyzePattern(lower);
+        m_PatternAnalyzed = true;
+        }
+      m_SymmetricSolver.factorize(lower);
+      }
+    else
+      {
+      m_Solver.compute(*m_SparseMatrix);
+      }
   }
 
   void Solve(unsigned int nRHS, double *xRHS, double *xSoln)
@@ -47,7 +71,10 @@ public:
     for(unsigned int i = 0; i < nRHS; i++)
       {
       Eigen::Map<Eigen::VectorXd> mapRHS(xRHS + i * n, n), mapSoln(xSoln + i * n, n);
-      mapSoln = m_Solver.solve(mapRHS);
+      if(m_SPD)
+        mapSoln = m_SymmetricSolver.solve(mapRHS);
+      else
+        mapSoln = m_Solver.solve(mapRHS);
       }
   }
 
@@ -62,7 +89,13 @@ private:
   typedef Eigen::Map<SparseType> SparseMap;
   SparseMap *m_SparseMatrix = nullptr;
 
-// TODO: handle symmetric matrices!
+  // Symmetric positive definite matrices are passed in as the upper triangle
+  // (same convention as PARDISO) and factored with sparse LDLT
+  typedef Eigen::SparseMatrix<double, Eigen::ColMajor, TIndex> SymmetricType;
+  typedef Eigen::Map<SymmetricType> SymmetricMap;
+  Eigen::SimplicialLDLT<SymmetricType, Eigen::Lower> m_SymmetricSolver;
+  bool m_SPD, m_PatternAnalyzed = false;
+
 #ifdef HAVE_MKL
   Eigen::PardisoLU<SparseType> m_Solver;
 #else
@@ -74,7 +107,7 @@ EigenSolverInterface
 ::EigenSolverInterface(ProblemType ptype)
 : m_Type(ptype)
 {
-  m_InternalSolver = new EigenSolverInterfaceInternal<int>;
+  m_InternalSolver = new EigenSolverInterfaceInternal<int>(ptype == SPD);
 }
 
 void
@@ -88,7 +121,7 @@ EigenSolverInterface
     }
   if(m_ColIndex)
     {
-    delete [] m_RowIndex;
+    delete [] m_ColIndex;
     m_ColIndex = nullptr;
     }
 }
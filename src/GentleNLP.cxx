@@ -1,5 +1,9 @@
 #include "GentleNLP.h"
+#include "MedialException.h"
 #include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <unordered_map>
 
 namespace gnlp
 {
@@ -55,11 +59,8 @@ Expression *Problem::GetPartialDerivative(Expression *ex, Variable *v)
 
 void Problem::MakeChildrenDirty()
 {
-  for(ExpressionSet::iterator it = m_ChildExpressions.begin();
-      it != m_ChildExpressions.end(); it++)
-    {
-    (*it)->MakeDirty();
-    }
+  // Cached values from earlier generations are treated as dirty
+  m_Generation++;
 }
 
 void Problem::ClearDerivativeCaches()
@@ -175,6 +176,53 @@ Expression::Expression(Problem *problem)
   m_Problem->AddChildExpression(this);
 }
 
+void Expression::DifferentiateFromOperands(const double *, double *grad, double *hess)
+{
+  // The default EvaluateFromOperands() ignores the operand values, so the
+  // derivatives come from the symbolic partial derivatives. These are with
+  // respect to variables, so every operand must be a variable, and the tape
+  // has already set the variables to the operand values
+  int n = this->GetNumberOfOperands();
+  std::vector<Variable *> vars(n);
+  std::vector<bool> first(n, true);
+  for(int i = 0; i < n; i++)
+    {
+    vars[i] = dynamic_cast<Variable *>(this->GetOperand(i));
+    if(!vars[i])
+      throw MedialModelException(
+          "External expression has non-variable operands, but does not implement DifferentiateFromOperands");
+
+    // A repeated variable gets the whole derivative at its first occurrence
+    for(int k = 0; k < i; k++)
+      if(vars[k] == vars[i])
+        first[i] = false;
+    }
+
+  std::vector<Expression *> d(n, NULL);
+  for(int i = 0; i < n; i++)
+    {
+    if(first[i])
+      d[i] = m_Problem->GetPartialDerivative(this, vars[i]);
+    if(d[i])
+      d[i]->MakeTreeDirty();
+    grad[i] = d[i] ? d[i]->Evaluate() : 0.0;
+    }
+
+  if(!hess)
+    return;
+
+  for(int i = 0; i < n; i++)
+    {
+    for(int j = 0; j <= i; j++)
+      {
+      Expression *dd = (d[i] && first[j]) ? m_Problem->GetPartialDerivative(d[i], vars[j]) : NULL;
+      if(dd)
+        dd->MakeTreeDirty();
+      hess[i * n + j] = hess[j * n + i] = dd ? dd->Evaluate() : 0.0;
+      }
+    }
+}
+
 Expression * Variable::MakePartialDerivative(Variable *variable)
 {
   // If the derivative is zero, this should not be created!
@@ -660,6 +708,577 @@ Expression *TriangleTwiceAreaSqr(Problem *p, const VarVec &a, const VarVec &b, c
 }
 
 
+/******************************************************************
+  Expression tape
+  *****************************************************************/
+void ExpressionTape::Compile(const std::vector<Expression *> &outputs, bool separate)
+{
+  // A node of the graph after merging common subexpressions. The operands
+  // of each node are stored as node indices in the array args
+  struct Node
+    {
+    OpCode op;
+    int first_arg, n_args;
+    double k;
+    Expression *ex;
+    };
+
+  std::vector<Node> nodes;
+  std::vector<int> args;
+
+  // Node assigned to each expression, and node with each signature. The
+  // signature is the operation, the scalar and the operand nodes
+  typedef std::vector<int64_t> Signature;
+  typedef std::map<Signature, int> SignatureMap;
+  std::unordered_map<Expression *, int> node_of;
+  SignatureMap node_of_sig;
+
+  // When the outputs are separate, the operations added for an output are
+  // forgotten before moving on to the next one. The variables of each
+  // output and its range of nodes are recorded
+  std::vector<Expression *> added_ex;
+  std::vector<SignatureMap::iterator> added_sig;
+  std::vector<int> seg_first_node(outputs.size() + 1, 0), seg_vars, seg_var_start;
+
+  // Depth-first traversal, in which an expression is added after its
+  // operands. The stack holds the expression and the next operand to visit
+  std::vector< std::pair<Expression *, int> > stack;
+  m_OutputSlots.clear();
+  for(unsigned int i = 0; i < outputs.size(); i++)
+    {
+    seg_first_node[i] = nodes.size();
+    seg_var_start.push_back(seg_vars.size());
+    if(!outputs[i])
+      {
+      if(separate)
+        m_OutputSlots.push_back(-1);
+      continue;
+      }
+
+    if(!node_of.count(outputs[i]))
+      stack.push_back(std::make_pair(outputs[i], 0));
+
+    while(stack.size())
+      {
+      Expression *e = stack.back().first;
+      int next = stack.back().second;
+      if(next < e->GetNumberOfOperands())
+        {
+        stack.back().second++;
+        Expression *child = e->GetOperand(next);
+        if(!node_of.count(child))
+          stack.push_back(std::make_pair(child, 0));
+        continue;
+        }
+
+      stack.pop_back();
+      if(node_of.count(e))
+        continue;
+
+      Node node;
+      node.op = e->GetOpCode();
+      node.ex = e;
+      node.first_arg = args.size();
+      node.n_args = e->GetNumberOfOperands();
+      node.k = 0.0;
+      for(int j = 0; j < node.n_args; j++)
+        args.push_back(node_of[e->GetOperand(j)]);
+
+      if(node.op == OP_CONSTANT)
+        node.k = e->Evaluate();
+      else if(node.op == OP_SCALE)
+        node.k = static_cast<ScalarProduct *>(e)->GetScalar();
+
+      // Operands of commutative binary operations are sorted
+      if((node.op == OP_PLUS || node.op == OP_PRODUCT) && args[node.first_arg] > args[node.first_arg+1])
+        std::swap(args[node.first_arg], args[node.first_arg+1]);
+
+      bool leaf = (node.op == OP_VARIABLE || node.op == OP_CONSTANT);
+
+      // Variables and external expressions are never merged
+      if(node.op != OP_VARIABLE && node.op != OP_EXTERNAL)
+        {
+        Signature sig(2 + node.n_args);
+        sig[0] = node.op;
+        memcpy(&sig[1], &node.k, sizeof(double));
+        for(int j = 0; j < node.n_args; j++)
+          sig[2+j] = args[node.first_arg + j];
+
+        std::pair<SignatureMap::iterator, bool> ret =
+            node_of_sig.insert(std::make_pair(sig, (int) nodes.size()));
+        if(!ret.second)
+          {
+          args.resize(node.first_arg);
+          node_of[e] = ret.first->second;
+          if(separate && !leaf)
+            added_ex.push_back(e);
+          continue;
+          }
+
+        if(separate && !leaf)
+          added_sig.push_back(ret.first);
+        }
+
+      node_of[e] = nodes.size();
+      nodes.push_back(node);
+      if(separate && !leaf)
+        added_ex.push_back(e);
+      }
+
+    if(separate)
+      {
+      // Collect the variables used by the nodes of this output
+      int out = node_of[outputs[i]];
+      if(nodes[out].op == OP_VARIABLE)
+        seg_vars.push_back(out);
+      for(unsigned int q = seg_first_node[i]; q < nodes.size(); q++)
+        for(int j = 0; j < nodes[q].n_args; j++)
+          if(nodes[args[nodes[q].first_arg + j]].op == OP_VARIABLE)
+            seg_vars.push_back(args[nodes[q].first_arg + j]);
+      std::sort(seg_vars.begin() + seg_var_start[i], seg_vars.end());
+      seg_vars.erase(std::unique(seg_vars.begin() + seg_var_start[i], seg_vars.end()), seg_vars.end());
+
+      // The output node must be found before its operations are forgotten
+      m_OutputSlots.push_back(out);
+      for(unsigned int q = 0; q < added_ex.size(); q++)
+        node_of.erase(added_ex[q]);
+      for(unsigned int q = 0; q < added_sig.size(); q++)
+        node_of_sig.erase(added_sig[q]);
+      added_ex.clear();
+      added_sig.clear();
+      }
+    }
+  seg_first_node[outputs.size()] = nodes.size();
+  seg_var_start.push_back(seg_vars.size());
+
+  // Assign positions in the value array, first to the variables, then to
+  // the constants (including zero for NULL outputs) and then to the rest
+  std::vector<int> slot(nodes.size(), -1);
+  std::vector<double> constants;
+  m_Variables.clear();
+  for(unsigned int i = 0; i < nodes.size(); i++)
+    {
+    if(nodes[i].op == OP_VARIABLE)
+      {
+      slot[i] = m_Variables.size();
+      m_Variables.push_back(static_cast<Variable *>(nodes[i].ex));
+      }
+    }
+
+  for(unsigned int i = 0; i < nodes.size(); i++)
+    {
+    if(nodes[i].op == OP_CONSTANT)
+      {
+      slot[i] = m_Variables.size() + constants.size();
+      constants.push_back(nodes[i].k);
+      }
+    }
+
+  int zero_slot = m_Variables.size() + constants.size();
+  constants.push_back(0.0);
+  m_FirstInstruction = m_Variables.size() + constants.size();
+
+  // Generate the instructions, keeping track of where each node starts
+  m_Instructions.clear();
+  m_OperandLists.clear();
+  m_External.clear();
+  std::vector<int> first_ins(nodes.size() + 1);
+  unsigned int max_external_operands = 0;
+  for(unsigned int i = 0; i < nodes.size(); i++)
+    {
+    first_ins[i] = m_Instructions.size();
+    const Node &node = nodes[i];
+    if(node.op == OP_VARIABLE || node.op == OP_CONSTANT)
+      continue;
+
+    Instruction ins;
+    ins.op = node.op;
+    ins.k = node.k;
+    ins.a = ins.b = ins.c = -1;
+    if(node.op == OP_BIGSUM || node.op == OP_EXTERNAL)
+      {
+      ins.a = m_OperandLists.size();
+      ins.b = node.n_args;
+      for(int j = 0; j < node.n_args; j++)
+        m_OperandLists.push_back(slot[args[node.first_arg + j]]);
+
+      if(node.op == OP_EXTERNAL)
+        {
+        ins.c = m_External.size();
+        m_External.push_back(node.ex);
+        max_external_operands = std::max(max_external_operands, (unsigned int) node.n_args);
+        }
+      }
+    else
+      {
+      int *ops[] = { &ins.a, &ins.b, &ins.c };
+      for(int j = 0; j < node.n_args; j++)
+        *ops[j] = slot[args[node.first_arg + j]];
+      }
+
+    slot[i] = m_FirstInstruction + m_Instructions.size();
+    m_Instructions.push_back(ins);
+    }
+  first_ins[nodes.size()] = m_Instructions.size();
+
+  // Initialize the value array
+  m_Values.assign(m_FirstInstruction + m_Instructions.size(), 0.0);
+  std::copy(constants.begin(), constants.end(), m_Values.begin() + m_Variables.size());
+  m_ExternalOperands.resize(std::max(3u, max_external_operands));
+
+  // Locate the outputs
+  if(separate)
+    {
+    m_Segments.resize(outputs.size());
+    m_SegmentVariables.resize(seg_vars.size());
+    for(unsigned int i = 0; i < outputs.size(); i++)
+      {
+      Segment &seg = m_Segments[i];
+      seg.first_ins = first_ins[seg_first_node[i]];
+      seg.end_ins = first_ins[seg_first_node[i+1]];
+      seg.first_var = seg_var_start[i];
+      seg.n_vars = seg_var_start[i+1] - seg_var_start[i];
+      for(int j = seg.first_var; j < seg.first_var + seg.n_vars; j++)
+        m_SegmentVariables[j] = slot[seg_vars[j]];
+
+      seg.linear = true;
+      for(int q = seg.first_ins; q < seg.end_ins; q++)
+        {
+        OpCode op = m_Instructions[q].op;
+        if(op != OP_NEGATE && op != OP_SCALE && op != OP_PLUS && op != OP_MINUS
+           && op != OP_SUM3 && op != OP_BIGSUM)
+          seg.linear = false;
+        }
+
+      m_OutputSlots[i] = outputs[i] ? slot[m_OutputSlots[i]] : zero_slot;
+      }
+    }
+  else
+    {
+    m_Segments.clear();
+    m_SegmentVariables.clear();
+    m_OutputSlots.resize(outputs.size());
+    for(unsigned int i = 0; i < outputs.size(); i++)
+      m_OutputSlots[i] = outputs[i] ? slot[node_of[outputs[i]]] : zero_slot;
+    }
+
+  // Work arrays for the derivatives
+  unsigned int n_work = separate ? m_Values.size() : 0;
+  m_Adjoints.assign(n_work, 0.0);
+  m_Tangents.assign(n_work, 0.0);
+  m_SecondAdjoints.assign(n_work, 0.0);
+}
+
+void ExpressionTape::Evaluate()
+{
+  double *v = m_Values.data();
+  for(unsigned int i = 0; i < m_Variables.size(); i++)
+    v[i] = m_Variables[i]->GetValue();
+
+  // Instruction i writes r[i], and its operands are earlier entries of v
+  double *r = v + m_FirstInstruction;
+  const Instruction *ins = m_Instructions.data();
+  for(unsigned int i = 0; i < m_Instructions.size(); i++, ins++)
+    {
+    switch(ins->op)
+      {
+      case OP_NEGATE:
+        r[i] = NegateOperatorTraits::Operate(v[ins->a]); break;
+      case OP_SQUARE:
+        r[i] = SquareOperatorTraits::Operate(v[ins->a]); break;
+      case OP_SQRT:
+        r[i] = SquareRootOperatorTraits::Operate(v[ins->a]); break;
+      case OP_COS:
+        r[i] = CosOperatorTraits::Operate(v[ins->a]); break;
+      case OP_SIN:
+        r[i] = SinOperatorTraits::Operate(v[ins->a]); break;
+      case OP_SCALE:
+        r[i] = ins->k * v[ins->a]; break;
+      case OP_PLUS:
+        r[i] = PlusOperatorTraits::Operate(v[ins->a], v[ins->b]); break;
+      case OP_MINUS:
+        r[i] = MinusOperatorTraits::Operate(v[ins->a], v[ins->b]); break;
+      case OP_PRODUCT:
+        r[i] = ProductOperatorTraits::Operate(v[ins->a], v[ins->b]); break;
+      case OP_RATIO:
+        r[i] = RatioOperatorTraits::Operate(v[ins->a], v[ins->b]); break;
+      case OP_GRADMAG3:
+        r[i] = GradientMagnitude3Traits::Operate(v[ins->a], v[ins->b], v[ins->c]); break;
+      case OP_GRADMAGSQR3:
+        r[i] = GradientMagnitudeSqr3Traits::Operate(v[ins->a], v[ins->b], v[ins->c]); break;
+      case OP_SUM3:
+        r[i] = SumOperator3Traits::Operate(v[ins->a], v[ins->b], v[ins->c]); break;
+      case OP_PRODUCT3:
+        r[i] = ProductOperator3Traits::Operate(v[ins->a], v[ins->b], v[ins->c]); break;
+      case OP_BIGSUM:
+        {
+        const int *op = m_OperandLists.data() + ins->a;
+        double val = 0;
+        for(int j = 0; j < ins->b; j++)
+          val += v[op[j]];
+        r[i] = val;
+        break;
+        }
+      case OP_EXTERNAL:
+        {
+        const int *op = m_OperandLists.data() + ins->a;
+        for(int j = 0; j < ins->b; j++)
+          m_ExternalOperands[j] = v[op[j]];
+        r[i] = m_External[ins->c]->EvaluateFromOperands(m_ExternalOperands.data());
+        break;
+        }
+      default:
+        break;
+      }
+    }
+}
+
+void ExpressionTape::GetOutputs(double *out) const
+{
+  for(unsigned int i = 0; i < m_OutputSlots.size(); i++)
+    out[i] = m_Values[m_OutputSlots[i]];
+}
+
+int ExpressionTape::GetOperands(const Instruction &ins, int *buf, const int *&ops) const
+{
+  if(ins.op == OP_BIGSUM || ins.op == OP_EXTERNAL)
+    {
+    ops = m_OperandLists.data() + ins.a;
+    return ins.b;
+    }
+
+  buf[0] = ins.a; buf[1] = ins.b; buf[2] = ins.c;
+  ops = buf;
+  return (ins.op <= OP_SCALE) ? 1 : ((ins.op <= OP_RATIO) ? 2 : 3);
+}
+
+void ExpressionTape::ReverseSweep(unsigned int i, bool second_order)
+{
+  const Segment &seg = m_Segments[i];
+  const double *v = m_Values.data();
+  double *adj = m_Adjoints.data();
+  int buf[3];
+  const int *ops;
+
+  // Partial derivatives of each instruction with respect to its operands,
+  // n first derivatives followed by n*n second derivatives. Sums have no
+  // stored partials, since they are all equal to one
+  m_PartialOffsets.resize(seg.end_ins - seg.first_ins);
+  m_Partials.clear();
+  double *x = m_ExternalOperands.data();
+  for(int q = seg.first_ins; q < seg.end_ins; q++)
+    {
+    const Instruction &ins = m_Instructions[q];
+    int n = this->GetOperands(ins, buf, ops);
+    m_PartialOffsets[q - seg.first_ins] = m_Partials.size();
+    if(ins.op == OP_BIGSUM)
+      continue;
+
+    m_Partials.resize(m_Partials.size() + (second_order ? n + n * n : n), 0.0);
+    double *d = m_Partials.data() + m_PartialOffsets[q - seg.first_ins];
+    double *dd = second_order ? d + n : NULL;
+    for(int j = 0; j < n; j++)
+      x[j] = v[ops[j]];
+    double r = v[m_FirstInstruction + q];
+
+    switch(ins.op)
+      {
+      case OP_NEGATE:
+        d[0] = -1.0; break;
+      case OP_SQUARE:
+        d[0] = 2 * x[0];
+        if(dd) dd[0] = 2.0;
+        break;
+      case OP_SQRT:
+        d[0] = 0.5 / r;
+        if(dd) dd[0] = -0.25 / (r * r * r);
+        break;
+      case OP_COS:
+        d[0] = -sin(x[0]);
+        if(dd) dd[0] = -r;
+        break;
+      case OP_SIN:
+        d[0] = cos(x[0]);
+        if(dd) dd[0] = -r;
+        break;
+      case OP_SCALE:
+        d[0] = ins.k; break;
+      case OP_PLUS:
+        d[0] = 1.0; d[1] = 1.0; break;
+      case OP_MINUS:
+        d[0] = 1.0; d[1] = -1.0; break;
+      case OP_PRODUCT:
+        d[0] = x[1]; d[1] = x[0];
+        if(dd) dd[1] = dd[2] = 1.0;
+        break;
+      case OP_RATIO:
+        {
+        double ib = 1.0 / x[1];
+        d[0] = ib; d[1] = -r * ib;
+        if(dd) { dd[1] = dd[2] = -ib * ib; dd[3] = 2 * r * ib * ib; }
+        break;
+        }
+      case OP_GRADMAG3:
+        for(int j = 0; j < 3; j++)
+          d[j] = x[j] / r;
+        for(int j = 0; dd && j < 3; j++)
+          for(int l = 0; l < 3; l++)
+            dd[3 * j + l] = ((j == l ? 1.0 : 0.0) - d[j] * d[l]) / r;
+        break;
+      case OP_GRADMAGSQR3:
+        for(int j = 0; j < 3; j++)
+          {
+          d[j] = 2 * x[j];
+          if(dd) dd[4 * j] = 2.0;
+          }
+        break;
+      case OP_SUM3:
+        d[0] = d[1] = d[2] = 1.0; break;
+      case OP_PRODUCT3:
+        d[0] = x[1] * x[2]; d[1] = x[0] * x[2]; d[2] = x[0] * x[1];
+        if(dd)
+          {
+          dd[1] = dd[3] = x[2];
+          dd[2] = dd[6] = x[1];
+          dd[5] = dd[7] = x[0];
+          }
+        break;
+      case OP_EXTERNAL:
+        m_External[ins.c]->DifferentiateFromOperands(x, d, dd);
+        break;
+      default:
+        break;
+      }
+    }
+
+  // First order adjoints. The adjoints of constants are accumulated too,
+  // but they are never used
+  const int *vars = m_SegmentVariables.data() + seg.first_var;
+  for(int j = 0; j < seg.n_vars; j++)
+    adj[vars[j]] = 0.0;
+  for(int q = seg.first_ins; q < seg.end_ins; q++)
+    adj[m_FirstInstruction + q] = 0.0;
+  adj[m_OutputSlots[i]] = 1.0;
+
+  for(int q = seg.end_ins - 1; q >= seg.first_ins; q--)
+    {
+    const Instruction &ins = m_Instructions[q];
+    double a = adj[m_FirstInstruction + q];
+    int n = this->GetOperands(ins, buf, ops);
+    if(ins.op == OP_BIGSUM)
+      {
+      for(int j = 0; j < n; j++)
+        adj[ops[j]] += a;
+      }
+    else
+      {
+      const double *d = m_Partials.data() + m_PartialOffsets[q - seg.first_ins];
+      for(int j = 0; j < n; j++)
+        adj[ops[j]] += a * d[j];
+      }
+    }
+}
+
+void ExpressionTape::SecondOrderSweep(unsigned int i, const double *dir, double *hv)
+{
+  const Segment &seg = m_Segments[i];
+  const double *adj = m_Adjoints.data();
+  double *t = m_Tangents.data(), *s = m_SecondAdjoints.data();
+  const int *vars = m_SegmentVariables.data() + seg.first_var;
+  int buf[3];
+  const int *ops;
+
+  // Forward propagation of the direction
+  for(int j = 0; j < seg.n_vars; j++)
+    {
+    t[vars[j]] = dir[j];
+    s[vars[j]] = 0.0;
+    }
+
+  for(int q = seg.first_ins; q < seg.end_ins; q++)
+    {
+    const Instruction &ins = m_Instructions[q];
+    int n = this->GetOperands(ins, buf, ops);
+    double tq = 0.0;
+    if(ins.op == OP_BIGSUM)
+      {
+      for(int j = 0; j < n; j++)
+        tq += t[ops[j]];
+      }
+    else
+      {
+      const double *d = m_Partials.data() + m_PartialOffsets[q - seg.first_ins];
+      for(int j = 0; j < n; j++)
+        tq += d[j] * t[ops[j]];
+      }
+    t[m_FirstInstruction + q] = tq;
+    s[m_FirstInstruction + q] = 0.0;
+    }
+
+  // Backward propagation of the adjoints of the tangents
+  for(int q = seg.end_ins - 1; q >= seg.first_ins; q--)
+    {
+    const Instruction &ins = m_Instructions[q];
+    double a = adj[m_FirstInstruction + q], sq = s[m_FirstInstruction + q];
+    int n = this->GetOperands(ins, buf, ops);
+    if(ins.op == OP_BIGSUM)
+      {
+      for(int j = 0; j < n; j++)
+        s[ops[j]] += sq;
+      continue;
+      }
+
+    const double *d = m_Partials.data() + m_PartialOffsets[q - seg.first_ins];
+    const double *dd = d + n;
+    for(int j = 0; j < n; j++)
+      {
+      double h = 0.0;
+      for(int l = 0; l < n; l++)
+        h += dd[j * n + l] * t[ops[l]];
+      s[ops[j]] += sq * d[j] + a * h;
+      }
+    }
+
+  for(int j = 0; j < seg.n_vars; j++)
+    hv[j] = s[vars[j]];
+}
+
+void ExpressionTape::Gradient(unsigned int i, double *grad)
+{
+  this->ReverseSweep(i, false);
+  const int *vars = m_SegmentVariables.data() + m_Segments[i].first_var;
+  for(int j = 0; j < m_Segments[i].n_vars; j++)
+    grad[j] = m_Adjoints[vars[j]];
+}
+
+void ExpressionTape::HessianVectorProduct(unsigned int i, const double *dir, double *hv)
+{
+  this->ReverseSweep(i, true);
+  this->SecondOrderSweep(i, dir, hv);
+}
+
+void ExpressionTape::Hessian(unsigned int i, double *hess, double *grad)
+{
+  this->ReverseSweep(i, true);
+  int n = m_Segments[i].n_vars;
+  if(grad)
+    {
+    const int *vars = m_SegmentVariables.data() + m_Segments[i].first_var;
+    for(int j = 0; j < n; j++)
+      grad[j] = m_Adjoints[vars[j]];
+    }
+
+  // One Hessian-vector product for each variable
+  m_Direction.assign(n, 0.0);
+  for(int k = 0; k < n; k++)
+    {
+    m_Direction[k] = 1.0;
+    this->SecondOrderSweep(i, m_Direction.data(), hess + k * n);
+    m_Direction[k] = 0.0;
+    }
+}
+
+
 /******************************************************************
   Generic Constrained PRoblem STUFF
   *****************************************************************/
@@ -723,246 +1342,365 @@ void ConstrainedNonLinearProblem
   m_F = ex;
 }
 
-struct counter {
-  int value;
-  operator int () const { return value; }
-  counter &operator ++() { value ++; return *this; }
-  counter() : value(0) {}
-};
-
-double TestCentralDifference(Expression *ex, Variable *v, double delta=1e-5)
+void ConstrainedNonLinearProblem
+::SplitIntoElements(Expression *ex, int owner, std::vector<Element> &elements)
 {
-  double val = v->Evaluate();
-
-  // Do the perturbation
-  ex->MakeTreeDirty();
-  v->SetValue(val + delta);
-    double f2 = ex->Evaluate();
+  if(!ex)
+    return;
 
-  ex->MakeTreeDirty();
-  v->SetValue(val - delta);
-  double f1 = ex->Evaluate();
+  // Walk down through sums, differences, negations and scalar products,
+  // keeping track of the weight of each term. Repeated terms are merged
+  std::map<Expression *, double> weight;
+  std::vector<Expression *> terms;
+  std::vector< std::pair<Expression *, double> > stack(1, std::make_pair(ex, 1.0));
+  while(stack.size())
+    {
+    Expression *e = stack.back().first;
+    double w = stack.back().second;
+    stack.pop_back();
 
-  v->SetValue(val);
+    switch(e->GetOpCode())
+      {
+      case OP_PLUS:
+      case OP_SUM3:
+      case OP_BIGSUM:
+        for(int j = e->GetNumberOfOperands() - 1; j >= 0; j--)
+          stack.push_back(std::make_pair(e->GetOperand(j), w));
+        break;
+      case OP_MINUS:
+        stack.push_back(std::make_pair(e->GetOperand(1), -w));
+        stack.push_back(std::make_pair(e->GetOperand(0), w));
+        break;
+      case OP_NEGATE:
+        stack.push_back(std::make_pair(e->GetOperand(0), -w));
+        break;
+      case OP_SCALE:
+        stack.push_back(std::make_pair(e->GetOperand(0), w * static_cast<ScalarProduct *>(e)->GetScalar()));
+        break;
+      default:
+        {
+        std::pair<std::map<Expression *, double>::iterator, bool> ret =
+            weight.insert(std::make_pair(e, w));
+        if(ret.second)
+          terms.push_back(e);
+        else
+          ret.first->second += w;
+        }
+      }
+    }
 
-  return (f2 - f1) / (2 * delta);
+  for(unsigned int i = 0; i < terms.size(); i++)
+    {
+    Element el;
+    el.ex = terms[i];
+    el.weight = weight[terms[i]];
+    el.owner = owner;
+    if(el.weight != 0.0)
+      elements.push_back(el);
+    }
 }
 
-void TestDeriv(Problem *p, Expression *ex, Variable *v, Expression *deriv, std::string what)
+void ConstrainedNonLinearProblem
+::GetElementVariables(const ExpressionTape &tape, unsigned int e, std::vector<int> &idx)
 {
-  if(deriv) deriv->MakeTreeDirty();
-  double dAnalytic = deriv ? deriv->Evaluate() : 0.0;
-  double dNumeric = TestCentralDifference(ex, v);
-  double diffAbs = fabs(dAnalytic - dNumeric);
-  double diffRel = 2 * (dAnalytic - dNumeric) / fabs(dAnalytic + dNumeric);
-  if(diffAbs > 1e-6)
+  unsigned int n = tape.GetNumberOfSegmentVariables(e);
+  const int *vars = tape.GetSegmentVariables(e);
+  idx.resize(n);
+  for(unsigned int k = 0; k < n; k++)
     {
-    std::cout << "--- BAD DERIVATIVE in " << what << " --- " << std::endl;
-    std::cout << "EXPRESSION: " << ex->GetName() << std::endl;
-    std::cout << "VARIABLE:" << v->GetName() << std::endl;
-    std::cout << "DERIVATIVE" << v->GetName() << std::endl;
-    std::cout << "NUMERIC: "<< dNumeric << std::endl;
-    std::cout << "ANALYTC: "<< dAnalytic << std::endl;
-    std::cout << "DIFFERN: "<< diffAbs << std::endl;
+    Variable *v = tape.GetVariables()[vars[k]];
+    int iv = v->GetIndex();
+    idx[k] = (iv >= 0 && iv < (int) m_X.size() && m_X[iv] == v) ? iv : -1;
     }
 }
 
+// Position of an entry in a sparse matrix whose rows have sorted columns
+static int FindSparseIndex(const ImmutableSparseMatrix<double> &M, int row, int col)
+{
+  const size_t *ci = M.GetColIndex();
+  return std::lower_bound(ci + M.GetRowIndex()[row], ci + M.GetRowIndex()[row+1], (size_t) col) - ci;
+}
+
 void ConstrainedNonLinearProblem
-::SetupProblem(bool hessian, bool deriv_test)
+::MapElements(const std::vector<Element> &elements, const ExpressionTape &tape,
+              std::vector<int> &var_map, std::vector<int> &hess_map,
+              std::vector<int> &offsets, bool jacobian, bool hessian)
 {
-  typedef std::set<Variable *> VarSet;
+  var_map.clear();
+  hess_map.clear();
+  offsets.clear();
 
-  // Only a single initialization is allowed!
-  m_GradF.clear();
+  std::vector<int> idx;
+  for(unsigned int e = 0; e < elements.size(); e++)
+    {
+    offsets.push_back(var_map.size());
+    offsets.push_back(hess_map.size());
 
-  // This is where all the work takes place. This function is responsible to
-  // set up the Jacobian and Hessian matrices
+    this->GetElementVariables(tape, e, idx);
+    int n = idx.size();
+    for(int k = 0; k < n; k++)
+      {
+      if(jacobian && idx[k] >= 0)
+        var_map.push_back(FindSparseIndex(m_DG, elements[e].owner, idx[k]));
+      else
+        var_map.push_back(idx[k]);
+      }
 
-  // Start with the gradient
-  for(int i = 0; i < m_X.size(); i++)
-    {
-    m_GradF.push_back(this->GetPartialDerivative(m_F, m_X[i]));
-    if(deriv_test)
-      TestDeriv(this, m_F, m_X[i], m_GradF.back(), "Objective");
+    // Only the lower triangle of the Hessian is stored
+    if(hessian && !tape.IsSegmentLinear(e))
+      {
+      for(int k = 0; k < n; k++)
+        for(int l = 0; l < n; l++)
+          hess_map.push_back((idx[k] >= 0 && idx[l] >= 0 && idx[k] >= idx[l])
+                             ? FindSparseIndex(m_Hessian, idx[k], idx[l]) : -1);
+      }
     }
 
-  // Now the Jacobian of G
-  std::cout << "Computing Jacobian entries" << std::endl;
-  SparseExpressionMatrix::STLSourceType stl_DG;
+  offsets.push_back(var_map.size());
+  offsets.push_back(hess_map.size());
+}
+
+void ConstrainedNonLinearProblem
+::SetupProblem(bool hessian, bool deriv_test)
+{
+  // The objective and the constraints are split into elements, and each
+  // element is compiled into its own segment of a tape. All derivatives are
+  // computed on the tapes, so no derivative expressions are created
+  m_ElementsF.clear();
+  m_ElementsG.clear();
+  SplitIntoElements(m_F, 0, m_ElementsF);
   for(int j = 0; j < m_G.size(); j++)
+    SplitIntoElements(m_G[j], j, m_ElementsG);
+
+  std::vector<Expression *> ex;
+  for(unsigned int e = 0; e < m_ElementsF.size(); e++)
+    ex.push_back(m_ElementsF[e].ex);
+  m_TapeF.Compile(ex, true);
+
+  ex.clear();
+  for(unsigned int e = 0; e < m_ElementsG.size(); e++)
+    ex.push_back(m_ElementsG[e].ex);
+  m_TapeG.Compile(ex, true);
+
+  // The Jacobian has an entry for each variable of each element of a
+  // constraint, and the Hessian has an entry for each pair of variables of
+  // each non-linear element
+  std::vector< std::vector<int> > jac_rows(m_G.size()), hess_rows(m_X.size());
+  std::vector<int> idx;
+  unsigned int max_vars = 0;
+  for(int pass = 0; pass < 2; pass++)
     {
-    // Find the dependent variables of the constraint
-    const Dependency &vars = this->GetDependentVariables(m_G[j]);
-
-    // Create a row for the sparse matrix
-    SparseExpressionMatrix::STLRowType stl_row;
-
-    // For each dependent variable, create a sparse entry.
-    for(Dependency::const_iterator it = vars.begin(); it != vars.end(); it++)
+    const std::vector<Element> &elements = pass ? m_ElementsG : m_ElementsF;
+    const ExpressionTape &tape = pass ? m_TapeG : m_TapeF;
+    for(unsigned int e = 0; e < elements.size(); e++)
       {
-      Variable *v = *it;
-      Expression *dg_dv = this->GetPartialDerivative(m_G[j], v);
-      if(dg_dv)
-        stl_row.push_back(std::make_pair(v->GetIndex(), dg_dv));
-      if(deriv_test)
-        TestDeriv(this, m_G[j], v, dg_dv, "Constraints");
+      this->GetElementVariables(tape, e, idx);
+      max_vars = std::max(max_vars, (unsigned int) idx.size());
+      for(unsigned int k = 0; k < idx.size(); k++)
+        {
+        if(idx[k] < 0)
+          continue;
+        if(pass)
+          jac_rows[elements[e].owner].push_back(idx[k]);
+        if(hessian && !tape.IsSegmentLinear(e))
+          for(unsigned int l = 0; l < idx.size(); l++)
+            if(idx[l] >= 0 && idx[l] <= idx[k])
+              hess_rows[idx[k]].push_back(idx[l]);
+        }
       }
-
-    // Add the row
-    stl_DG.push_back(stl_row);
-
-    if((j+1) % 50 == 0)
-      std::cout << "." << std::flush;
-    if((j+1) % 4000 == 0)
-      std::cout << " " << (j+1) << std::endl;
     }
 
-  std::cout << std::endl;
+  SparseRealMatrix::STLSourceType stl_DG(m_G.size()), stl_H(m_X.size());
+  for(int pass = 0; pass < 2; pass++)
+    {
+    std::vector< std::vector<int> > &rows = pass ? hess_rows : jac_rows;
+    SparseRealMatrix::STLSourceType &stl = pass ? stl_H : stl_DG;
+    for(unsigned int r = 0; r < rows.size(); r++)
+      {
+      std::sort(rows[r].begin(), rows[r].end());
+      rows[r].erase(std::unique(rows[r].begin(), rows[r].end()), rows[r].end());
+      for(unsigned int k = 0; k < rows[r].size(); k++)
+        stl[r].push_back(std::make_pair(rows[r][k], 0.0));
+      std::vector<int>().swap(rows[r]);
+      }
+    }
 
-  // Form a proper sparse matrix from the STL construct
   m_DG.SetFromSTL(stl_DG, m_X.size());
+  m_Hessian.SetFromSTL(stl_H, m_X.size());
 
-  // Now, for the trickiest part, we need the Hessian! To build it up, we
-  // need a different data structure: a map from row/col pair to Expression
-  typedef std::pair<int, int> IndexPair;
-  typedef std::map<IndexPair, Expression *> SparseMap;
-  SparseMap Hmap;
+  // Map the element derivatives to the sparse matrices
+  this->MapElements(m_ElementsF, m_TapeF, m_GradMapF, m_HessMapF, m_OffsetsF, false, hessian);
+  this->MapElements(m_ElementsG, m_TapeG, m_JacMapG, m_HessMapG, m_OffsetsG, true, hessian);
+  m_ElementGrad.resize(max_vars);
+  m_ElementHess.resize(hessian ? max_vars * max_vars : 0);
 
-  if(!hessian)
-    return;
+  std::cout << "Compiled tapes: "
+            << "F: " << m_ElementsF.size() << " elements, "
+            << m_TapeF.GetNumberOfInstructions() << " instructions;  "
+            << "G: " << m_ElementsG.size() << " elements, "
+            << m_TapeG.GetNumberOfInstructions() << " instructions" << std::endl;
+  std::cout << "Non-zeros: "
+            << "Jacobian: " << m_DG.GetNumberOfSparseValues()
+            << "  Hessian: " << m_Hessian.GetNumberOfSparseValues() << std::endl;
 
-  // Keep track of hessian entries
-  double nSecondDeriv = 0;
-  std::map<int, counter> histDepth, histSize;
+  if(deriv_test)
+    this->TestDerivatives(hessian);
+}
 
-  // We begin by adding entries from the objective function
-  std::cout << "Computing Hessian entries" << std::endl;
-  for(int i = 0; i < m_X.size(); i++)
+void ConstrainedNonLinearProblem::TestDerivatives(bool hessian)
+{
+  unsigned int n = m_X.size(), m = m_G.size();
+  const double delta = 1e-5;
+
+  // Gradient of the Lagrangean, which is used to test the Hessian
+  std::vector<double> df(n), dg(m_DG.GetNumberOfSparseValues());
+  auto lagrangean_gradient = [&](std::vector<double> &lg)
+    {
+    this->EvaluateObjectiveGradient(df.data());
+    this->EvaluateConstraintsJacobian(dg.data());
+    lg.assign(n, 0.0);
+    for(unsigned int i = 0; i < n; i++)
+      lg[i] = m_SigmaF->GetValue() * df[i];
+    for(unsigned int j = 0; j < m; j++)
+      for(SparseRealMatrix::RowIterator it = m_DG.Row(j); !it.IsAtEnd(); ++it)
+        lg[it.Column()] += m_Lambda[j]->GetValue() * dg[it.SparseIndex()];
+    };
+
+  // Second derivatives are tested against differences of first derivatives,
+  // so they get a larger tolerance
+  auto report = [](const std::string &what, int row, int col, double analytic, double numeric)
     {
-    Expression *df = m_GradF[i];
-    if(df)
+    double tol = (what == "Hessian") ? 1e-4 : 1e-6;
+    if(fabs(analytic - numeric) > tol)
       {
-      const Dependency &depvar = this->GetDependentVariables(df);
-      for(Dependency::const_iterator it = depvar.begin(); it != depvar.end(); it++)
-        {
-        Variable *v = *it;
-        if(v->GetIndex() <= i)   // Hessian must be lower triangular!
-          {
-          IndexPair idx = std::make_pair(i, v->GetIndex());
-          BigSum *sum = new BigSum(this);
-          Hmap[idx] = sum;
-
-          Expression *ddf = this->GetPartialDerivative(df, v);
-
-          if(deriv_test)
-            TestDeriv(this, df, v, ddf, "Hessian-F");
-
-          if(ddf)
-            {
-            sum->AddSummand(MakeProduct(this, ddf, m_SigmaF));
-
-            // Do some stats on the hessian entries
-            nSecondDeriv++;
-            int depth, size;
-            ddf->GetTreeStats(depth, size);
-            ++histDepth[depth];
-            ++histSize[size];
-            if(depth > 1)
-              {
-              std::cout << ddf->GetName() << std::endl;
-              }
-            }
-          }
-        }
+      std::cout << "--- BAD DERIVATIVE in " << what << " --- " << std::endl;
+      std::cout << "ENTRY: " << row << ", " << col << std::endl;
+      std::cout << "NUMERIC: "<< numeric << std::endl;
+      std::cout << "ANALYTC: "<< analytic << std::endl;
+      std::cout << "DIFFERN: "<< fabs(analytic - numeric) << std::endl;
       }
-    if((i+1) % 50 == 0)
-      std::cout << "." << std::flush;
-    if((i+1) % 4000 == 0)
-      std::cout << " " << (i+1) << std::endl;
-    }
-  std::cout << std::endl;
+    };
 
-  // Now add entries for each of the constraints
-  for(int j = 0; j < m_G.size(); j++)
+  std::vector<double> h(m_Hessian.GetNumberOfSparseValues()), lg, lg1, lg2;
+  std::vector<double> df0(n), dg0(dg.size()), g1(m), g2(m);
+  this->EvaluateObjectiveGradient(df0.data());
+  this->EvaluateConstraintsJacobian(dg0.data());
+  if(hessian)
+    this->EvaluateHessianOfLagrangean(h.data());
+
+  for(unsigned int i = 0; i < n; i++)
     {
-    // Iterate over all partial derivatives of G
-    for(SparseExpressionMatrix::RowIterator rit = m_DG.Row(j); !rit.IsAtEnd(); ++rit)
+    double x = m_X[i]->GetValue();
+    m_X[i]->SetValue(x + delta);
+    double f2 = this->EvaluateObjective();
+    this->EvaluateConstraints(g2.data());
+    if(hessian)
+      lagrangean_gradient(lg2);
+
+    m_X[i]->SetValue(x - delta);
+    double f1 = this->EvaluateObjective();
+    this->EvaluateConstraints(g1.data());
+    if(hessian)
+      lagrangean_gradient(lg1);
+
+    m_X[i]->SetValue(x);
+
+    report("Objective", 0, i, df0[i], (f2 - f1) / (2 * delta));
+    for(unsigned int j = 0; j < m; j++)
       {
-      Expression *dg = rit.Value();
-      int row = rit.Column(); // Column in DG = Row in the hessian matrix
+      int k = FindSparseIndex(m_DG, j, i);
+      bool found = k < (int) m_DG.GetRowIndex()[j+1] && m_DG.GetColIndex()[k] == i;
+      report("Constraints", j, i, found ? dg0[k] : 0.0, (g2[j] - g1[j]) / (2 * delta));
+      }
 
-      const Dependency &depvar = this->GetDependentVariables(dg);
-      for(Dependency::const_iterator it = depvar.begin(); it != depvar.end(); it++)
-        {
-        Variable *v = *it;
-        if(v->GetIndex() <= row)   // Hessian must be lower triangular!
-          {
-          IndexPair idx = std::make_pair(row, v->GetIndex());
-          std::pair<SparseMap::iterator, bool> ret =
-              Hmap.insert(std::make_pair(idx, (BigSum *) NULL));
-
-          if(ret.second)
-            {
-            // Actual insertion took place
-            ret.first->second = new BigSum(this);
-            }
-
-          BigSum *sum = (BigSum *) ret.first->second;
-
-          Expression *ddg = this->GetPartialDerivative(dg, v);
-          if(deriv_test)
-            TestDeriv(this, dg, v, ddg, "Hessian-G");
-          if(ddg)
-            {
-            // Do some stats on the hessian entries
-            nSecondDeriv++;
-            int depth, size;
-            ddg->GetTreeStats(depth, size);
-            ++histDepth[depth];
-            ++histSize[size];
-
-            sum->AddSummand(MakeProduct(this, m_Lambda[j], ddg));
-
-            if(depth > 1)
-              {
-              std::cout << "DERIV ISSUE" << std::endl;
-              std::cout << "Con = " << m_G[j]->GetName() << std::endl;
-              std::cout << "Var1 =  " << m_X[row]->GetName() << std::endl;
-              std::cout << "Var2 =  " << v->GetName() << std::endl;
-              std::cout << ddg->GetName() << std::endl;
-              }
-            }
-          }
-        }
+    for(unsigned int r = 0; hessian && r < n; r++)
+      {
+      int row = std::max(r, i), col = std::min(r, i);
+      int k = FindSparseIndex(m_Hessian, row, col);
+      bool found = k < (int) m_Hessian.GetRowIndex()[row+1] && m_Hessian.GetColIndex()[k] == col;
+      report("Hessian", r, i, found ? h[k] : 0.0, (lg2[r] - lg1[r]) / (2 * delta));
       }
-    if((j+1) % 50 == 0)
-      std::cout << "." << std::flush;
-    if((j+1) % 4000 == 0)
-      std::cout << " " << (j+1) << std::endl;
     }
+}
 
-  std::cout << " " << std::endl;
-  std::cout << "Hessian Histogram" << std::endl;
-  std::cout << "  total entries = " << nSecondDeriv << std::endl;
-  std::cout << "  depth histo: " << std::endl;
-  for(std::map<int, counter>::const_iterator ith = histDepth.begin(); ith!=histDepth.end(); ith++)
-    std::cout << "\t" << ith->first << "\t" << (int) ith->second << std::endl;
-  std::cout << "  size histo: " << std::endl;
-  for(std::map<int, counter>::const_iterator ith = histSize.begin(); ith!=histSize.end(); ith++)
-    std::cout << "\t" << ith->first << "\t" << (int) ith->second << std::endl;
-
-  // Now we need to populate a sparse matrix
-  SparseExpressionMatrix::STLSourceType stl_H;
-  stl_H.resize(m_X.size());
-  for(SparseMap::iterator it = Hmap.begin(); it != Hmap.end(); it++)
-    {
-    int row = it->first.first;
-    int col = it->first.second;
-    Expression *ex = it->second;
-    stl_H[row].push_back(std::make_pair(col, ex));
+double ConstrainedNonLinearProblem::EvaluateObjective()
+{
+  m_TapeF.Evaluate();
+  double f = 0.0;
+  for(unsigned int e = 0; e < m_ElementsF.size(); e++)
+    f += m_ElementsF[e].weight * m_TapeF.GetOutput(e);
+  return f;
+}
+
+void ConstrainedNonLinearProblem::EvaluateObjectiveGradient(double *df)
+{
+  std::fill(df, df + m_X.size(), 0.0);
+  m_TapeF.Evaluate();
+  for(unsigned int e = 0; e < m_ElementsF.size(); e++)
+    {
+    m_TapeF.Gradient(e, m_ElementGrad.data());
+    double w = m_ElementsF[e].weight;
+    for(int k = m_OffsetsF[2*e]; k < m_OffsetsF[2*e+2]; k++)
+      if(m_GradMapF[k] >= 0)
+        df[m_GradMapF[k]] += w * m_ElementGrad[k - m_OffsetsF[2*e]];
     }
+}
 
-  m_Hessian.SetFromSTL(stl_H, m_X.size());
+void ConstrainedNonLinearProblem::EvaluateConstraints(double *g)
+{
+  std::fill(g, g + m_G.size(), 0.0);
+  m_TapeG.Evaluate();
+  for(unsigned int e = 0; e < m_ElementsG.size(); e++)
+    g[m_ElementsG[e].owner] += m_ElementsG[e].weight * m_TapeG.GetOutput(e);
+}
+
+void ConstrainedNonLinearProblem::EvaluateConstraintsJacobian(double *values)
+{
+  std::fill(values, values + m_DG.GetNumberOfSparseValues(), 0.0);
+  m_TapeG.Evaluate();
+  for(unsigned int e = 0; e < m_ElementsG.size(); e++)
+    {
+    m_TapeG.Gradient(e, m_ElementGrad.data());
+    double w = m_ElementsG[e].weight;
+    for(int k = m_OffsetsG[2*e]; k < m_OffsetsG[2*e+2]; k++)
+      if(m_JacMapG[k] >= 0)
+        values[m_JacMapG[k]] += w * m_ElementGrad[k - m_OffsetsG[2*e]];
+    }
+}
+
+void ConstrainedNonLinearProblem
+::AccumulateHessians(const std::vector<Element> &elements, ExpressionTape &tape,
+                     const std::vector<int> &hess_map, const std::vector<int> &offsets,
+                     const double *owner_scale, double *values)
+{
+  tape.Evaluate();
+  for(unsigned int e = 0; e < elements.size(); e++)
+    {
+    double w = elements[e].weight * owner_scale[elements[e].owner];
+    if(w == 0.0 || tape.IsSegmentLinear(e))
+      continue;
+
+    tape.Hessian(e, m_ElementHess.data());
+    const int *map = hess_map.data() + offsets[2*e+1];
+    int nn = offsets[2*e+3] - offsets[2*e+1];
+    for(int k = 0; k < nn; k++)
+      if(map[k] >= 0)
+        values[map[k]] += w * m_ElementHess[k];
+    }
+}
+
+void ConstrainedNonLinearProblem::EvaluateHessianOfLagrangean(double *values)
+{
+  std::fill(values, values + m_Hessian.GetNumberOfSparseValues(), 0.0);
+
+  // The objective is scaled by sigma and each constraint by its lambda
+  double sigma = m_SigmaF->GetValue();
+  std::vector<double> lambda(m_Lambda.size());
+  for(unsigned int j = 0; j < m_Lambda.size(); j++)
+    lambda[j] = m_Lambda[j]->GetValue();
+
+  this->AccumulateHessians(m_ElementsF, m_TapeF, m_HessMapF, m_OffsetsF, &sigma, values);
+  this->AccumulateHessians(m_ElementsG, m_TapeG, m_HessMapG, m_OffsetsG, lambda.data(), values);
 }
 
 void ConstrainedNonLinearProblem::SetGradientSmoothingKernel(SparseRealMatrix K)
@@ -16,6 +16,20 @@ namespace gnlp
 class Expression;
 class Variable;
 
+/**
+  Codes for the operations performed by expressions. These are used to
+  compile expressions into an ExpressionTape. Expressions that the tape
+  does not know how to compute have the code OP_EXTERNAL.
+ */
+enum OpCode
+{
+  OP_VARIABLE, OP_CONSTANT,
+  OP_NEGATE, OP_SQUARE, OP_SQRT, OP_COS, OP_SIN, OP_SCALE,
+  OP_PLUS, OP_MINUS, OP_PRODUCT, OP_RATIO,
+  OP_GRADMAG3, OP_GRADMAGSQR3, OP_SUM3, OP_PRODUCT3,
+  OP_BIGSUM, OP_EXTERNAL
+};
+
 
 /**
   A representation of a non-linear problem.
@@ -26,7 +40,7 @@ public:
   typedef std::set<Variable *> Dependency;
   typedef std::set<Expression *> ExpressionSet;
 
-  Problem() {}
+  Problem() : m_Generation(0) {}
   virtual ~Problem();
 
   /** Get the set of dependent variables for a given registered expression.
@@ -48,9 +62,14 @@ public:
     child expression is deleted. */
   void AddChildExpression(Expression *);
 
-  /** Dirty all the child expressions */
+  /** Dirty all the child expressions. This does not visit the expressions,
+    it just increments the generation counter, and cached values from older
+    generations are recomputed on the next call to Evaluate() */
   void MakeChildrenDirty();
 
+  /** Get the generation counter */
+  unsigned long GetGeneration() const { return m_Generation; }
+
   /** Get the set of all stored expressions */
   const ExpressionSet& GetChildExpressions() { return m_ChildExpressions; }
 
@@ -74,6 +93,9 @@ protected:
   // List of dependencies for each expression
   typedef std::map<Expression *, Dependency> DependencyMap;
   DependencyMap m_DependencyMap;
+
+  // Generation counter, incremented whenever the variables change
+  unsigned long m_Generation;
 };
 
 /**
@@ -123,6 +145,27 @@ public:
   virtual int GetNumberOfOperands() const = 0;
   virtual Expression* GetOperand(int i) const = 0;
 
+  /** Get the operation performed by the expression (see ExpressionTape) */
+  virtual OpCode GetOpCode() const { return OP_EXTERNAL; }
+
+  /** Compute the value of the expression given the values of its operands.
+    This is called by ExpressionTape for OP_EXTERNAL expressions. The default
+    implementation ignores the operand values and evaluates the tree */
+  virtual double EvaluateFromOperands(const double *operands)
+  {
+    this->MakeTreeDirty();
+    return this->Evaluate();
+  }
+
+  /** Compute the first and second partial derivatives of the expression with
+    respect to its n operands, given the operand values. The arrays grad and
+    hess hold n and n*n values, and hess may be NULL. This is called by
+    ExpressionTape for OP_EXTERNAL expressions. The default implementation
+    evaluates the symbolic partial derivatives from MakePartialDerivative(),
+    which requires the operands to be variables. Expressions that override
+    EvaluateFromOperands() should override this method as well */
+  virtual void DifferentiateFromOperands(const double *operands, double *grad, double *hess);
+
 protected:
 
   // The problem that owns this expression
@@ -142,6 +185,7 @@ public:
       m_Value(0), m_IndexInProblem(-1) {}
 
   void SetValue(double value) { m_Value = value; }
+  double GetValue() const { return m_Value; }
   std::string GetName() { return m_Name; }
 
   void SetIndex(int value) { m_Index = value; }
@@ -166,6 +210,7 @@ public:
 
   virtual int GetNumberOfOperands() const { return 0; }
   virtual Expression* GetOperand(int i) const { return NULL; }
+  virtual OpCode GetOpCode() const { return OP_VARIABLE; }
 
 protected:
   std::string m_Name;
@@ -200,6 +245,7 @@ public:
 
   virtual int GetNumberOfOperands() const { return 0; }
   virtual Expression* GetOperand(int i)  const { return NULL; }
+  virtual OpCode GetOpCode() const { return OP_CONSTANT; }
 
 protected:
   double m_Value;
@@ -210,15 +256,16 @@ class CachingExpression : public Expression
 {
 public:
   CachingExpression(Problem *parent)
-    : Expression(parent), m_Value(0.0), m_Dirty(true) {}
+    : Expression(parent), m_Value(0.0), m_Dirty(true), m_Generation(0) {}
 
   /** Evaluate returns cached value if possible */
   virtual double Evaluate()
   {
-    if(m_Dirty)
+    if(m_Dirty || m_Generation != m_Problem->GetGeneration())
       {
       m_Value = this->ComputeValue();
       m_Dirty = false;
+      m_Generation = m_Problem->GetGeneration();
       }
     return m_Value;
   }
@@ -238,11 +285,15 @@ protected:
 
   // Whether the cached value is valid
   bool m_Dirty;
+
+  // The generation of the problem when the value was cached
+  unsigned long m_Generation;
 };
 
 class NegateOperatorTraits
 {
 public:
+  static const OpCode Code = OP_NEGATE;
   static double Operate(double a) { return -a; }
   static Expression *Differentiate(Problem *p, Expression *self,
                                    Expression *a, Expression *dA);
@@ -252,6 +303,7 @@ public:
 class SquareOperatorTraits
 {
 public:
+  static const OpCode Code = OP_SQUARE;
   static double Operate(double a) { return a * a; }
   static Expression *Differentiate(Problem *p, Expression *self,
                                    Expression *a, Expression *dA);
@@ -261,6 +313,7 @@ public:
 class SquareRootOperatorTraits
 {
 public:
+  static const OpCode Code = OP_SQRT;
   static double Operate(double a) { return sqrt(a); }
   static Expression *Differentiate(Problem *p, Expression *self,
                                    Expression *a, Expression *dA);
@@ -270,6 +323,7 @@ public:
 class CosOperatorTraits
 {
 public:
+  static const OpCode Code = OP_COS;
   static double Operate(double a) { return cos(a); }
   static Expression *Differentiate(Problem *p, Expression *self,
                                    Expression *a, Expression *dA);
@@ -279,6 +333,7 @@ public:
 class SinOperatorTraits
 {
 public:
+  static const OpCode Code = OP_SIN;
   static double Operate(double a) { return sin(a); }
   static Expression *Differentiate(Problem *p, Expression *self,
                                    Expression *a, Expression *dA);
@@ -321,8 +376,7 @@ public:
 
   virtual int GetNumberOfOperands() const { return 1; }
   virtual Expression* GetOperand(int i) const { return i == 0 ? m_A : NULL; }
-
-
+  virtual OpCode GetOpCode() const { return TOperatorTraits::Code; }
 
 protected:
   Expression *m_A;
@@ -366,6 +420,7 @@ public:
 
   virtual int GetNumberOfOperands() const { return 1; }
   virtual Expression* GetOperand(int i) const { return i == 0 ? m_A : NULL; }
+  virtual OpCode GetOpCode() const { return OP_SCALE; }
 
   double GetScalar() { return m_Const; }
 
@@ -380,6 +435,7 @@ protected:
 class PlusOperatorTraits
 {
 public:
+  static const OpCode Code = OP_PLUS;
   static double Operate(double a, double b) { return a + b; }
   static Expression *Differentiate(Problem *p, Expression *self,
                                    Expression *a, Expression *b,
@@ -390,6 +446,7 @@ public:
 class MinusOperatorTraits
 {
 public:
+  static const OpCode Code = OP_MINUS;
   static double Operate(double a, double b) { return a - b; }
   static Expression *Differentiate(Problem *p, Expression *self,
                                    Expression *a, Expression *b,
@@ -400,6 +457,7 @@ public:
 class ProductOperatorTraits
 {
 public:
+  static const OpCode Code = OP_PRODUCT;
   static double Operate(double a, double b) { return a * b; }
   static Expression *Differentiate(Problem *p, Expression *self,
                                    Expression *a, Expression *b,
@@ -410,6 +468,7 @@ public:
 class RatioOperatorTraits
 {
 public:
+  static const OpCode Code = OP_RATIO;
   static double Operate(double a, double b) { return a / b; }
   static Expression *Differentiate(Problem *p, Expression *self,
                                    Expression *a, Expression *b,
@@ -471,6 +530,8 @@ public:
       }
   }
 
+  virtual OpCode GetOpCode() const { return TOperatorTraits::Code; }
+
 protected:
   Expression *m_A, *m_B;
 
@@ -485,6 +546,7 @@ typedef BinaryExpression<RatioOperatorTraits> BinaryFraction;
 class GradientMagnitude3Traits
 {
 public:
+  static const OpCode Code = OP_GRADMAG3;
   static double Operate(double a, double b, double c)
   {
     return sqrt(a*a + b*b + c*c);
@@ -500,6 +562,7 @@ public:
 class GradientMagnitudeSqr3Traits
 {
 public:
+  static const OpCode Code = OP_GRADMAGSQR3;
   static double Operate(double a, double b, double c)
   {
     return a*a + b*b + c*c;
@@ -515,6 +578,7 @@ public:
 class SumOperator3Traits
 {
 public:
+  static const OpCode Code = OP_SUM3;
   static double Operate(double a, double b, double c)
   {
     return a + b + c;
@@ -530,6 +594,7 @@ public:
 class ProductOperator3Traits
 {
 public:
+  static const OpCode Code = OP_PRODUCT3;
   static double Operate(double a, double b, double c)
   {
     return a * b * c;
@@ -600,6 +665,7 @@ public:
       }
   }
 
+  virtual OpCode GetOpCode() const { return TOperatorTraits::Code; }
 
 protected:
   Expression *m_A, *m_B, *m_C;
@@ -740,6 +806,30 @@ public:
       }
   }
 
+  virtual double EvaluateFromOperands(const double *operands)
+  {
+    return m_Traits->Evaluate(operands[0], operands[1], operands[2],
+                              m_OrderX, m_OrderY, m_OrderZ);
+  }
+
+  virtual void DifferentiateFromOperands(const double *operands, double *grad, double *hess)
+  {
+    int order[] = { m_OrderX, m_OrderY, m_OrderZ };
+    for(int i = 0; i < 3; i++)
+      {
+      int oi[] = { order[0], order[1], order[2] };
+      oi[i]++;
+      grad[i] = m_Traits->Evaluate(operands[0], operands[1], operands[2], oi[0], oi[1], oi[2]);
+      for(int j = 0; hess && j <= i; j++)
+        {
+        int oij[] = { oi[0], oi[1], oi[2] };
+        oij[j]++;
+        hess[3*i+j] = hess[3*j+i] = m_Traits->Evaluate(
+              operands[0], operands[1], operands[2], oij[0], oij[1], oij[2]);
+        }
+      }
+  }
+
 protected:
   Expression *m_X, *m_Y, *m_Z;
   Self *m_DfDx, *m_DfDy, *m_DfDz;
@@ -798,6 +888,8 @@ public:
     return (i < m_A.size()) ? m_A[i] : NULL;
   }
 
+  virtual OpCode GetOpCode() const { return OP_BIGSUM; }
+
 protected:
   typedef std::vector<Expression *>::iterator Iterator;
   std::vector<Expression *> m_A;
@@ -836,6 +928,139 @@ Expression *TriangleTwiceAreaSqr(Problem *p, const VarVec &a, const VarVec &b, c
 Expression *DistanceSqr(Problem *p, const VarVec &a, const VarVec &b);
 Expression *MagnitudeSqr(Problem *p, const VarVec &a);
 
+/**
+  A set of expressions compiled into a flat list of instructions. Compile()
+  sorts the expression graph topologically and merges common subexpressions,
+  i.e., nodes that perform the same operation on the same operands, as well
+  as equal constants. Each instruction stores its result in a value array,
+  and the operands refer to earlier entries in this array, so Evaluate() is
+  a single loop over the instructions without virtual calls or recursion.
+
+  The values of the variables are read from the Variable objects at the
+  start of each evaluation. Expressions with code OP_EXTERNAL are computed by
+  calling their EvaluateFromOperands() method. The tape holds pointers to
+  the expressions, so it must not outlive the problem.
+
+  When the outputs are compiled into separate segments, subexpressions are
+  only shared within an output, and the derivatives of each output with
+  respect to the variables it depends on are computed by sweeping over its
+  segment. Gradient() uses reverse mode, and the Hessian is computed column
+  by column as Hessian-vector products (forward mode over reverse mode).
+  This is meant for functions made up of many small terms, where each term
+  depends on a handful of variables.
+  */
+class ExpressionTape
+{
+public:
+  ExpressionTape() : m_FirstInstruction(0) {}
+
+  /** Compile a list of expressions. NULL entries are treated as zero. When
+    separate is true, each output gets its own segment of the tape, which
+    is needed for the derivative methods below */
+  void Compile(const std::vector<Expression *> &outputs, bool separate = false);
+
+  /** Evaluate all the expressions */
+  void Evaluate();
+
+  /** Get the value of the i-th output after Evaluate() */
+  double GetOutput(unsigned int i) const { return m_Values[m_OutputSlots[i]]; }
+
+  /** Copy all the outputs into an array */
+  void GetOutputs(double *out) const;
+
+  /** Number of outputs */
+  unsigned int GetNumberOfOutputs() const { return m_OutputSlots.size(); }
+
+  /** Number of instructions, not counting variables and constants */
+  unsigned int GetNumberOfInstructions() const { return m_Instructions.size(); }
+
+  /** Get the variables read by the tape */
+  const std::vector<Variable *> &GetVariables() const { return m_Variables; }
+
+  /** Number of variables that the i-th output depends on */
+  unsigned int GetNumberOfSegmentVariables(unsigned int i) const
+    { return m_Segments[i].n_vars; }
+
+  /** Indices (into GetVariables()) of the variables of the i-th output */
+  const int *GetSegmentVariables(unsigned int i) const
+    { return m_SegmentVariables.data() + m_Segments[i].first_var; }
+
+  /** Whether the i-th output is a linear function of its variables */
+  bool IsSegmentLinear(unsigned int i) const { return m_Segments[i].linear; }
+
+  /** Gradient of the i-th output with respect to its variables, for the
+    values computed by the last call to Evaluate() */
+  void Gradient(unsigned int i, double *grad);
+
+  /** Product of the Hessian of the i-th output with a direction. Both the
+    direction and the result are indexed by the variables of the output */
+  void HessianVectorProduct(unsigned int i, const double *dir, double *hv);
+
+  /** Dense Hessian of the i-th output (n x n, where n is the number of
+    variables of the output). The gradient is also computed if grad is not
+    NULL */
+  void Hessian(unsigned int i, double *hess, double *grad = NULL);
+
+protected:
+
+  // An instruction. The operands a, b, c are indices into the value array.
+  // For OP_BIGSUM and OP_EXTERNAL, a is the position of the operand list in
+  // m_OperandLists and b is the number of operands, and for OP_EXTERNAL, c
+  // is the index of the expression in m_External
+  struct Instruction
+    {
+    OpCode op;
+    int a, b, c;
+    double k;
+    };
+
+  // A range of instructions that computes one output, and the range of
+  // m_SegmentVariables that holds the variables of the output
+  struct Segment
+    {
+    int first_ins, end_ins;
+    int first_var, n_vars;
+    bool linear;
+    };
+
+  // Get the operands of an instruction, using buf for the ternary ones
+  int GetOperands(const Instruction &ins, int *buf, const int *&ops) const;
+
+  // Compute the partial derivatives of the instructions in a segment with
+  // respect to their operands, and the first order adjoints of the segment
+  void ReverseSweep(unsigned int i, bool second_order);
+
+  // Propagate a direction forward through the segment and accumulate the
+  // second order adjoints backward. Requires ReverseSweep(i, true)
+  void SecondOrderSweep(unsigned int i, const double *dir, double *hv);
+
+  std::vector<Instruction> m_Instructions;
+  std::vector<int> m_OperandLists;
+  std::vector<Expression *> m_External;
+
+  // The value array holds variables, then constants, then instruction results
+  std::vector<double> m_Values;
+  std::vector<Variable *> m_Variables;
+  unsigned int m_FirstInstruction;
+
+  // Positions of the outputs in the value array
+  std::vector<int> m_OutputSlots;
+
+  // Buffer for operands of external expressions
+  std::vector<double> m_ExternalOperands;
+
+  // Segments, when compiled separately
+  std::vector<Segment> m_Segments;
+  std::vector<int> m_SegmentVariables;
+
+  // Work arrays for derivatives, parallel to the value array, and the
+  // partial derivatives of each instruction of the current segment
+  std::vector<double> m_Adjoints, m_Tangents, m_SecondAdjoints;
+  std::vector<double> m_Partials, m_Direction;
+  std::vector<int> m_PartialOffsets;
+};
+
+
 /**
   A problem for IPOpt
   */
@@ -844,8 +1069,8 @@ class ConstrainedNonLinearProblem : public Problem
 public:
   static const double LBINF, UBINF;
 
-  // The Jacobian of G is stored as a sparse array of Expression pointers
-  typedef ImmutableSparseArray<Expression *> SparseExpressionMatrix;
+  // The Jacobian of G and the Hessian of the Lagrangean are computed on
+  // the compiled tapes. The sparse matrices only hold their structure
   typedef ImmutableSparseMatrix<double> SparseRealMatrix;
 
   ConstrainedNonLinearProblem();
@@ -909,11 +1134,6 @@ public:
   // Get the objective function
   Expression *GetObjective() { return m_F; }
 
-  // Get the partial derivative of the objective with respect to the i-th
-  // variable. This may return NULL if the objective does not depend on some
-  // of the variables.
-  Expression *GetObjectivePD(unsigned int i) { return m_GradF[i]; }
-
   // Get the i-th constraint
   Expression *GetConstraint(unsigned int j) { return m_G[j]; }
 
@@ -923,40 +1143,96 @@ public:
   // Get the category of a constraint
   const std::string &GetConstraintCategory(int i) { return m_ConstraintCategory[i]; }
 
-  // Get the Jacobian sparse matrix
-  SparseExpressionMatrix &GetConstraintsJacobian() { return m_DG; }
+  // Get the sparsity structure of the Jacobian
+  SparseRealMatrix &GetConstraintsJacobian() { return m_DG; }
 
-  // Get the Hessian of the Lagrangean
-  SparseExpressionMatrix &GetHessianOfLagrangean() { return m_Hessian; }
+  // Get the sparsity structure of the Hessian of the Lagrangean (lower
+  // triangle)
+  SparseRealMatrix &GetHessianOfLagrangean() { return m_Hessian; }
+
+  // The following methods evaluate the problem for the current values of the
+  // variables using the tapes compiled by SetupProblem. The Jacobian and the
+  // Hessian values are in the order of the entries of the sparse matrices.
+  double EvaluateObjective();
+  void EvaluateObjectiveGradient(double *df);
+  void EvaluateConstraints(double *g);
+  void EvaluateConstraintsJacobian(double *values);
+  void EvaluateHessianOfLagrangean(double *values);
 
 protected:
 
+  // A term of the objective or of a constraint, after the sums and scalar
+  // multiples at the top of the expression have been taken apart
+  struct Element
+    {
+    Expression *ex;
+    double weight;
+    int owner;
+    };
+
+  // Split an expression into weighted elements
+  static void SplitIntoElements(Expression *ex, int owner, std::vector<Element> &elements);
+
+  // Get the indices in the problem of the variables of the e-th element
+  // of a tape, with -1 for variables that are not part of the problem
+  void GetElementVariables(const ExpressionTape &tape, unsigned int e, std::vector<int> &idx);
+
+  // Map the variables of each element to their indices in the gradient or,
+  // if jacobian is true, to the positions of the entries in the Jacobian,
+  // and map each pair of variables to the positions in the Hessian
+  void MapElements(const std::vector<Element> &elements, const ExpressionTape &tape,
+                   std::vector<int> &var_map, std::vector<int> &hess_map,
+                   std::vector<int> &offsets, bool jacobian, bool hessian);
+
+  // Add the Hessians of the elements, scaled by their weights and by the
+  // scale factors of their owners, to the Hessian values
+  void AccumulateHessians(const std::vector<Element> &elements, ExpressionTape &tape,
+                          const std::vector<int> &hess_map, const std::vector<int> &offsets,
+                          const double *owner_scale, double *values);
+
+  // Compare the derivatives to central differences
+  void TestDerivatives(bool hessian);
+
   Expression *m_F;
   std::vector<Variable *> m_X, m_Lambda;
   std::vector<Expression *> m_G;
-  std::vector<Expression *> m_GradF;
 
   std::vector<double> m_LowerBoundX, m_UpperBoundX;
   std::vector<double> m_LowerBoundG, m_UpperBoundG;
   std::vector<std::string> m_ConstraintCategory;
 
-  // The matrix for the Jacobian
-  SparseExpressionMatrix m_DG;
+  // The structure of the Jacobian
+  SparseRealMatrix m_DG;
 
-  // The matrix for the Hessian of the Lagrangean
-  SparseExpressionMatrix m_Hessian;
+  // The structure of the Hessian of the Lagrangean
+  SparseRealMatrix m_Hessian;
 
   // For IPOpt, during Hessian computation, there is a scaling factor
   Variable *m_SigmaF;
 
   // Kernel for the gradient
   SparseRealMatrix m_GradientKernel;
+
+  // Elements of the objective and of the constraints, and the tapes that
+  // they are compiled into
+  std::vector<Element> m_ElementsF, m_ElementsG;
+  ExpressionTape m_TapeF, m_TapeG;
+
+  // For each variable of each element, the index of the variable in the
+  // gradient and the position in the Jacobian values (constraints only).
+  // For each pair of variables of each element, the position in the Hessian
+  // values or -1. The offsets of each element in these arrays are stored
+  // at 2*e and 2*e+1
+  std::vector<int> m_GradMapF, m_HessMapF, m_OffsetsF;
+  std::vector<int> m_JacMapG, m_HessMapG, m_OffsetsG;
+
+  // Work arrays for element derivatives
+  std::vector<double> m_ElementGrad, m_ElementHess;
 };
 
 }
 
 #include "SparseMatrix.txx"
-template class ImmutableSparseArray<gnlp::Expression *>;
 
 
 #endif // GENTLENLP_H
@@ -0,0 +1,274 @@
+#include "HeatGeodesicDistance.h"
+#include "SparseSolver.h"
+#include "MedialException.h"
+#include <vtkPolyData.h>
+#include <vtkCellType.h>
+#include <algorithm>
+#include <limits>
+#include <map>
+
+using namespace std;
+
+HeatGeodesicDistance
+::HeatGeodesicDistance()
+{
+  m_HeatSolver = NULL;
+  m_PoissonSolver = NULL;
+}
+
+HeatGeodesicDistance
+::~HeatGeodesicDistance()
+{
+  delete m_HeatSolver;
+  delete m_PoissonSolver;
+}
+
+void
+HeatGeodesicDistance
+::SetMesh(const TriangleMesh *mesh, const SMLVec3d *X, double xTimeFactor)
+{
+  m_X.assign(X, X + mesh->nVertices);
+  m_Tri.clear();
+  m_Tri.reserve(3 * mesh->triangles.size());
+  for(size_t i = 0; i < mesh->triangles.size(); i++)
+    for(size_t j = 0; j < 3; j++)
+      m_Tri.push_back(mesh->triangles[i].vertices[j]);
+
+  Initialize(xTimeFactor);
+}
+
+void
+HeatGeodesicDistance
+::SetMesh(vtkPolyData *mesh, double xTimeFactor)
+{
+  m_X.resize(mesh->GetNumberOfPoints());
+  for(vtkIdType i = 0; i < mesh->GetNumberOfPoints(); i++)
+    mesh->GetPoint(i, m_X[i].data_block());
+
+  m_Tri.clear();
+  for(vtkIdType iCell = 0; iCell < mesh->GetNumberOfCells(); iCell++)
+    {
+    if(mesh->GetCellType(iCell) != VTK_TRIANGLE)
+      continue;
+
+    vtkIdType nPoints;
+    const vtkIdType *xPoints;
+    mesh->GetCellPoints(iCell, nPoints, xPoints);
+    for(size_t j = 0; j < 3; j++)
+      m_Tri.push_back(xPoints[j]);
+    }
+
+  Initialize(xTimeFactor);
+}
+
+void
+HeatGeodesicDistance
+::Initialize(double xTimeFactor)
+{
+  size_t n = m_X.size(), nt = m_Tri.size() / 3;
+  if(nt == 0)
+    throw MedialModelException("HeatGeodesicDistance: mesh has no triangles");
+
+  // Compute the geometry of each triangle
+  m_TriGeom.resize(nt);
+  m_Mass.assign(n, 0.0);
+  double xEdgeSum = 0.0;
+  for(size_t q = 0; q < nt; q++)
+    {
+    const size_t *v = &m_Tri[3 * q];
+    TriangleGeom &tg = m_TriGeom[q];
+
+    SMLVec3d N = vnl_cross_3d(m_X[v[1]] - m_X[v[0]], m_X[v[2]] - m_X[v[0]]);
+    double xNormN = N.magnitude();
+    tg.xArea = 0.5 * xNormN;
+
+    for(size_t k = 0; k < 3; k++)
+      {
+      const SMLVec3d &xk = m_X[v[k]];
+      SMLVec3d e1 = m_X[v[(k+1) % 3]] - xk, e2 = m_X[v[(k+2) % 3]] - xk;
+      xEdgeSum += e1.magnitude();
+
+      // Cotangent of the angle at vertex k. Degenerate triangles do not
+      // contribute to the operators
+      tg.xCotangent[k] = xNormN > 0.0 ? dot_product(e1, e2) / xNormN : 0.0;
+      m_Mass[v[k]] += tg.xArea / 3.0;
+      }
+
+    tg.xNormal = xNormN > 0.0 ? N / xNormN : N;
+    }
+
+  // Time step for the heat flow
+  double h = xEdgeSum / (3 * nt);
+  double t = xTimeFactor * h * h;
+
+  // Assemble the cotangent Laplacian (upper triangle only). The edge opposite
+  // to vertex k gets a weight of 1/2 cot(angle at k)
+  vector< map<size_t, double> > L(n);
+  for(size_t i = 0; i < n; i++)
+    L[i][i] = 0.0;
+
+  for(size_t q = 0; q < nt; q++)
+    {
+    const size_t *v = &m_Tri[3 * q];
+    for(size_t k = 0; k < 3; k++)
+      {
+      size_t i = v[(k+1) % 3], j = v[(k+2) % 3];
+      double w = 0.5 * m_TriGeom[q].xCotangent[k];
+      L[i][i] += w;
+      L[j][j] += w;
+      L[min(i,j)][max(i,j)] -= w;
+      }
+    }
+
+  // The Poisson operator is regularized by a small multiple of the mass matrix
+  // to remove the constant null space of L
+  double xReg = 1.0e-8 / t;
+
+  // Vertices that are not in any non-degenerate triangle have no mass and an
+  // empty row in L. They get a unit diagonal so that the systems are not
+  // singular, and their distance is reported as infinite
+  SparseMat::STLSourceType srcHeat(n), srcPoisson(n);
+  for(size_t i = 0; i < n; i++)
+    {
+    for(map<size_t, double>::const_iterator it = L[i].begin(); it != L[i].end(); ++it)
+      {
+      if(it->first == i && m_Mass[i] == 0.0)
+        {
+        srcHeat[i].push_back(make_pair(i, 1.0));
+        srcPoisson[i].push_back(make_pair(i, 1.0));
+        continue;
+        }
+      double m = (it->first == i) ? m_Mass[i] : 0.0;
+      srcHeat[i].push_back(make_pair(it->first, m + t * it->second));
+      srcPoisson[i].push_back(make_pair(it->first, it->second + xReg * m));
+      }
+    }
+
+  m_HeatOp.SetFromSTL(srcHeat, n);
+  m_PoissonOp.SetFromSTL(srcPoisson, n);
+
+  // Factor both operators
+  delete m_HeatSolver;
+  delete m_PoissonSolver;
+  m_HeatSolver = SparseSolver::MakeSolver(true);
+  m_PoissonSolver = SparseSolver::MakeSolver(true);
+
+  m_HeatSolver->SymbolicFactorization(m_HeatOp);
+  m_HeatSolver->NumericFactorization(m_HeatOp);
+  m_PoissonSolver->SymbolicFactorization(m_PoissonOp);
+  m_PoissonSolver->NumericFactorization(m_PoissonOp);
+}
+
+void
+HeatGeodesicDistance
+::HeatToDistance(size_t nRHS, double *u, double *xDist)
+{
+  size_t n = m_X.size(), nt = m_TriGeom.size();
+
+  // The divergence is accumulated in place of the heat solution, which is no
+  // longer needed once the gradient in each triangle has been computed
+  vector<double> div(n);
+  for(size_t r = 0; r < nRHS; r++)
+    {
+    double *ur = u + r * n;
+    std::fill(div.begin(), div.end(), 0.0);
+
+    for(size_t q = 0; q < nt; q++)
+      {
+      const size_t *v = &m_Tri[3 * q];
+      const TriangleGeom &tg = m_TriGeom[q];
+      if(tg.xArea <= 0.0)
+        continue;
+
+      // Gradient of the heat function in the triangle
+      SMLVec3d grad(0.0);
+      for(size_t k = 0; k < 3; k++)
+        {
+        SMLVec3d e = m_X[v[(k+2) % 3]] - m_X[v[(k+1) % 3]];
+        grad += ur[v[k]] * vnl_cross_3d(tg.xNormal, e);
+        }
+
+      // Normalized vector field pointing away from the source
+      double xNormGrad = grad.magnitude();
+      if(xNormGrad == 0.0)
+        continue;
+      SMLVec3d X = -grad / xNormGrad;
+
+      // Integrated divergence at each vertex
+      for(size_t k = 0; k < 3; k++)
+        {
+        size_t i = v[k], j = v[(k+1) % 3], l = v[(k+2) % 3];
+        div[i] += 0.5 * (tg.xCotangent[(k+2) % 3] * dot_product(m_X[j] - m_X[i], X)
+                         + tg.xCotangent[(k+1) % 3] * dot_product(m_X[l] - m_X[i], X));
+        }
+      }
+
+    for(size_t i = 0; i < n; i++)
+      ur[i] = -div[i];
+    }
+
+  // Solve the Poisson problem for all right hand sides
+  m_PoissonSolver->Solve(nRHS, u, xDist);
+
+  // Shift so that the smallest distance (at the source) is zero. Vertices
+  // without mass are not reachable from the rest of the mesh
+  for(size_t r = 0; r < nRHS; r++)
+    {
+    double *dr = xDist + r * n;
+    double xMin = std::numeric_limits<double>::infinity();
+    for(size_t i = 0; i < n; i++)
+      if(m_Mass[i] > 0.0)
+        xMin = std::min(xMin, dr[i]);
+    for(size_t i = 0; i < n; i++)
+      dr[i] = (m_Mass[i] > 0.0) ? dr[i] - xMin : std::numeric_limits<double>::infinity();
+    }
+}
+
+void
+HeatGeodesicDistance
+::ComputeDistances(size_t nSources, const size_t *xSources, double *xDist)
+{
+  size_t n = m_X.size();
+  if(!m_HeatSolver)
+    throw MedialModelException("HeatGeodesicDistance: SetMesh has not been called");
+
+  // Integrate the heat flow from a unit impulse at each source
+  vector<double> rhs(nSources * n, 0.0), u(nSources * n);
+  for(size_t r = 0; r < nSources; r++)
+    {
+    if(m_Mass[xSources[r]] == 0.0)
+      throw MedialModelException("HeatGeodesicDistance: source vertex is not in any triangle");
+    rhs[r * n + xSources[r]] = 1.0;
+    }
+  m_HeatSolver->Solve(nSources, rhs.data(), u.data());
+
+  HeatToDistance(nSources, u.data(), xDist);
+}
+
+void
+HeatGeodesicDistance
+::ComputeDistances(size_t iSource, double *xDist)
+{
+  ComputeDistances(1, &iSource, xDist);
+}
+
+void
+HeatGeodesicDistance
+::ComputeDistancesToSet(const std::vector<size_t> &sources, double *xDist)
+{
+  size_t n = m_X.size();
+  if(!m_HeatSolver)
+    throw MedialModelException("HeatGeodesicDistance: SetMesh has not been called");
+
+  // A single heat flow from all the sources gives the distance to the set
+  vector<double> rhs(n, 0.0), u(n);
+  for(size_t k = 0; k < sources.size(); k++)
+    {
+    if(m_Mass[sources[k]] == 0.0)
+      throw MedialModelException("HeatGeodesicDistance: source vertex is not in any triangle");
+    rhs[sources[k]] = 1.0;
+    }
+  m_HeatSolver->Solve(rhs.data(), u.data());
+
+  HeatToDistance(1, u.data(), xDist);
+}
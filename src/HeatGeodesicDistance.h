@@ -0,0 +1,102 @@
+#ifndef __HeatGeodesicDistance_h_
+#define __HeatGeodesicDistance_h_
+
+#include <vector>
+#include "smlmath.h"
+#include "SparseMatrix.h"
+#include "MeshTraversal.h"
+
+class SparseSolver;
+class vtkPolyData;
+
+/**
+ * This class computes geodesic distances on a triangle mesh using the heat
+ * method of Crane, Weischedel and Wardetzky (ACM ToG 2013). The distance from
+ * a source is obtained in three steps:
+ *
+ *   1. Integrate the heat flow for a short time t, i.e., solve
+ *      (A + t L) u = \delta_source
+ *   2. Normalize the gradient of u in each triangle, X = - \nabla u / |\nabla u|
+ *   3. Solve the Poisson equation L \phi = - \nabla \cdot X
+ *
+ * Here L is the (positive semi-definite) cotangent Laplacian and A is the
+ * lumped mass matrix. Both systems depend only on the mesh geometry, so they
+ * are factored once in SetMesh() and each subsequent query costs two sparse
+ * back-substitutions. Several sources can be processed in a single batch.
+ *
+ * Unlike Dijkstra's algorithm on the edge graph, the distances are not
+ * restricted to paths along mesh edges. Boundaries of open meshes are
+ * treated with Neumann conditions. Vertices that do not belong to any
+ * non-degenerate triangle get an infinite distance and cannot be sources.
+ * The class requires a sparse solver to be configured (see
+ * SparseSolver::MakeSolver). Queries are not thread-safe, use the batch
+ * interface to compute distances from many sources.
+ */
+class HeatGeodesicDistance
+{
+public:
+  typedef ImmutableSparseMatrix<double> SparseMat;
+
+  HeatGeodesicDistance();
+  ~HeatGeodesicDistance();
+
+  /**
+   * Set the mesh and factor the heat and Poisson operators. The time step of
+   * the heat flow is xTimeFactor * h^2, where h is the mean edge length
+   */
+  void SetMesh(const TriangleMesh *mesh, const SMLVec3d *X, double xTimeFactor = 1.0);
+
+  /** Set the mesh from a VTK triangle mesh (non-triangle cells are ignored) */
+  void SetMesh(vtkPolyData *mesh, double xTimeFactor = 1.0);
+
+  /** Get the number of vertices in the mesh */
+  size_t GetNumberOfVertices() const
+    { return m_X.size(); }
+
+  /** Compute the distance from a single source to all vertices */
+  void ComputeDistances(size_t iSource, double *xDist);
+
+  /**
+   * Compute distances from a batch of sources. The output array must hold
+   * nSources * n values, the distances from source k are stored in
+   * xDist[k * n] ... xDist[k * n + n - 1]
+   */
+  void ComputeDistances(size_t nSources, const size_t *xSources, double *xDist);
+
+  /** Compute the distance from each vertex to the nearest of a set of sources */
+  void ComputeDistancesToSet(const std::vector<size_t> &sources, double *xDist);
+
+private:
+
+  // Compute triangle geometry and factor the operators
+  void Initialize(double xTimeFactor);
+
+  // Given the solutions of the heat equation (nRHS columns), compute the
+  // distance functions in place
+  void HeatToDistance(size_t nRHS, double *u, double *xDist);
+
+  // Vertex coordinates and triangles
+  std::vector<SMLVec3d> m_X;
+  std::vector<size_t> m_Tri;
+
+  // Triangle-wise geometry: area, unit normal and the cotangents of the
+  // three angles
+  struct TriangleGeom
+    {
+    double xArea;
+    SMLVec3d xNormal;
+    double xCotangent[3];
+    };
+  std::vector<TriangleGeom> m_TriGeom;
+
+  // Lumped mass matrix (diagonal)
+  std::vector<double> m_Mass;
+
+  // Heat operator A + t L and Poisson operator L, stored as upper triangles
+  SparseMat m_HeatOp, m_PoissonOp;
+
+  // Solvers holding the factorizations of the two operators
+  SparseSolver *m_HeatSolver, *m_PoissonSolver;
+};
+
+#endif // __HeatGeodesicDistance_h_
@@ -65,7 +65,7 @@ bool IPOptProblemInterface::eval_f(
     m_Problem->SetVariableValues(x);
 
   // Compute the objective
-  obj_value = m_Problem->GetObjective()->Evaluate();
+  obj_value = m_Problem->EvaluateObjective();
 
   return true;
 }
@@ -81,11 +81,7 @@ bool IPOptProblemInterface::eval_grad_f(
   vnl_vector<double> df(n, 0.0);
 
   // Get the partial derivatives of the objective function
-  for(unsigned int i = 0; i < n; i++)
-    {
-    Expression *pd = m_Problem->GetObjectivePD(i);
-    df[i] = pd ? pd->Evaluate() : 0.0;
-    }
+  m_Problem->EvaluateObjectiveGradient(df.data_block());
 
   // Multiply by the kernel
   if(m_Problem->GetGradientSmoothingKernel().GetNumberOfSparseValues())
@@ -109,10 +105,10 @@ bool IPOptProblemInterface::eval_g(
   typedef std::map<std::string, double> CatMap;
   CatMap cmap;
 
-  // Get the partial derivatives of the objective function
+  // Evaluate the constraints
+  m_Problem->EvaluateConstraints(g);
   for(unsigned int i = 0; i < m; i++)
     {
-    g[i] = m_Problem->GetConstraint(i)->Evaluate();
     std::string cat = m_Problem->GetConstraintCategory(i);
     std::pair<CatMap::iterator, bool> ret = cmap.insert(std::make_pair(cat, 0.0));
 
@@ -154,8 +150,8 @@ bool IPOptProblemInterface::eval_jac_g(
     Index nele_jac, Index *iRow, Index *jCol, Number *values)
 {
   // Get the Jacobian sparse matrix
-  typedef ConstrainedNonLinearProblem::SparseExpressionMatrix SparseMat;
-  SparseMat DG = m_Problem->GetConstraintsJacobian();
+  typedef ConstrainedNonLinearProblem::SparseRealMatrix SparseMat;
+  SparseMat &DG = m_Problem->GetConstraintsJacobian();
 
   if(iRow && jCol)
     {
@@ -179,14 +175,7 @@ bool IPOptProblemInterface::eval_jac_g(
       m_Problem->SetVariableValues(x);
 
     // A request for the Jacobian values
-    int iEntry = 0;
-    for(int row = 0; row < DG.GetNumberOfRows(); row++)
-      {
-      for(SparseMat::RowIterator it = DG.Row(row); !it.IsAtEnd(); ++it)
-        {
-        values[iEntry++] = it.Value()->Evaluate();
-        }
-      }
+    m_Problem->EvaluateConstraintsJacobian(values);
     }
 
   return true;
@@ -202,9 +191,9 @@ bool IPOptProblemInterface::eval_h(
   if(!m_UseHessian)
     return false;
 
-  // Get the Jacobian sparse matrix
-  typedef ConstrainedNonLinearProblem::SparseExpressionMatrix SparseMat;
-  SparseMat H = m_Problem->GetHessianOfLagrangean();
+  // Get the Hessian sparse matrix
+  typedef ConstrainedNonLinearProblem::SparseRealMatrix SparseMat;
+  SparseMat &H = m_Problem->GetHessianOfLagrangean();
 
   if(iRow && jCol)
     {
@@ -234,15 +223,8 @@ bool IPOptProblemInterface::eval_h(
     // Set the objective factor
     m_Problem->SetSigma(obj_factor);
 
-    // A request for the Jacobian values
-    int iEntry = 0;
-    for(int row = 0; row < H.GetNumberOfRows(); row++)
-      {
-      for(SparseMat::RowIterator it = H.Row(row); !it.IsAtEnd(); ++it)
-        {
-        values[iEntry++] = it.Value()->Evaluate();
-        }
-      }
+    // A request for the Hessian values
+    m_Problem->EvaluateHessianOfLagrangean(values);
     }
 
   return true;
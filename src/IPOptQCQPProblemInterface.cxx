@@ -99,6 +99,9 @@ bool IPOptQCQPProblemInterface::eval_grad_f(
 bool IPOptQCQPProblemInterface::eval_g(
     Index n, const Number *x, bool new_x, Index m, Number *g)
 {
+  // Evaluate all the constraints
+  m_Problem.EvaluateConstraints(x, g);
+
   if(m_ConstraintLogFile)
     {
     // Keep track of the constraints
@@ -107,9 +110,6 @@ bool IPOptQCQPProblemInterface::eval_g(
 
     for(unsigned int i = 0; i < m; i++)
       {
-      // Evaluate the constraint
-      g[i] = m_Problem.EvaluateConstraint(x, i);
-
       // Get the lower and upper bounds
       double lb, ub;
       m_Problem.GetConstraintBounds(i, lb, ub);
@@ -133,13 +133,6 @@ bool IPOptQCQPProblemInterface::eval_g(
     fflush(m_ConstraintLogFile);
     m_ConstraintLogIter++;
     }
-  else
-    {
-    // If not logging constraints, just one line
-    for(unsigned int i = 0; i < m; i++)
-      g[i] = m_Problem.EvaluateConstraint(x, i);
-
-    }
 
   return true;
 }
@@ -170,18 +163,7 @@ bool IPOptQCQPProblemInterface::eval_jac_g(
   else
     {
     // A request for the Jacobian values
-    int iEntry = 0;
-    for(size_t row = 0; row < T.GetNumberOfRows(); row++)
-      {
-      for(auto it = T.Row(row); !it.IsAtEnd(); ++it)
-        {
-        auto &wz = it.Value();
-        double val = wz.z;
-        for(auto it_w : wz.w)
-          val += x[std::get<0>(it_w)] * std::get<1>(it_w);
-        values[iEntry++] = val;
-        }
-      }
+    m_Problem.EvaluateConstraintsJacobian(x, values);
     }
 
   return true;
@@ -214,20 +196,8 @@ bool IPOptQCQPProblemInterface::eval_h(
     }
   else
     {
-    // A request for the Jacobian values
-    int iEntry = 0;
-    for(int row = 0; row < H.GetNumberOfRows(); row++)
-      {
-      for(auto it = H.Row(row); !it.IsAtEnd(); ++it)
-        {
-        auto &wz = it.Value();
-        double val = wz.z * obj_factor;
-        for(auto it_w : wz.w)
-          val += lambda[std::get<0>(it_w)] * std::get<1>(it_w);
-
-        values[iEntry++] = val;
-        }
-      }
+    // A request for the Hessian values
+    m_Problem.EvaluateHessianOfLagrangean(obj_factor, lambda, values);
     }
 
   return true;
@@ -2,12 +2,113 @@
 #include <vnl/vnl_fastops.h>
 #include <iostream>
 #include "ctpl_stl.h"
-#include "exp_approx.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+template <class TFloat, unsigned int VDim>
+void
+PointSetCutoffGrid<TFloat, VDim>
+::SetCellSize(TFloat cell_size)
+{
+  this->cell_size = cell_size;
+  cells.clear();
+  cell_of.clear();
+  pos.clear();
+
+  // Offsets to the cell itself and to its neighbors
+  stencil.clear();
+  unsigned int n_nbr = 1;
+  for(unsigned int a = 0; a < VDim; a++)
+    n_nbr *= 3;
+
+  for(unsigned int m = 0; m < n_nbr; m++)
+    {
+    Key offset = 0;
+    for(unsigned int a = 0, r = m; a < VDim; a++, r /= 3)
+      offset += ((Key) ((int) (r % 3) - 1)) << (21 * a);
+    stencil.push_back(offset);
+    }
+}
+
+template <class TFloat, unsigned int VDim>
+typename PointSetCutoffGrid<TFloat, VDim>::Key
+PointSetCutoffGrid<TFloat, VDim>
+::GetKey(const TFloat *x) const
+{
+  const Key bias = 1 << 20, max_field = (1 << 21) - 1;
+  Key key = 0;
+  for(unsigned int a = 0; a < VDim; a++)
+    {
+    Key c = (Key) std::floor(x[a] / cell_size) + bias;
+    key += std::max((Key) 0, std::min(max_field, c)) << (21 * a);
+    }
+  return key;
+}
+
+template <class TFloat, unsigned int VDim>
+void
+PointSetCutoffGrid<TFloat, VDim>
+::Update(const Matrix &q)
+{
+  unsigned int k = q.rows();
+  if(cell_of.size() != k)
+    {
+    // Bin all the points
+    cells.clear();
+    cell_of.resize(k);
+    pos.resize(k);
+    for(unsigned int i = 0; i < k; i++)
+      {
+      cell_of[i] = GetKey(q[i]);
+      std::vector<unsigned int> &cell = cells[cell_of[i]].points;
+      pos[i] = cell.size();
+      cell.push_back(i);
+      }
+    }
+  else
+    {
+    // Move the points that changed cells. A point is removed from its old
+    // cell by moving the last point of that cell into its place
+    for(unsigned int i = 0; i < k; i++)
+      {
+      Key key = GetKey(q[i]);
+      if(key == cell_of[i])
+        continue;
+
+      std::vector<unsigned int> &old_cell = cells[cell_of[i]].points;
+      unsigned int last = old_cell.back();
+      old_cell[pos[i]] = last;
+      pos[last] = pos[i];
+      old_cell.pop_back();
+
+      std::vector<unsigned int> &new_cell = cells[key].points;
+      pos[i] = new_cell.size();
+      new_cell.push_back(i);
+      cell_of[i] = key;
+      }
+    }
+
+  // Lay the cells out one after another, so that each cell is a contiguous
+  // range of slots
+  order.resize(k);
+  slot_of.resize(k);
+  unsigned int p = 0;
+  for(auto &it : cells)
+    {
+    it.second.start = p;
+    for(unsigned int i : it.second.points)
+      {
+      order[p] = i;
+      slot_of[i] = p++;
+      }
+    }
+}
 
 template <class TFloat, unsigned int VDim>
 PointSetOptimalControlSystem<TFloat, VDim>
 ::PointSetOptimalControlSystem(
-    const Matrix &q0, TFloat sigma, unsigned int N)
+    const Matrix &q0, TFloat sigma, unsigned int N, TFloat tol)
 {
   // Copy parameters
   this->q0 = q0;
@@ -16,6 +117,21 @@ PointSetOptimalControlSystem<TFloat, VDim>
   this->k = q0.rows();
   this->dt = 1.0 / (N-1);
 
+  // The kernel approximation vanishes for squared distances beyond 512
+  // sigma^2. With a tolerance, the cutoff is where the kernel drops to tol
+  this->cutoff_sq = 512 * sigma * sigma;
+  if(tol > 0 && tol < 1)
+    this->cutoff_sq = std::min(cutoff_sq, (TFloat) (-2 * sigma * sigma * std::log(tol)));
+  this->grid.SetCellSize(std::sqrt(cutoff_sq));
+
+  // Store the whole path by default
+  this->n_checkpoints = 0;
+  this->u_flow = NULL;
+  this->t_cursor = -1;
+
+  // Kernel sums in TFloat by default
+  this->mixed_precision = false;
+
   // Allocate H derivatives
   for(unsigned int a = 0; a < VDim; a++)
     this->d_q__d_t[a].set_size(k);
@@ -50,17 +166,6 @@ PointSetOptimalControlSystem<TFloat, VDim>
   // Handle the middle line for odd number of vertices
   if(k % 2 == 1)
     td[(k / 2) % n_threads].rows.push_back(k/2);
-
-  // Allocate the per-thread arrays
-  for(int i = 0; i < n_threads; i++)
-    {
-    for(int a = 0; a < VDim; a++)
-      {
-      td[i].d_q__d_t[a] = Vector(k, 0.0);
-      td[i].alpha_U[a] = Vector(k, 0.0);
-      td[i].alpha_Q[a] = Vector(k, 0.0);
-      }
-    }
 }
 
 // TODO: get rid of this stuff
@@ -89,68 +194,158 @@ public:
     }
 };
 
+// Number of partial sums kept by the inner loops over the neighbors. The
+// pairs are processed in blocks of this many consecutive slots, which lets
+// the compiler map each block onto SIMD registers. The blocks span 64 bytes
+// of each array, i.e., twice as many lanes in single precision
+template <class TKernel>
+constexpr unsigned int KernelLanes() { return 64 / sizeof(TKernel); }
+
+// The kernel is (1 + f d2 / 256)^256. Below this value of the base, the
+// kernel is smaller than the square root of the smallest normal number, and
+// it is set to zero. Otherwise the kernel, or its products with the other
+// terms, can be denormal numbers, which are very slow to compute with
+template <class TFloat>
+TFloat KernelBaseMin()
+{
+  return std::pow(std::numeric_limits<TFloat>::min(), (TFloat) (1.0 / 512));
+}
+
 template <class TFloat, unsigned int VDim>
+template <class TKernel>
 void
 PointSetOptimalControlSystem<TFloat, VDim>
-::ComputeEnergyAndVelocityThreadedWorker(const Matrix &q, const Matrix &u, ThreadData *tdi)
+::ScatterToSlots(const Matrix &m, vnl_vector<TKernel> soa[])
 {
-  // Gaussian factor, i.e., K(z) = exp(f * z)
-  TFloat f = -0.5 / (sigma * sigma);
+  for(unsigned int a = 0; a < VDim; a++)
+    {
+    soa[a].set_size(k);
+    for(unsigned int p = 0; p < k; p++)
+      soa[a][p] = m(grid.GetPointInSlot(p), a);
+    }
+}
 
-  // Initialize the velocity vector to zero
+template <class TFloat, unsigned int VDim>
+template <class TKernel>
+void
+PointSetOptimalControlSystem<TFloat, VDim>
+::ScatterToSlots(const Vector v[], vnl_vector<TKernel> soa[])
+{
   for(unsigned int a = 0; a < VDim; a++)
     {
-    tdi->d_q__d_t[a].fill(0.0);
+    soa[a].set_size(k);
+    for(unsigned int p = 0; p < k; p++)
+      soa[a][p] = v[a][grid.GetPointInSlot(p)];
     }
+}
+
+template <class TFloat, unsigned int VDim>
+template <class TKernel>
+void
+PointSetOptimalControlSystem<TFloat, VDim>
+::ComputeEnergyAndVelocityThreadedWorker(
+    const vnl_vector<TKernel> slot_q[], const vnl_vector<TKernel> slot_u[],
+    ThreadData *tdi)
+{
+  const unsigned int L = KernelLanes<TKernel>();
+
+  // Gaussian factor, i.e., K(z) = exp(f * z). The kernel is computed as in
+  // exp_approx, without branches
+  TKernel f = -0.5 / (sigma * sigma);
+  TKernel f256 = f / 256;
+  TKernel y_min = KernelBaseMin<TKernel>();
+  TKernel d2_max = cutoff_sq;
 
   // Initialize the kinetic energy
   tdi->KE = 0.0;
 
-  // Loop over all points
-  for(unsigned int i : tdi->rows)
+  // Pointers to the arrays in slot order
+  const TKernel *qs[VDim], *us[VDim];
+  for(unsigned int a = 0; a < VDim; a++)
     {
-    // Get a pointer to pi for faster access?
-    const TFloat *ui = u.data_array()[i], *qi = q.data_array()[i];
+    qs[a] = slot_q[a].data_block();
+    us[a] = slot_u[a].data_block();
+    }
 
-    // The diagonal terms
+  // Loop over all points. The sums over j include j = i, which accounts
+  // for the diagonal terms
+  for(unsigned int i : tdi->rows)
+    {
+    unsigned int pi = grid.GetSlotOfPoint(i);
+    TKernel qi[VDim], ui[VDim];
     for(unsigned int a = 0; a < VDim; a++)
       {
-      tdi->KE += 0.5 * ui[a] * ui[a];
-      tdi->d_q__d_t[a](i) += ui[a];
+      qi[a] = qs[a][pi];
+      ui[a] = us[a][pi];
+      }
+
+    // Partial sums of the energy and of the velocity of point i. The sums
+    // over each cell are computed in TKernel and then added to these
+    TFloat ke[L], vi[VDim][L];
+    TKernel kc[L], vc[VDim][L];
+    for(unsigned int l = 0; l < L; l++)
+      {
+      ke[l] = 0.0;
+      for(unsigned int a = 0; a < VDim; a++)
+        vi[a][l] = 0.0;
       }
 
-    // Perform symmetric computation
-    for(unsigned int j = i+1; j < k; j++)
+    // Add the points in slots p ... p+n-1 to the cell sums, with n <= L
+    auto block = [&](unsigned int p, unsigned int n)
       {
-      const TFloat *uj = u.data_array()[j], *qj = q.data_array()[j];
+      for(unsigned int l = 0; l < n; l++)
+        {
+        TKernel d2 = 0.0, ui_uj = 0.0;
+        for(unsigned int a = 0; a < VDim; a++)
+          {
+          TKernel dq = qi[a] - qs[a][p + l];
+          d2 += dq * dq;
+          ui_uj += ui[a] * us[a][p + l];
+          }
 
-      // Vector Qi-Qj
-      VecD dq;
+        TKernel y = 1 + d2 * f256;
+        TKernel g = (d2 < d2_max && y > y_min) ? y : (TKernel) 0.0;
+        g *= g; g *= g; g *= g; g *= g;
+        g *= g; g *= g; g *= g; g *= g;
 
-      // Dot product of Pi and Pj
-      TFloat ui_uj = 0.0;
+        kc[l] += ui_uj * g;
+        for(unsigned int a = 0; a < VDim; a++)
+          vc[a][l] += g * us[a][p + l];
+        }
+      };
 
-      // Compute above quantities
-      for(unsigned int a = 0; a < VDim; a++)
+    grid.ForEachNeighborRange(i, [&](unsigned int p0, unsigned int p1)
+      {
+      for(unsigned int l = 0; l < L; l++)
         {
-        dq[a] = qi[a] - qj[a];
-        ui_uj += ui[a] * uj[a];
+        kc[l] = 0.0;
+        for(unsigned int a = 0; a < VDim; a++)
+          vc[a][l] = 0.0;
         }
 
-      // Compute the Gaussian and its derivatives
-      TFloat g = exp_approx(dq.squared_magnitude(), f);
+      unsigned int p = p0;
+      for(; p + L <= p1; p += L)
+        block(p, L);
+      if(p < p1)
+        block(p, p1 - p);
 
-      // Accumulate the Hamiltonian
-      tdi->KE += ui_uj * g;
-
-      // Accumulate the derivatives
-      for(unsigned int a = 0; a < VDim; a++)
+      for(unsigned int l = 0; l < L; l++)
         {
-        // First derivatives
-        tdi->d_q__d_t[a](i) += g * uj[a];
-        tdi->d_q__d_t[a](j) += g * ui[a];
+        ke[l] += kc[l];
+        for(unsigned int a = 0; a < VDim; a++)
+          vi[a][l] += vc[a][l];
         }
-      } // loop over j
+      });
+
+    // Each pair is visited from both of its points, hence the factor of 1/2
+    for(unsigned int a = 0; a < VDim; a++)
+      d_q__d_t[a][i] = 0.0;
+    for(unsigned int l = 0; l < L; l++)
+      {
+      tdi->KE += 0.5 * ke[l];
+      for(unsigned int a = 0; a < VDim; a++)
+        d_q__d_t[a][i] += vi[a][l];
+      }
     } // loop over i
 }
 
@@ -161,13 +356,32 @@ TFloat
 PointSetOptimalControlSystem<TFloat, VDim>
 ::ComputeEnergyAndVelocity(const Matrix &q, const Matrix &u)
 {
+  // Rebin the points that moved and copy the data into slot order
+  grid.Update(q);
+  if(mixed_precision)
+    {
+    ScatterToSlots(q, soa_qf);
+    ScatterToSlots(u, soa_uf);
+    }
+  else
+    {
+    ScatterToSlots(q, soa_q);
+    ScatterToSlots(u, soa_u);
+    }
+
   // Submit the jobs to thread pool
   std::vector<std::future<void>> futures;
   for(auto &tdi : td)
     {
     futures.push_back(
       thread_pool->push(
-        [&](int id) { this->ComputeEnergyAndVelocityThreadedWorker(q, u, &tdi); }));
+        [&](int id) 
+        {
+        if(mixed_precision)
+          this->ComputeEnergyAndVelocityThreadedWorker(soa_qf, soa_uf, &tdi);
+        else
+          this->ComputeEnergyAndVelocityThreadedWorker(soa_q, soa_u, &tdi);
+        }));
     }
 
   // Wait for completion
@@ -176,17 +390,22 @@ PointSetOptimalControlSystem<TFloat, VDim>
 
   // Compile the results
   TFloat KE = 0.0;
-  for(int a = 0; a < VDim; a++)
-    this->d_q__d_t[a].fill(0.0);
-
   for(auto &tdi : td)
-    {
-    for(int a = 0; a < VDim; a++)
-      {
-      this->d_q__d_t[a] += tdi.d_q__d_t[a];
-      }
     KE += tdi.KE;
-    }
+
+  return KE;
+}
+
+
+template <class TFloat, unsigned int VDim>
+TFloat
+PointSetOptimalControlSystem<TFloat, VDim>
+::Step(Matrix &q, const Matrix &u)
+{
+  TFloat KE = ComputeEnergyAndVelocity(q, u);
+  for(unsigned int i = 0; i < k; i++)
+    for(unsigned int a = 0; a < VDim; a++)
+      q(i,a) += dt * d_q__d_t[a](i);
 
   return KE;
 }
@@ -200,13 +419,39 @@ PointSetOptimalControlSystem<TFloat, VDim>
   // Initialize q
   Matrix q = q0;
 
+  // The return value
+  TFloat KE = 0.0;
+
+  if(n_checkpoints > 0)
+    {
+    // Store the checkpoints that the backward flow places first, i.e., the
+    // chain of splits of the last segment
+    Qt.clear(); Vt.clear();
+    checkpoints.clear();
+    checkpoints[0] = q0;
+
+    std::vector<unsigned int> chain;
+    for(unsigned int t0 = 0, s = n_checkpoints; s > 0 && t0 + 1 < N - 1; s--)
+      chain.push_back(t0 = GetCheckpointSplit(t0, N - 1, s));
+
+    for(unsigned int t = 1, c = 0; t < N; t++)
+      {
+      KE += dt * Step(q, u[t-1]);
+      if(c < chain.size() && chain[c] == t)
+        checkpoints[chain[c++]] = q;
+      }
+
+    // The endpoint is available without recomputation
+    u_flow = &u;
+    q_cursor = q;
+    t_cursor = N - 1;
+    return KE;
+    }
+
   // Allocate the streamline arrays
   Qt.resize(N); Qt[0] = q0;
   Vt.resize(N, Matrix(k, VDim));
 
-  // The return value
-  TFloat KE = 0.0;
-
   // Flow over time
   for(unsigned int t = 1; t < N; t++)
     {
@@ -231,6 +476,53 @@ PointSetOptimalControlSystem<TFloat, VDim>
 }
 
 
+template <class TFloat, unsigned int VDim>
+const typename PointSetOptimalControlSystem<TFloat, VDim>::Matrix &
+PointSetOptimalControlSystem<TFloat, VDim>
+::GetQt(unsigned int t)
+{
+  if(n_checkpoints == 0)
+    return Qt[t];
+
+  // Restart from the last checkpoint before t, unless the previously
+  // returned timepoint is closer
+  auto it = --checkpoints.upper_bound(t);
+  if(t_cursor < 0 || t_cursor > (int) t || (int) it->first > t_cursor)
+    {
+    q_cursor = it->second;
+    t_cursor = it->first;
+    }
+
+  for(; t_cursor < (int) t; t_cursor++)
+    Step(q_cursor, (*u_flow)[t_cursor]);
+
+  return q_cursor;
+}
+
+
+template <class TFloat, unsigned int VDim>
+unsigned int
+PointSetOptimalControlSystem<TFloat, VDim>
+::GetCheckpointSplit(unsigned int t0, unsigned int t1, unsigned int s)
+{
+  // Find the smallest number of repetitions r such that the l steps can be
+  // reversed with s checkpoints, i.e., beta(s,r) = (s+r)!/(s!r!) >= l
+  unsigned int l = t1 - t0, r = 0;
+  double beta = 1;
+  while(beta < l)
+    {
+    r++;
+    beta = beta * (s + r) / r;
+    }
+
+  // The steps after the split are reversed with s-1 checkpoints and r
+  // repetitions, so there can be up to beta(s-1,r) = beta(s,r) s / (s+r)
+  // of them. The steps before the split get the remaining repetitions
+  double l_right = std::min(beta * s / (s + r), (double) (l - 1));
+  return t1 - (unsigned int) l_right;
+}
+
+
 template <class TFloat, unsigned int VDim>
 void
 PointSetOptimalControlSystem<TFloat, VDim>
@@ -260,38 +552,100 @@ PointSetOptimalControlSystem<TFloat, VDim>
   
   // Allocate and initialize the alpha vector and the products of 
   // alpha with Q(t,t-1) and U(t-1)
-  Vector alpha[VDim], alpha_Q[VDim], alpha_U[VDim];
-
-  TFloat wke_factor = w_kinetic * 0.5;
+  BackwardData bd;
+  bd.u = &u;
+  bd.d_g__d_qt = &d_g__d_qt;
+  bd.d_f__d_u = &d_f__d_u;
+  bd.wke_factor = w_kinetic * 0.5;
 
   for(int a = 0; a < VDim; a++)
     {
-    alpha[a] = d_g__d_qt[N-1].get_column(a) + wke_factor * u[N-2].get_column(a);
-    alpha_Q[a].set_size(k);
-    alpha_U[a].set_size(k);
+    bd.alpha[a] = d_g__d_qt[N-1].get_column(a) + bd.wke_factor * u[N-2].get_column(a);
+    bd.alpha_Q[a].set_size(k);
+    bd.alpha_U[a].set_size(k);
     }
 
   // Work our way backwards
-  for(int t = N-1; t > 0; t--)
+  if(n_checkpoints == 0)
     {
-    // Propagate gradient backwards
-    PropagateAlphaBackwards(Qt[t-1], u[t-1], alpha, alpha_Q, alpha_U);
+    for(int t = N-1; t > 0; t--)
+      BackwardStep(bd, t, Qt[t-1]);
+    }
+  else
+    {
+    ReverseSegment(bd, 0, N-1, n_checkpoints);
+    }
+}
 
-    // Terms involved in KE computation
-    Matrix delta_q = wke_factor * (Qt[t] - Qt[t-1]);
-    Matrix delta_u = wke_factor * ((t > 1) ? (u[t-2] - u[t-1]) : -u[t-1]);
 
-    for(int a = 0; a < VDim; a++)
-      {
-      // Update the gradient of f with respect to u[t-1]
-      d_f__d_u[t-1].set_column(a, dt * alpha_U[a] + delta_q.get_column(a));
+template <class TFloat, unsigned int VDim>
+void
+PointSetOptimalControlSystem<TFloat, VDim>
+::BackwardStep(BackwardData &bd, unsigned int t, const Matrix &q_prev)
+{
+  const MatrixArray &u = *bd.u;
+
+  // Propagate gradient backwards
+  PropagateAlphaBackwards(q_prev, u[t-1], bd.alpha, bd.alpha_Q, bd.alpha_U);
+
+  // Terms involved in KE computation. The displacement q[t]-q[t-1] is the
+  // velocity times dt
+  Matrix delta_u = bd.wke_factor * ((t > 1) ? (u[t-2] - u[t-1]) : -u[t-1]);
+
+  for(int a = 0; a < VDim; a++)
+    {
+    // Update the gradient of f with respect to u[t-1]
+    (*bd.d_f__d_u)[t-1].set_column(a, dt * bd.alpha_U[a] + (bd.wke_factor * dt) * d_q__d_t[a]);
+
+    // Update the alpha
+    bd.alpha[a] += dt * bd.alpha_Q[a] + (*bd.d_g__d_qt)[t-1].get_column(a) + delta_u.get_column(a);
+    }
+}
+
+
+template <class TFloat, unsigned int VDim>
+void
+PointSetOptimalControlSystem<TFloat, VDim>
+::ReverseSegment(BackwardData &bd, unsigned int t0, unsigned int t1, unsigned int s)
+{
+  const MatrixArray &u = *bd.u;
 
-      // Update the alpha
-      alpha[a] += dt * alpha_Q[a] + d_g__d_qt[t-1].get_column(a) + delta_u.get_column(a);
+  if(t1 == t0 + 1)
+    {
+    BackwardStep(bd, t1, checkpoints[t0]);
+    return;
+    }
+
+  if(s == 0)
+    {
+    // Without free checkpoints, each step is recomputed from t0
+    for(unsigned int t = t1; t > t0; t--)
+      {
+      Matrix q = checkpoints[t0];
+      for(unsigned int j = t0; j < t - 1; j++)
+        Step(q, u[j]);
+      BackwardStep(bd, t, q);
       }
-    } 
+    return;
+    }
+
+  // Place a checkpoint at the split, unless the forward flow already did
+  unsigned int m = GetCheckpointSplit(t0, t1, s);
+  if(checkpoints.find(m) == checkpoints.end())
+    {
+    Matrix q = checkpoints[t0];
+    for(unsigned int j = t0; j < m; j++)
+      Step(q, u[j]);
+    checkpoints[m] = q;
+    }
+
+  // Reverse the second part, then free the checkpoint for the first part
+  ReverseSegment(bd, m, t1, s - 1);
+  checkpoints.erase(m);
+  ReverseSegment(bd, t0, m, s);
 }
 
+
 template <class TFloat, unsigned int VDim>
 void
 PointSetOptimalControlSystem<TFloat, VDim>
@@ -300,94 +654,158 @@ PointSetOptimalControlSystem<TFloat, VDim>
     const Vector alpha[], 
     Vector alpha_Q[], Vector alpha_U[])
 { 
+  // Rebin the points that moved and copy the data into slot order
+  grid.Update(q);
+  if(mixed_precision)
+    {
+    ScatterToSlots(q, soa_qf);
+    ScatterToSlots(u, soa_uf);
+    ScatterToSlots(alpha, soa_alphaf);
+    }
+  else
+    {
+    ScatterToSlots(q, soa_q);
+    ScatterToSlots(u, soa_u);
+    ScatterToSlots(alpha, soa_alpha);
+    }
+
   // Submit the jobs to thread pool
   std::vector<std::future<void>> futures;
   for(auto &tdi : td)
     {
     futures.push_back(
       thread_pool->push(
-        [&](int id) { this->PropagateAlphaBackwardsThreadedWorker(q, u, alpha, &tdi); }));
+        [&](int id) 
+        { 
+        if(mixed_precision)
+          this->PropagateAlphaBackwardsThreadedWorker(
+            soa_qf, soa_uf, soa_alphaf, alpha_Q, alpha_U, &tdi);
+        else
+          this->PropagateAlphaBackwardsThreadedWorker(
+            soa_q, soa_u, soa_alpha, alpha_Q, alpha_U, &tdi);
+        }));
     }
 
   // Wait for completion
   for(auto &f : futures)
     f.get();
-
-  // Compile the results
-  for(int a = 0; a < VDim; a++)
-    {
-    alpha_Q[a].fill(0.0);
-    alpha_U[a] = alpha[a];
-    }
-
-  for(auto &tdi : td)
-    {
-    for(int a = 0; a < VDim; a++)
-      {
-      alpha_Q[a] += tdi.alpha_Q[a];
-      alpha_U[a] += tdi.alpha_U[a];
-      }
-    }
 }
 
 template <class TFloat, unsigned int VDim>
+template <class TKernel>
 void
 PointSetOptimalControlSystem<TFloat, VDim>
 ::PropagateAlphaBackwardsThreadedWorker(
-    const Matrix &q, const Matrix &u,
-    const Vector alpha[], ThreadData *tdi)
+    const vnl_vector<TKernel> slot_q[], const vnl_vector<TKernel> slot_u[],
+    const vnl_vector<TKernel> slot_alpha[],
+    Vector alpha_Q[], Vector alpha_U[], ThreadData *tdi)
 {
-  TFloat f = -0.5 / (sigma * sigma);
+  const unsigned int L = KernelLanes<TKernel>();
 
-  for(int a = 0; a < VDim; a++)
+  TKernel f = -0.5 / (sigma * sigma);
+  TKernel f256 = f / 256;
+  TKernel y_min = KernelBaseMin<TKernel>();
+  TKernel d2_max = cutoff_sq;
+
+  // Pointers to the arrays in slot order
+  const TKernel *qs[VDim], *us[VDim], *as[VDim];
+  for(unsigned int a = 0; a < VDim; a++)
     {
-    tdi->alpha_Q[a].fill(0.0);
-    tdi->alpha_U[a].fill(0.0);
+    qs[a] = slot_q[a].data_block();
+    us[a] = slot_u[a].data_block();
+    as[a] = slot_alpha[a].data_block();
     }
 
+  // The sums over j include j = i, which adds alpha[i] to alpha_U[i] and
+  // nothing to alpha_Q[i]. The velocity is computed along the way, as in
+  // ComputeEnergyAndVelocityThreadedWorker
   for(unsigned int i : tdi->rows)
     {
-    // Get a pointer to pi for faster access?
-    const TFloat *ui = u.data_array()[i], *qi = q.data_array()[i];
-
-    for(unsigned int j = i+1; j < k; j++)
+    unsigned int pi = grid.GetSlotOfPoint(i);
+    TKernel qi[VDim], ui[VDim], ai[VDim];
+    for(unsigned int a = 0; a < VDim; a++)
       {
-      const TFloat *uj = u.data_array()[j], *qj = q.data_array()[j];
+      qi[a] = qs[a][pi];
+      ui[a] = us[a][pi];
+      ai[a] = as[a][pi];
+      }
 
-      // Vector Qi-Qj
-      VecD dq;
+    // Partial sums of the terms for point i, and the sums over the current
+    // cell, which are computed in TKernel
+    TFloat aqi[VDim][L], aui[VDim][L], vi[VDim][L];
+    TKernel aqc[VDim][L], auc[VDim][L], vc[VDim][L];
+    for(unsigned int a = 0; a < VDim; a++)
+      for(unsigned int l = 0; l < L; l++)
+        aqi[a][l] = aui[a][l] = vi[a][l] = 0.0;
 
-      // Compute above quantities
-      for(unsigned int a = 0; a < VDim; a++)
+    // Add the points in slots p ... p+n-1 to the cell sums, with n <= L
+    auto block = [&](unsigned int p, unsigned int n)
+      {
+      for(unsigned int l = 0; l < n; l++)
         {
-        dq[a] = qi[a] - qj[a];
-        }
+        TKernel dq[VDim], d2 = 0.0, alpha_j_ui_plus_alpha_i_uj = 0.0;
+        for(unsigned int a = 0; a < VDim; a++)
+          {
+          dq[a] = qi[a] - qs[a][p + l];
+          d2 += dq[a] * dq[a];
+          alpha_j_ui_plus_alpha_i_uj += as[a][p + l] * ui[a] + ai[a] * us[a][p + l];
+          }
 
-      // Compute the Gaussian and its derivatives
-      TFloat g, g1;
-      g = exp_approx(dq.squared_magnitude(), f, g1);
+        // The Gaussian and its derivative, as in exp_approx
+        TKernel y = 1 + d2 * f256;
+        TKernel g = (d2 < d2_max && y > y_min) ? y : (TKernel) 0.0;
+        g *= g; g *= g; g *= g; g *= g;
+        g *= g; g *= g; g *= g; g *= g;
+        TKernel term_2_g1 = 2 * f * g * alpha_j_ui_plus_alpha_i_uj / ((y > y_min) ? y : y_min);
 
-      // Accumulate the derivatives
+        for(unsigned int a = 0; a < VDim; a++)
+          {
+          aqc[a][l] += term_2_g1 * dq[a];
+          auc[a][l] += g * as[a][p + l];
+          vc[a][l] += g * us[a][p + l];
+          }
+        }
+      };
+
+    grid.ForEachNeighborRange(i, [&](unsigned int p0, unsigned int p1)
+      {
       for(unsigned int a = 0; a < VDim; a++)
-        {
-        TFloat term_2_g1_dqa = 2.0 * g1 * dq[a];
-        TFloat alpha_j_ui_plus_alpha_i_uj = 0.0;
+        for(unsigned int l = 0; l < L; l++)
+          aqc[a][l] = auc[a][l] = vc[a][l] = 0.0;
 
-        for(unsigned int b = 0; b < VDim; b++)
+      unsigned int p = p0;
+      for(; p + L <= p1; p += L)
+        block(p, L);
+      if(p < p1)
+        block(p, p1 - p);
+
+      for(unsigned int a = 0; a < VDim; a++)
+        for(unsigned int l = 0; l < L; l++)
           {
-          alpha_j_ui_plus_alpha_i_uj += alpha[b][j] * ui[b] + alpha[b][i] * uj[b];
+          aqi[a][l] += aqc[a][l];
+          aui[a][l] += auc[a][l];
+          vi[a][l] += vc[a][l];
           }
+      });
 
-        tdi->alpha_Q[a][i] += term_2_g1_dqa * alpha_j_ui_plus_alpha_i_uj;
-        tdi->alpha_Q[a][j] -= term_2_g1_dqa * alpha_j_ui_plus_alpha_i_uj;
-
-        tdi->alpha_U[a][i] += g * alpha[a][j];
-        tdi->alpha_U[a][j] += g * alpha[a][i];
+    for(unsigned int a = 0; a < VDim; a++)
+      {
+      alpha_Q[a][i] = alpha_U[a][i] = d_q__d_t[a][i] = 0.0;
+      for(unsigned int l = 0; l < L; l++)
+        {
+        alpha_Q[a][i] += aqi[a][l];
+        alpha_U[a][i] += aui[a][l];
+        d_q__d_t[a][i] += vi[a][l];
         }
-      } // loop over j
-    } // loop over i}
+      }
+    } // loop over i
 }
 
+template class PointSetCutoffGrid<double, 2>;
+template class PointSetCutoffGrid<double, 3>;
+template class PointSetCutoffGrid<float, 2>;
+template class PointSetCutoffGrid<float, 3>;
+
 template class PointSetOptimalControlSystem<double, 2>;
 template class PointSetOptimalControlSystem<double, 3>;
 template class PointSetOptimalControlSystem<float, 2>;
@@ -5,9 +5,83 @@
 #include <vnl/vnl_vector.h>
 #include <vnl/vnl_vector_fixed.h>
 #include <vector>
+#include <unordered_map>
+#include <map>
 
 namespace ctpl { class thread_pool; }
 
+/**
+ * A uniform grid used to find the pairs of points that are closer than a
+ * cutoff distance. The cells have the size of the cutoff and are stored in
+ * a hash table, so only occupied cells take up memory. Points are rebinned
+ * incrementally: Update() only touches the points that changed cells since
+ * the previous call, which is cheap when points move a little between time
+ * steps of a flow.
+ *
+ * After each update, the points are also listed in cell order, so that the
+ * points of each cell occupy a contiguous range of slots. Callers can copy
+ * point data into arrays in slot order and loop over whole cells.
+ */
+template <class TFloat, unsigned int VDim>
+class PointSetCutoffGrid
+{
+public:
+
+  typedef vnl_matrix<TFloat> Matrix;
+
+  /** Set the cell size; this empties the grid */
+  void SetCellSize(TFloat cell_size);
+
+  /** Bin the points (rows of q) */
+  void Update(const Matrix &q);
+
+  /** Point in the given slot */
+  unsigned int GetPointInSlot(unsigned int p) const { return order[p]; }
+
+  /** Slot of the given point */
+  unsigned int GetSlotOfPoint(unsigned int i) const { return slot_of[i]; }
+
+  /**
+   * Call f(p0, p1) for the ranges of slots that hold the points in the same
+   * cell as point i and in the neighboring cells. Point i itself is included.
+   */
+  template <class TFunc> void ForEachNeighborRange(unsigned int i, TFunc f) const
+    {
+    for(Key offset : stencil)
+      {
+      auto it = cells.find(cell_of[i] + offset);
+      if(it != cells.end() && it->second.points.size())
+        f(it->second.start, it->second.start + (unsigned int) it->second.points.size());
+      }
+    }
+
+protected:
+
+  // Cell coordinates are packed into 21-bit fields of a 64-bit key
+  typedef long long Key;
+  Key GetKey(const TFloat *x) const;
+
+  TFloat cell_size;
+
+  // Points in each occupied cell, and the first slot of the cell
+  struct Cell
+    {
+    std::vector<unsigned int> points;
+    unsigned int start;
+    };
+  std::unordered_map<Key, Cell> cells;
+
+  // Cell of each point and the position of the point in that cell
+  std::vector<Key> cell_of;
+  std::vector<unsigned int> pos;
+
+  // Points in cell order, and the slot of each point in that order
+  std::vector<unsigned int> order, slot_of;
+
+  // Key offsets of a cell and its neighbors
+  std::vector<Key> stencil;
+};
+
 template <class TFloat, unsigned int VDim>
 class PointSetOptimalControlSystem
 {
@@ -27,17 +101,41 @@ public:
    * q0      : N x D vector of template landmark positions
    * sigma   : standard deviation of the Gaussian kernel 
    * N       : number of timesteps for the ODE
+   * tol     : pairs of points where the kernel is below tol are skipped.
+   *           With the default of zero, only the pairs where the kernel
+   *           approximation vanishes (beyond 22.6 sigma) are skipped
    */
   PointSetOptimalControlSystem(
     const Matrix &q0, 
     TFloat sigma,
-    unsigned int N);
+    unsigned int N,
+    TFloat tol = 0.0);
 
   /** 
    * Get the number of time steps
    */
   unsigned int GetN() const { return N; }
 
+  /**
+   * Limit the number of intermediate timepoints of the flow that are kept in
+   * memory. By default (zero), Flow() stores the whole path. Otherwise it
+   * stores at most n timepoints besides q0, placed by binomial checkpointing
+   * (Griewank's revolve schedule), and the other timepoints are recomputed
+   * from the nearest stored one when GetQt() or FlowBackward() need them.
+   * Fewer checkpoints mean more recomputation: with n checkpoints and r
+   * recomputations of each step, up to (n+r)!/(n!r!) steps can be reversed.
+   */
+  void SetNumberOfCheckpoints(unsigned int n) { n_checkpoints = n; }
+
+  /**
+   * Evaluate the kernel in single precision, while accumulating the sums
+   * over the points (velocities, energy and gradients) in TFloat. The point
+   * data are copied to float arrays for the kernel loops, which halves their
+   * memory traffic and doubles the width of the SIMD operations. This has no
+   * effect when TFloat is float.
+   */
+  void SetMixedPrecision(bool flag) { mixed_precision = flag; }
+
   /**
    * Compute the kinetic energy and the flow velocities at a given timepoint
    */
@@ -46,7 +144,8 @@ public:
   /**
    * Perform forward flow with control u, returning the total kinetic energy
    * of the flow. The endpoint and intermediate timepoints can be queried
-   * using GetQt()
+   * using GetQt(). With checkpointing, u must remain valid while GetQt() is
+   * being used
    */
   TFloat Flow(const MatrixArray &u);
 
@@ -62,28 +161,58 @@ public:
                     TFloat w_kinetic, MatrixArray &d_f__d_u);
 
   /**
-   * Get the curves
+   * Get the curves. With checkpointing, the timepoint is recomputed, which is
+   * cheapest when the timepoints are requested in increasing order.
+   * FlowBackward() frees all the checkpoints except q0, so after it each
+   * timepoint is recomputed from t=0
    */
-  const Matrix &GetQt(unsigned int t) const { return Qt[t]; }
+  const Matrix &GetQt(unsigned int t);
 
-  /** Get the velocities */
+  /** Get the velocities (only stored when checkpointing is off) */
   const Matrix &GetVt(unsigned int t) const { return Vt[t]; }
 
   const TFloat GetDeltaT() const { return dt; }
 
 protected:
 
-  // Step of backpropagation
+  // Step of backpropagation. This also computes the velocity d_q__d_t
   void PropagateAlphaBackwards(
     const Matrix &q, const Matrix &u, 
     const Vector alpha[], Vector alpha_Q[], Vector alpha_U[]);
 
+  // Euler step from q with control u, returning the kinetic energy
+  TFloat Step(Matrix &q, const Matrix &u);
+
+  // Data passed between the steps of the backward flow
+  struct BackwardData
+    {
+    const MatrixArray *u, *d_g__d_qt;
+    MatrixArray *d_f__d_u;
+    TFloat wke_factor;
+    Vector alpha[VDim], alpha_Q[VDim], alpha_U[VDim];
+    };
+
+  // Propagate the gradient from timepoint t to t-1, given q at t-1
+  void BackwardStep(BackwardData &bd, unsigned int t, const Matrix &q_prev);
+
+  // Perform the backward steps from t1 down to t0 using the checkpoint at t0
+  // and s free checkpoints
+  void ReverseSegment(BackwardData &bd, unsigned int t0, unsigned int t1, unsigned int s);
+
+  // Timepoint in (t0, t1) at which revolve places the next checkpoint
+  static unsigned int GetCheckpointSplit(unsigned int t0, unsigned int t1, unsigned int s);
+
   // Initial ladnmark coordinates - fixed for duration
   Matrix q0;
 
   // Standard deviation of Gaussian kernel; time step
   TFloat sigma, dt;
 
+  // Squared distance beyond which the kernel is treated as zero, and the
+  // grid used to find the pairs of points closer than that
+  TFloat cutoff_sq;
+  PointSetCutoffGrid<TFloat, VDim> grid;
+
   // Number of timesteps for integration; number of points
   unsigned int N, k;
 
@@ -93,17 +222,37 @@ protected:
   // Streamlines - paths of the landmarks over time
   std::vector<Matrix> Qt;
 
+  // With checkpointing, the stored timepoints, the controls of the last
+  // flow, and the most recent timepoint returned by GetQt()
+  unsigned int n_checkpoints;
+  std::map<unsigned int, Matrix> checkpoints;
+  const MatrixArray *u_flow;
+  Matrix q_cursor;
+  int t_cursor;
+
   // Streamline velocities
   std::vector<Matrix> Vt;
 
-    // Multi-threaded quantities
+  // Coordinates, controls and adjoints of the points in the slot order of
+  // the grid, one array per dimension. The float copies are used in the
+  // mixed precision mode
+  Vector soa_q[VDim], soa_u[VDim], soa_alpha[VDim];
+  vnl_vector<float> soa_qf[VDim], soa_uf[VDim], soa_alphaf[VDim];
+  bool mixed_precision;
+
+  // Copy the rows of a matrix, or a set of column vectors, into arrays in
+  // slot order
+  template <class TKernel> void ScatterToSlots(const Matrix &m, vnl_vector<TKernel> soa[]);
+  template <class TKernel> void ScatterToSlots(const Vector v[], vnl_vector<TKernel> soa[]);
+
+  // Multi-threaded quantities. Each thread computes whole rows of the
+  // sums over the pairs of points, so the threads write to separate entries
+  // of the output vectors
   struct ThreadData 
     {
     // List of rows handled by this thread
     std::vector<unsigned int> rows;
     TFloat KE;
-    Vector d_q__d_t[VDim];
-    Vector alpha_U[VDim], alpha_Q[VDim];
     };
 
   // Data associated with each thread
@@ -114,12 +263,18 @@ protected:
 
   void SetupMultiThreaded();
 
+  // The workers read the points from arrays in slot order. The kernel is
+  // computed in TKernel and the sums are accumulated in TFloat
+  template <class TKernel>
   void ComputeEnergyAndVelocityThreadedWorker(
-    const Matrix &q, const Matrix &u, ThreadData *tdi);
+    const vnl_vector<TKernel> slot_q[], const vnl_vector<TKernel> slot_u[],
+    ThreadData *tdi);
 
+  template <class TKernel>
   void PropagateAlphaBackwardsThreadedWorker(
-    const Matrix &q, const Matrix &u, 
-    const Vector alpha[], ThreadData *tdi);
+    const vnl_vector<TKernel> slot_q[], const vnl_vector<TKernel> slot_u[],
+    const vnl_vector<TKernel> slot_alpha[],
+    Vector alpha_Q[], Vector alpha_U[], ThreadData *tdi);
 };
 
 
@@ -8,6 +8,9 @@
 #include <vnl_vector_fixed.h>
 #include <tuple>
 #include <unordered_set>
+#include <algorithm>
+#include <thread>
+#include <cstdint>
 #include "SparseMatrix.h"
 
 namespace qcqp {
@@ -224,6 +227,8 @@ class QuadraticExpression
 {
 public:
   friend class Problem;
+  friend class CompiledExpressionSet;
+  friend class CompiledLoss;
 
   double &A(ElementRef e1, ElementRef e2)
     {
@@ -381,6 +386,7 @@ public:
     : name(name), weight(weight) {}
 
   friend class Problem;
+  friend class CompiledLoss;
 
 protected:
 
@@ -393,6 +399,231 @@ protected:
 
 
 
+/**
+ * Split the range [0, n) into contiguous blocks and call f(t, k0, k1) for each
+ * block t in a separate thread. No threads are created if n is smaller than
+ * min_block. Returns the number of blocks used.
+ */
+template <class TFunc>
+unsigned int parallel_blocks(size_t n, unsigned int n_threads, size_t min_block, TFunc f)
+{
+  size_t nb = std::min((size_t) std::max(n_threads, 1u), std::max(n / min_block, (size_t) 1));
+  if(nb == 1)
+    {
+    f(0u, (size_t) 0, n);
+    return 1;
+    }
+
+  std::vector<std::thread> threads;
+  for(size_t t = 0; t < nb; t++)
+    threads.push_back(std::thread(f, (unsigned int) t, n * t / nb, n * (t + 1) / nb));
+  for(auto &th : threads)
+    th.join();
+  return nb;
+}
+
+/**
+ * Stable least significant digit radix sort of an array by an integer key
+ * with values in [0, max_key]. Each pass counts the digits in blocks of the
+ * array in parallel, and each block then scatters its items to their own
+ * positions in the output.
+ */
+template <class TItem, class TKeyFunc>
+void parallel_radix_sort(std::vector<TItem> &a, TKeyFunc key, uint64_t max_key, unsigned int n_threads)
+{
+  const unsigned int n_bits = 11, n_digits = 1u << n_bits;
+  std::vector<TItem> buffer(a.size());
+  std::vector< std::vector<size_t> > count(std::max(n_threads, 1u));
+
+  for(unsigned int shift = 0; shift < 64 && (max_key >> shift) > 0; shift += n_bits)
+    {
+    // Count the digits in each block
+    unsigned int nb = parallel_blocks(a.size(), n_threads, 65536,
+                                      [&](unsigned int t, size_t i0, size_t i1)
+      {
+      count[t].assign(n_digits, 0);
+      for(size_t i = i0; i < i1; i++)
+        count[t][(key(a[i]) >> shift) & (n_digits - 1)]++;
+      });
+
+    // Turn the counts into starting positions, ordered by digit and block
+    size_t pos = 0;
+    for(unsigned int d = 0; d < n_digits; d++)
+      for(unsigned int t = 0; t < nb; t++)
+        {
+        size_t c = count[t][d];
+        count[t][d] = pos;
+        pos += c;
+        }
+
+    // Scatter. The blocks are the same as in the counting pass
+    parallel_blocks(a.size(), n_threads, 65536, [&](unsigned int t, size_t i0, size_t i1)
+      {
+      for(size_t i = i0; i < i1; i++)
+        buffer[count[t][(key(a[i]) >> shift) & (n_digits - 1)]++] = a[i];
+      });
+
+    a.swap(buffer);
+    }
+}
+
+/**
+ * A set of quadratic expressions (e.g., all constraints) compiled into flat
+ * arrays. The quadratic and linear terms of expression k are stored in the
+ * ranges [a_ptr[k], a_ptr[k+1]) and [b_ptr[k], b_ptr[k+1]) of coordinate
+ * arrays, so that evaluating all expressions is a single pass over memory.
+ */
+class CompiledExpressionSet
+{
+public:
+
+  template <class TExpr>
+  void Compile(const std::vector<TExpr *> &expr)
+    {
+    size_t n = expr.size(), na = 0, nb = 0;
+    for(auto *e : expr)
+      {
+      na += e->m_Aij.size();
+      nb += e->m_bi.size();
+      }
+
+    a_ptr.assign(1, 0); a_ptr.reserve(n + 1);
+    b_ptr.assign(1, 0); b_ptr.reserve(n + 1);
+    a_i.clear(); a_i.reserve(na);
+    a_j.clear(); a_j.reserve(na);
+    a_val.clear(); a_val.reserve(na);
+    b_i.clear(); b_i.reserve(nb);
+    b_val.clear(); b_val.reserve(nb);
+    c.resize(n);
+
+    for(size_t k = 0; k < n; k++)
+      {
+      for(auto it_a : expr[k]->m_Aij)
+        {
+        a_i.push_back(std::get<0>(it_a.first));
+        a_j.push_back(std::get<1>(it_a.first));
+        a_val.push_back(it_a.second);
+        }
+      for(auto it_b : expr[k]->m_bi)
+        {
+        b_i.push_back(it_b.first);
+        b_val.push_back(it_b.second);
+        }
+      a_ptr.push_back(a_i.size());
+      b_ptr.push_back(b_i.size());
+      c[k] = expr[k]->m_c;
+      }
+    }
+
+  size_t size() const { return c.size(); }
+
+  /** Evaluate expressions k0 ... k1-1 */
+  template <typename T>
+  void Evaluate(const T *x, T *y, size_t k0, size_t k1) const
+    {
+    for(size_t k = k0; k < k1; k++)
+      {
+      double v = c[k];
+      for(size_t q = a_ptr[k]; q < a_ptr[k+1]; q++)
+        v += x[a_i[q]] * x[a_j[q]] * a_val[q];
+      for(size_t q = b_ptr[k]; q < b_ptr[k+1]; q++)
+        v += x[b_i[q]] * b_val[q];
+      y[k] = v;
+      }
+    }
+
+protected:
+  std::vector<size_t> a_ptr, b_ptr;
+  std::vector<int> a_i, a_j, b_i;
+  std::vector<double> a_val, b_val, c;
+};
+
+/**
+ * The weighted sum of all the losses, compiled into the form
+ *   f(x) = 1/2 x^t G x + b^t x + c
+ * where G = A + A^t is stored as a symmetric matrix in CSR format. The
+ * gradient G x + b is then computed one row at a time, and the objective
+ * reuses the product G x.
+ */
+class CompiledLoss
+{
+public:
+
+  template <class TLoss>
+  void Compile(const std::vector<TLoss *> &losses, size_t n)
+    {
+    // Gather the weighted entries of G in coordinate form
+    std::vector< std::tuple<int, int, double> > coo;
+    b.assign(n, 0.0);
+    c = 0.0;
+    for(auto *l : losses)
+      {
+      for(auto it_a : l->m_Aij)
+        {
+        int i = std::get<0>(it_a.first), j = std::get<1>(it_a.first);
+        double w = it_a.second * l->weight;
+        coo.push_back(std::make_tuple(i, j, w));
+        coo.push_back(std::make_tuple(j, i, w));
+        }
+      for(auto it_b : l->m_bi)
+        b[it_b.first] += it_b.second * l->weight;
+      c += l->m_c * l->weight;
+      }
+
+    // Sort by row and column and merge the duplicates
+    std::sort(coo.begin(), coo.end(),
+              [](const std::tuple<int, int, double> &p, const std::tuple<int, int, double> &q)
+      { return std::get<0>(p) < std::get<0>(q) || (std::get<0>(p) == std::get<0>(q) && std::get<1>(p) < std::get<1>(q)); });
+
+    row_ptr.assign(n + 1, 0);
+    col.clear(); val.clear();
+    for(size_t q = 0; q < coo.size(); q++)
+      {
+      int i = std::get<0>(coo[q]), j = std::get<1>(coo[q]);
+      if(q > 0 && std::get<0>(coo[q-1]) == i && std::get<1>(coo[q-1]) == j)
+        {
+        val.back() += std::get<2>(coo[q]);
+        }
+      else
+        {
+        col.push_back(j);
+        val.push_back(std::get<2>(coo[q]));
+        row_ptr[i + 1]++;
+        }
+      }
+    for(size_t i = 0; i < n; i++)
+      row_ptr[i + 1] += row_ptr[i];
+    }
+
+  /**
+   * Compute rows i0 ... i1-1 of the gradient and return their contribution
+   * to the objective
+   */
+  template <typename T>
+  double EvaluateRows(const T *x, T *grad_x, size_t i0, size_t i1) const
+    {
+    double f = 0.0;
+    for(size_t i = i0; i < i1; i++)
+      {
+      double gx = 0.0;
+      for(size_t q = row_ptr[i]; q < row_ptr[i+1]; q++)
+        gx += val[q] * x[col[q]];
+      f += x[i] * (0.5 * gx + b[i]);
+      if(grad_x)
+        grad_x[i] = gx + b[i];
+      }
+    return f;
+    }
+
+  double GetConstant() const { return c; }
+
+protected:
+  std::vector<size_t> row_ptr;
+  std::vector<int> col;
+  std::vector<double> val, b;
+  double c = 0.0;
+};
+
 /**
  * @brief Helper for building a quadratically constrained quadratic programming problem.
  *
@@ -402,15 +633,23 @@ class Problem
 public:
   // The Jacobian and the Hessian of Lagrangean are represented as sparse
   // 2D arrays, where each entry is used to compute the expression w^t x + z
-  // or w^t lambda + z.
+  // or w^t lambda + z. The nonzero elements of w for all the entries are
+  // stored one after another in flat arrays (see TensorWeights), and each
+  // entry holds the range of its elements.
   struct TensorRow
   {
-    std::vector< std::tuple<size_t, double> > w;
+    size_t w_begin, w_end;
     double z;
   };
 
   using SparseTensor = ImmutableSparseArray<TensorRow>;
 
+  struct TensorWeights
+  {
+    std::vector<int> index;
+    std::vector<double> weight;
+  };
+
   /**
    * Add a variable tensor to the optimization. The variable is really just an index into the
    * array of optimization variables that can then be referenced by name conveniently.
@@ -477,9 +716,32 @@ public:
   /** Get the sparse array used to compute the Jacobian */
   SparseTensor &GetConstraintsJacobian() { return m_Jacobian; }
 
-  /** Get the sparse array used to compute the Jacobian */
+  /** Get the sparse array used to compute the Hessian of the Lagrangean */
   SparseTensor &GetHessianOfLagrangean() { return m_Hessian; }
 
+  /** Compute the values of the nonzero entries of the constraints Jacobian */
+  template <typename T>
+  void EvaluateConstraintsJacobian(const T *x, T *values)
+  {
+    EvaluateTensor(m_Jacobian, m_JacobianWeights, x, 1.0, values);
+  }
+
+  /**
+   * Compute the values of the nonzero entries of the Hessian of the Lagrangean
+   * given the weight of the objective and the Lagrange multipliers
+   */
+  template <typename T>
+  void EvaluateHessianOfLagrangean(double obj_factor, const T *lambda, T *values)
+  {
+    EvaluateTensor(m_Hessian, m_HessianWeights, lambda, obj_factor, values);
+  }
+
+  /**
+   * Set the number of threads used to evaluate the losses and constraints
+   * once the problem has been set up. Zero means all available cores
+   */
+  void SetNumberOfThreads(unsigned int n) { m_NumberOfThreads = n; }
+
   /** Get the bounds on variables */
   void GetVariableBounds(int i_var, double &lb, double &ub)
   {
@@ -522,9 +784,12 @@ public:
   template <typename T>
   double EvaluateLoss(const T* x)
   {
+    // After setup, use the compiled form of the losses
+    if(m_Compiled)
+      return EvaluateCompiledLoss(x, (T *) nullptr);
+
     // Evaluating the function means computing the quadratic form xAx+bx+c
-    // for each of the loss terms. In the future we might want to create more
-    // efficient data structures for these constraints
+    // for each of the loss terms.
     double total_loss = 0;
     for(auto *l : m_Losses)
       {
@@ -552,6 +817,13 @@ public:
   template <typename T>
   void EvaluateLossGradient(const T* x, T *grad_x)
   {
+    // After setup, use the compiled form of the losses
+    if(m_Compiled)
+      {
+      EvaluateCompiledLoss(x, grad_x);
+      return;
+      }
+
     // Initialize the gradient to zero
     for(unsigned int i = 0; i < m_Size; i++)
       grad_x[i] = 0.0;
@@ -573,6 +845,23 @@ public:
     return m_Constraints[k]->Evaluate(x);
   }
 
+  /** Compute all the constraints for given x */
+  template <typename T>
+  void EvaluateConstraints(const T* x, T *g)
+  {
+    if(m_Compiled)
+      {
+      parallel_blocks(m_CompiledConstraints.size(), GetThreadCount(), 4096,
+                      [&](unsigned int, size_t k0, size_t k1)
+        { m_CompiledConstraints.Evaluate(x, g, k0, k1); });
+      }
+    else
+      {
+      for(unsigned int k = 0; k < m_Constraints.size(); k++)
+        g[k] = m_Constraints[k]->Evaluate(x);
+      }
+  }
+
   /** Get the name of the constraint */
   std::string GetConstraintName(int k) const
   {
@@ -594,148 +883,74 @@ public:
     // The Jacobian matrix is a matrix where every row corresponds
     // to a constraint, and every column to a variable, i.e., columns are
     // the z-values.
-
-    // Allocate the row array
+    //
+    // Every coefficient of the constraints contributes one or two terms to the
+    // Jacobian. These are collected into a flat list of triplets, which is sorted
+    // and merged.
     size_t ncon = m_Constraints.size();
-    size_t *jac_row_arr = new size_t[ncon + 1];
-    jac_row_arr[0] = 0;
-
-    // The Jacobian for constraint g(x) wrt x_k is non-zero if k appears in the
-    // non-zero entries for g as either row or column
+    std::vector<size_t> jac_offset(ncon + 1, 0);
+    for(size_t k = 0; k < ncon; k++)
+      jac_offset[k+1] = jac_offset[k] + 2 * m_Constraints[k]->m_Aij.size() + m_Constraints[k]->m_bi.size();
 
-    // For each constraint, we need to compute the gradient entries. Right now we
-    // do this using a map, which might be slow
-    struct TensorRowSource { double z; std::map<int, double> w; };
-    std::vector< std::map<int, TensorRowSource> > con_jac_map(ncon);
-    for(size_t i = 0; i < ncon; i++)
+    // The constant terms of the entries use the index m_Size
+    std::vector<TensorTriplet> jac_src(jac_offset[ncon]);
+    parallel_blocks(ncon, GetThreadCount(), 1024, [&](unsigned int, size_t k0, size_t k1)
       {
-      auto &c = *m_Constraints[i];
-      auto &cm = con_jac_map[i];
-
-      for(auto it_a : c.m_Aij)
+      for(size_t k = k0; k < k1; k++)
         {
-        int i = std::get<0>(it_a.first);
-        int j = std::get<1>(it_a.first);
-        cm[i].w[j] += it_a.second;
-        cm[j].w[i] += it_a.second;
+        auto &c = *m_Constraints[k];
+        TensorTriplet *p = &jac_src[jac_offset[k]];
+        for(auto it_a : c.m_Aij)
+          {
+          int i = std::get<0>(it_a.first);
+          int j = std::get<1>(it_a.first);
+          *p++ = { k * m_Size + i, (size_t) j, it_a.second };
+          *p++ = { k * m_Size + j, (size_t) i, it_a.second };
+          }
+        for(auto it_b : c.m_bi)
+          *p++ = { k * m_Size + it_b.first, m_Size, it_b.second };
         }
-      for(auto it_b : c.m_bi)
-        {
-        int i = it_b.first;
-        cm[i].z += it_b.second;
-        }
-      }
+      });
 
-    // For each row, count the number of nonzero entries in the Jacobian
-    for(size_t i = 0; i < ncon; i++)
-      jac_row_arr[i+1] = jac_row_arr[i] + con_jac_map[i].size();
-
-    // Allocate storage for the entries
-    size_t *jac_col_arr = new size_t[jac_row_arr[ncon]];
-    TensorRow *jac_val = new TensorRow[jac_row_arr[ncon]];
-
-    // Second pass - allocate individual entries
-    for(size_t i = 0; i < ncon; i++)
-      {
-      // Reference to the constraint
-      auto &c = *m_Constraints[i];
-
-      // Record the indices of the non_zeros in the Jacobian matrix
-      int j = jac_row_arr[i];
-
-      // Iterate over the rows of the constraint matrix m_Ab
-      for(auto &it: con_jac_map[i])
-        {
-        jac_col_arr[j] = it.first;
-        jac_val[j].w.reserve(it.second.w.size());
-        for(auto it2: it.second.w)
-          jac_val[j].w.push_back({it2.first, it2.second});
-        jac_val[j].z = it.second.z;
-        j++;
-        }
-      }
-
-    // Create the Jacobian matrix
-    m_Jacobian.SetArrays(ncon, m_Size, jac_row_arr, jac_col_arr, jac_val);
+    BuildTensor(jac_src, ncon, m_Size, m_Size, m_Jacobian, m_JacobianWeights);
 
     // Now compute the Hessian of the Lagrangian. This has the dimensions
-    // n x n where n is the number of variables, and when computing we need
-    // to iterate over the Lagrange multipliers. To form this matrix, we need
-    // to 'splat' each of the constraints' A matrices
-
-    // What we essentially have to do is to transpose the way in which the
-    // constraint information is stored so that it is row/col/constraint order
-    // as opposed to the constraint/row/col order. One way to do this is using
-    // maps of maps - might be slow but let's try
-    struct SrcEntry
-    {
-      double h_loss = 0.;             // Hessian of the losses
-      std::map<int, double> h_con;    // Constraint Hessians
-    };
-
-    std::vector< std::map<int, SrcEntry > > hol_src;
-
-    // No sparsity in the rows
-    hol_src.resize(m_Size);
-
-    // Iterate over the constraints
-    for(unsigned int k = 0; k < ncon; k++)
+    // n x n where n is the number of variables, and its entries are linear in
+    // the Lagrange multipliers. Each quadratic coefficient of a constraint
+    // contributes to one entry in the upper triangle, and the coefficients of
+    // the losses contribute to the constant terms (index ncon).
+    std::vector<size_t> hol_offset(ncon + m_Losses.size() + 1, 0);
+    for(size_t k = 0; k < ncon; k++)
+      hol_offset[k+1] = hol_offset[k] + m_Constraints[k]->m_Aij.size();
+    for(size_t l = 0; l < m_Losses.size(); l++)
+      hol_offset[ncon+l+1] = hol_offset[ncon+l] + m_Losses[l]->m_Aij.size();
+
+    std::vector<TensorTriplet> hol_src(hol_offset.back());
+    parallel_blocks(ncon + m_Losses.size(), GetThreadCount(), 1024, [&](unsigned int, size_t k0, size_t k1)
       {
-      // Within the constraint, iterate over NNZ rows
-      for(auto it : m_Constraints[k]->m_Aij)
+      for(size_t k = k0; k < k1; k++)
         {
-        int i = std::get<0>(it.first);
-        int j = std::get<1>(it.first);
-        if(i <= j)
-          hol_src[i][j].h_con[k] += it.second;
-        if(j <= i)
-          hol_src[j][i].h_con[k] += it.second;
+        QuadraticExpression *qe = (k < ncon) ? (QuadraticExpression *) m_Constraints[k] : m_Losses[k - ncon];
+        double scale = (k < ncon) ? 1.0 : m_Losses[k - ncon]->weight;
+        size_t src = std::min(k, ncon);
+        TensorTriplet *p = &hol_src[hol_offset[k]];
+        for(auto it : qe->m_Aij)
+          {
+          // Diagonal entries of the Hessian are twice the coefficient
+          int i = std::get<0>(it.first);
+          int j = std::get<1>(it.first);
+          double w = (i == j ? 2.0 : 1.0) * it.second * scale;
+          *p++ = { (size_t) i * m_Size + j, src, w };
+          }
         }
-      }
+      });
 
-    // We also need to add the losses to the hessian, we can add them
-    // using index -1
-    for(auto *l : m_Losses)
-      {
-      // Within the loss, iterate over NNZ rows
-      for(auto it: l->m_Aij)
-        {
-        int i = std::get<0>(it.first);
-        int j = std::get<1>(it.first);
-        if(i <= j)
-          hol_src[i][j].h_loss += it.second * l->weight;
-        if(j <= i)
-          hol_src[j][i].h_loss += it.second * l->weight;
-        }
-      }
-
-    // Set the row index
-    size_t *hol_row_arr = new size_t[m_Size + 1];
-    hol_row_arr[0] = 0;
-    for(size_t i = 0; i < m_Size; i++)
-      hol_row_arr[i+1] = hol_row_arr[i] + hol_src[i].size();
-
-    // We can now allocate the HoL column index and data
-    size_t *hol_col_arr = new size_t[hol_row_arr[m_Size]];
-    TensorRow *hol_val = new TensorRow[hol_row_arr[m_Size]];
-
-    // Now set the values of the column arrays
-    for(size_t i = 0; i < m_Size; i++)
-      {
-      size_t j = hol_row_arr[i];
-      for(auto &it_row : hol_src[i])
-        {
-        hol_col_arr[j] = it_row.first;
-        hol_val[j].z = it_row.second.h_loss;
-        hol_val[j].w.reserve(it_row.second.h_con.size());
-        for(auto &it_w : it_row.second.h_con)
-          hol_val[j].w.push_back({it_w.first, it_w.second});
-        j++;
-        }
-      }
+    BuildTensor(hol_src, m_Size, m_Size, ncon, m_Hessian, m_HessianWeights);
 
-    // Create the sparse matrix
-    m_Hessian.SetArrays(m_Size, m_Size, hol_row_arr, hol_col_arr, hol_val);
+    // Compile the losses and constraints for evaluation
+    m_CompiledLoss.Compile(m_Losses, m_Size);
+    m_CompiledConstraints.Compile(m_Constraints);
+    m_Compiled = true;
 
     // Create the bounds arrays
     m_VariableLB.set_size(m_Size);
@@ -795,6 +1010,120 @@ public:
 
 protected:
 
+  unsigned int GetThreadCount() const
+  {
+    return m_NumberOfThreads > 0 ? m_NumberOfThreads : std::thread::hardware_concurrency();
+  }
+
+  // A contribution w to entry (row, col) of a tensor with index src in
+  // w^t v, where rc = row * n_cols + col
+  struct TensorTriplet
+  {
+    size_t rc, src;
+    double w;
+  };
+
+  // Sort the triplets, merge the duplicates and create the tensor. Triplets
+  // with src == n_src contribute to the constant term z
+  void BuildTensor(std::vector<TensorTriplet> &trip, size_t n_rows, size_t n_cols, size_t n_src,
+                   SparseTensor &tensor, TensorWeights &weights)
+  {
+    // Sort by entry, then by source
+    parallel_radix_sort(trip, [](const TensorTriplet &t) { return (uint64_t) t.src; }, n_src, GetThreadCount());
+    parallel_radix_sort(trip, [](const TensorTriplet &t) { return (uint64_t) t.rc; },
+                        (uint64_t) n_rows * n_cols, GetThreadCount());
+
+    // Count the entries in each row
+    size_t *row_arr = new size_t[n_rows + 1];
+    std::fill(row_arr, row_arr + n_rows + 1, 0);
+    size_t n_entries = 0, n_weights = 0;
+    for(size_t q = 0; q < trip.size(); q++)
+      {
+      bool new_entry = (q == 0 || trip[q].rc != trip[q-1].rc);
+      if(new_entry)
+        {
+        row_arr[trip[q].rc / n_cols + 1]++;
+        n_entries++;
+        }
+      if(trip[q].src < n_src && (new_entry || trip[q].src != trip[q-1].src))
+        n_weights++;
+      }
+    for(size_t i = 0; i < n_rows; i++)
+      row_arr[i+1] += row_arr[i];
+
+    // Merge the triplets into entries
+    size_t *col_arr = new size_t[n_entries];
+    TensorRow *val = new TensorRow[n_entries];
+    weights.index.clear(); weights.index.reserve(n_weights);
+    weights.weight.clear(); weights.weight.reserve(n_weights);
+    size_t e = 0;
+    for(size_t q = 0; q < trip.size(); q++)
+      {
+      bool new_entry = (q == 0 || trip[q].rc != trip[q-1].rc);
+      if(new_entry)
+        {
+        if(q > 0)
+          val[e++].w_end = weights.index.size();
+        col_arr[e] = trip[q].rc % n_cols;
+        val[e].w_begin = weights.index.size();
+        val[e].z = 0.0;
+        }
+
+      if(trip[q].src == n_src)
+        val[e].z += trip[q].w;
+      else if(new_entry || trip[q].src != trip[q-1].src)
+        {
+        weights.index.push_back(trip[q].src);
+        weights.weight.push_back(trip[q].w);
+        }
+      else
+        weights.weight.back() += trip[q].w;
+      }
+    if(n_entries > 0)
+      val[e].w_end = weights.index.size();
+
+    // The triplets are no longer needed
+    std::vector<TensorTriplet>().swap(trip);
+
+    tensor.SetArrays(n_rows, n_cols, row_arr, col_arr, val);
+  }
+
+  // Compute the entries z * z_scale + w^t v of a tensor
+  template <typename T>
+  void EvaluateTensor(SparseTensor &tensor, const TensorWeights &weights,
+                      const T *v, double z_scale, T *values)
+  {
+    const TensorRow *entry = tensor.GetSparseData();
+    const int *index = weights.index.data();
+    const double *weight = weights.weight.data();
+    parallel_blocks(tensor.GetNumberOfSparseValues(), GetThreadCount(), 16384,
+                    [&](unsigned int, size_t e0, size_t e1)
+      {
+      for(size_t e = e0; e < e1; e++)
+        {
+        double val = entry[e].z * z_scale;
+        for(size_t q = entry[e].w_begin; q < entry[e].w_end; q++)
+          val += v[index[q]] * weight[q];
+        values[e] = val;
+        }
+      });
+  }
+
+  // Evaluate the compiled loss and, if grad_x is not null, its gradient
+  template <typename T>
+  double EvaluateCompiledLoss(const T* x, T *grad_x)
+  {
+    std::vector<double> f_block(std::max(GetThreadCount(), 1u), 0.0);
+    unsigned int nb = parallel_blocks(m_Size, GetThreadCount(), 4096,
+                                      [&](unsigned int t, size_t i0, size_t i1)
+      { f_block[t] = m_CompiledLoss.EvaluateRows(x, grad_x, i0, i1); });
+
+    double total_loss = m_CompiledLoss.GetConstant();
+    for(unsigned int t = 0; t < nb; t++)
+      total_loss += f_block[t];
+    return total_loss;
+  }
+
   // Known variables
   std::vector<VariableRefBase *> m_Variables;
 
@@ -812,6 +1141,7 @@ protected:
 
   // Jacobian and Hessian computed for this problem
   SparseTensor m_Jacobian, m_Hessian;
+  TensorWeights m_JacobianWeights, m_HessianWeights;
 
   // Variable bounds - available after SetupProblem
   vnl_vector<double> m_VariableLB, m_VariableUB, m_VariableValue;
@@ -819,6 +1149,14 @@ protected:
   // Storage for warm start data - Lagrange multipliers
   vnl_vector<double> m_WarmStartLambda, m_WarmStartZL, m_WarmStartZU;
 
+  // Losses and constraints compiled into flat arrays by SetupProblem
+  CompiledLoss m_CompiledLoss;
+  CompiledExpressionSet m_CompiledConstraints;
+  bool m_Compiled = false;
+
+  // Number of threads for evaluation, zero for all cores
+  unsigned int m_NumberOfThreads = 0;
+
 
 };
 
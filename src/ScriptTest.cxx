@@ -13,12 +13,14 @@
 #include "SmoothedImageSampler.h"
 #include "itkOrientedRASImage.h"
 #include "TestSolver.h"
+#include "HeatGeodesicDistance.h"
 #include "vnl/vnl_erf.h"
 #include "vnl/vnl_random.h"
 
 #include "vtkOBJReader.h"
 #include "vtkBYUWriter.h"
 #include "vtkPolyData.h"
+#include "vtkSphereSource.h"
 
 #include <string>
 #include <iostream>
@@ -1133,6 +1135,7 @@ int usage()
   cout << "    ATOMMATH                   Test local medial geometry." << endl;
   cout << "    SAMPLE XX.img              Test image sampler code (SmoothedImageSampler)" << endl;
   cout << "    SPARSE                     Test sparse matrix code" << endl;
+  cout << "    HEATGEOD                   Test heat method geodesics on a sphere" << endl;
   cout << endl;
   return -1;
 }
@@ -1220,6 +1223,46 @@ int TestSparseCode()
   return diff > 1.0e-6;
 }
 
+int TestHeatGeodesicDistance()
+{
+  // Generate a unit sphere, for which geodesic distances are known exactly
+  vtkSphereSource *sphere = vtkSphereSource::New();
+  sphere->SetRadius(1.0);
+  sphere->SetThetaResolution(64);
+  sphere->SetPhiResolution(64);
+  sphere->Update();
+  vtkPolyData *mesh = sphere->GetOutput();
+
+  HeatGeodesicDistance hgd;
+  hgd.SetMesh(mesh);
+
+  // Compute distances from two sources in a single batch
+  size_t n = hgd.GetNumberOfVertices();
+  size_t src[] = { 0, n / 2 };
+  vnl_vector<double> dist(2 * n);
+  hgd.ComputeDistances(2, src, dist.data_block());
+
+  // Compare to great circle distances
+  double maxErr = 0.0, meanErr = 0.0;
+  for(size_t r = 0; r < 2; r++)
+    {
+    SMLVec3d xs(mesh->GetPoint(src[r]));
+    for(size_t i = 0; i < n; i++)
+      {
+      SMLVec3d xi(mesh->GetPoint(i));
+      double cosang = std::max(-1.0, std::min(1.0, dot_product(xs, xi)));
+      double err = fabs(dist[r * n + i] - acos(cosang));
+      maxErr = std::max(maxErr, err);
+      meanErr += err / (2 * n);
+      }
+    }
+
+  sphere->Delete();
+
+  printf("Heat geodesic error: mean %e, max %e\n", meanErr, maxErr);
+  return meanErr > 0.05;
+}
+
 int main(int argc, char *argv[])
 {
   // Different tests that can be executed
@@ -1274,6 +1317,8 @@ int main(int argc, char *argv[])
     return TestAtomMath();
   else if(0 == strcmp(argv[1], "SPARSE"))
     return TestSparseCode();
+  else if(0 == strcmp(argv[1], "HEATGEOD"))
+    return TestHeatGeodesicDistance();
   else if(0 == strcmp(argv[1], "SAMPLE"))
     {
     if(argc < 3)
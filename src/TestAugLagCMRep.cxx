@@ -537,6 +537,15 @@ struct AugLagMedialFitParameters
   // Sigma of the Gaussian kernel
   double sigma;
 
+  // Pairs of points where the kernel falls below this value are skipped
+  double kernel_tol;
+
+  // Number of flow timepoints kept in memory, zero to keep all
+  unsigned int n_checkpoints;
+
+  // Evaluate the flow kernel in single precision
+  bool kernel_mixed_precision;
+
   // Sigma for the image smoothing
   double image_sigma;
  
@@ -577,7 +586,8 @@ struct AugLagMedialFitParameters
 
   // Default initializer
   AugLagMedialFitParameters()
-    : nt(40), w_kinetic(0.05), sigma(2.0), image_sigma(0.2),
+    : nt(40), w_kinetic(0.05), sigma(2.0), kernel_tol(0.0), n_checkpoints(0),
+      kernel_mixed_precision(false), image_sigma(0.2),
       mu_init(1), mu_scale(1.0),
       gradient_iter(6000), al_iter(10),
       bfgs_ftol(1e-5), al_max_con(1e-4),
@@ -2488,7 +2498,9 @@ public:
     Traits::PrecomputeHessianData(model, target, param.limit_surface_constraints, &hess_data);
 
     // Initialize the hamiltonian system
-    ocsys = new OCSystem(q0, param.sigma, param.nt);
+    ocsys = new OCSystem(q0, param.sigma, param.nt, param.kernel_tol);
+    ocsys->SetNumberOfCheckpoints(param.n_checkpoints);
+    ocsys->SetMixedPrecision(param.kernel_mixed_precision);
 
     // There is a control (and constraints) at every time point
     u.resize(param.nt, Matrix(nvtx, 3));
@@ -3724,9 +3736,15 @@ int usage()
     "  -wk <value>        : Weight of the kinetic energy term (%f)\n"
     "  -mu <value>        : Initial value of the augmented lagrangian mu (%f)\n"
     "  -ks <value>        : Standard deviation (mm) of Gaussian in flow kernel (%f)\n"
+    "  -ktol <value>      : Skip pairs of points where the flow kernel is below this\n"
+    "                       value, e.g., 1e-6 (%g)\n"
+    "  -kmixed            : Flag, evaluate the flow kernel in single precision while\n"
+    "                       accumulating the flow and its gradient in double precision\n"
     "  -is <value>        : Standard deviation (in voxels) of the image smoothing kernel (%f)\n"
     "  -n <int> <int>     : Number of aug. lag.  (%d) and inner BFGS (%d) iterations\n"
     "  -t <int>           : Number of flow time steps (%d)\n"
+    "  -ckpt <int>        : Keep only this many flow time steps in memory and recompute\n"
+    "                       the others when needed. By default, all are kept\n"
     "  -T                 : Flag, specifies that constraints applied at all time points.\n"
     "                       When not set, constraints applied at endpoint of flow only.\n"
     "  -L                 : Flag, specifies that constraints are applied to the limit surface\n"
@@ -3741,7 +3759,7 @@ int usage()
     "  -D                 : Enable derivative checks\n"
     "  -noslack           : Use set of constraints without slack variables\n"
     "  -cmd <value>       : Maximum subdivision depth at which constraints are applied\n",
-    param.w_kinetic, param.mu_init, param.sigma, param.image_sigma,
+    param.w_kinetic, param.mu_init, param.sigma, param.kernel_tol, param.image_sigma,
     param.al_iter, param.gradient_iter,param.nt,
     param.loop_subdivision_level,
     param.bfgs_ftol, param.al_max_con
@@ -3851,6 +3869,14 @@ int main(int argc, char *argv[])
       {
       param.sigma = cl.read_double();
       }
+    else if(command == "-ktol")
+      {
+      param.kernel_tol = cl.read_double();
+      }
+    else if(command == "-kmixed")
+      {
+      param.kernel_mixed_precision = true;
+      }
     else if(command == "-is")
       {
       param.image_sigma = cl.read_double();
@@ -3864,6 +3890,10 @@ int main(int argc, char *argv[])
       {
       param.nt = (unsigned int) cl.read_integer();
       }
+    else if(command == "-ckpt")
+      {
+      param.n_checkpoints = (unsigned int) cl.read_integer();
+      }
     else if(command == "-T")
       {
       param.interp_mode = true;
@@ -6,9 +6,11 @@
 #include <cstdlib>
 #include <algorithm>
 #include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
 #include <SparseMatrix.h>
 #include <vtkDijkstraGraphGeodesicPath.h>
-#include <vtkSelectEnclosedPoints.h>
 #include <vtkThresholdPoints.h>
 #include <vtkBoundingBox.h>
 #include <vtkCellArray.h>
@@ -32,6 +34,7 @@
 #include <vtkQuadricClustering.h>
 #include <vnl/vnl_vector.h>
 #include <vnl/vnl_cross.h>
+#include <vnl/vnl_matlab_filewrite.h>
 #include <vtkLinearSubdivisionFilter.h>
 #include <vtkLoopSubdivisionFilter.h>
 #include <vtkUnstructuredGrid.h>
@@ -46,8 +49,9 @@
 #include <itkVectorImage.h>
 
 #include "util/ReadWriteVTK.h"
+#include "util/PointInMeshClassifier.h"
 
-#include <libqhull_r/libqhull_r.h>
+#include <libqhull_r/qhull_ra.h>
 
 using namespace std;
 
@@ -55,6 +59,40 @@ typedef std::pair<vtkIdType, vtkIdType> VertexPair;
 typedef std::set< std::pair<vtkIdType, vtkIdType> > VertexPairSet;
 typedef std::vector<VertexPair> VertexPairArray;
 
+// Faces (ridges) of a Voronoi diagram as reported by Qhull. The vertices of
+// ridge j are ids[offset[j]] ... ids[offset[j+1]-1], using Qhull's Voronoi
+// vertex numbering, in which 0 is the vertex at infinity
+struct VoronoiRidges
+{
+  VertexPairArray gen;
+  std::vector<size_t> offset = std::vector<size_t>(1, 0);
+  std::vector<vtkIdType> ids;
+};
+
+// Qhull state together with the ridge storage. Qhull only passes the qhT
+// pointer to the ridge callback, so qhT must be the first member
+struct VoronoiQhull
+{
+  qhT qh;
+  VoronoiRidges *ridges;
+};
+
+// Callback invoked by qh_eachvoronoi_all for each ridge, in place of the
+// printing routine used for the 'Fv' output option
+void VoronoiQhullRidgeCallback(
+  qhT *qh, FILE *fp, vertexT *vertex, vertexT *vertexA, setT *centers, boolT unbounded)
+{
+  VoronoiRidges *ridges = reinterpret_cast<VoronoiQhull *>(qh)->ridges;
+  ridges->gen.push_back(make_pair(
+    (vtkIdType) qh_pointid(qh, vertex->point), 
+    (vtkIdType) qh_pointid(qh, vertexA->point)));
+
+  facetT *facet, **facetp;
+  FOREACHfacet_(centers)
+    ridges->ids.push_back(facet->visitid);
+  ridges->offset.push_back(ridges->ids.size());
+}
+
 
 
 void WriteVTKData(vtkUnstructuredGrid *data, string fn)
@@ -82,40 +120,28 @@ vtkPolyData *ReadVoronoiOutput(
   fin >> junk;
   fin >> nv; 
 
-  vtkSelectEnclosedPoints *sel = vtkSelectEnclosedPoints::New();
-  sel->SetTolerance(xTol);
-  sel->Initialize(bnd);
-
   // Create an array of points
   vtkPoints *pts = vtkPoints::New();
   pts->SetNumberOfPoints(nv);
 
+  std::vector<double> x(3 * nv);
+  for(size_t i = 0; i < 3 * nv; i++)
+    fin >> x[i];
+
   // Create an array of in/out flags
   bool *ptin = new bool[nv];
 
-  // Progress bar
   cout << "Selecting points inside mesh (n = " << nv << ")" << endl;
-  cout << "|         |         |         |         |         |" << endl;
-  size_t next_prog_mark = nv / 50;
+  PointInMeshClassifier pimc(bnd, xTol);
+  pimc.Classify(nv, x.data(), ptin);
 
   for(size_t i = 0; i < nv; i++)
     {
-    double x,y,z;
-    fin >> x;
-    fin >> y;
-    fin >> z;
-    pts->SetPoint(i,x,y,z);
+    pts->SetPoint(i, &x[3*i]);
 
     // Is this point outside of the bounding box
-    ptin[i] = bbox->ContainsPoint(x,y,z) && sel->IsInsideSurface(x,y,z);
-    
-    if(i >= next_prog_mark)
-      {
-      cout << "." << flush;
-      next_prog_mark += nv / 50;
-      }
+    ptin[i] = ptin[i] && bbox->ContainsPoint(x[3*i], x[3*i+1], x[3*i+2]);
     }
-  cout << "." << endl;
 
   // Read the number of cells
   fin >> np;
@@ -249,6 +275,7 @@ int usage()
   cout << "General Options:         " << endl;
   cout << "    -z <level> <mode>    Subdivide input mesh prior to skeletonization" << endl;
   cout << "                         mode is either 'loop' or 'linear'" << endl;
+  cout << "    -n N                 Number of threads to use (default: all available cores)" << endl;
   cout << "Pruning Options:" << endl;
   cout << "    -e N                 Minimal number of mesh edges separating two generator" << endl;
   cout << "                         points of a VD face for it to be considered (try 2, 3)" << endl;
@@ -267,6 +294,7 @@ int usage()
   cout << "    -s mesh.vtk          Load a skeleton from mesh.vtk and compare to the output skeleton" << endl;
   cout << "    -R N xyz.mat d.mat   Generate N random samples from the skeleton and save their coordiantes" << endl;
   cout << "                         to xyz.mat and geodesic distances to d.mat" << endl;
+  cout << "    -B                   Save the -R matrices as binary MATLAB (v4) .mat files instead of text" << endl;
   cout << "    -T name.vtk          Generate thickness map on the boundary. The thickness is the distance" << endl;
   cout << "                         from each boundary point to the closest pruned skeleton point" << endl;
   cout << "    -I in.nii thickness.nii depth.nii " << endl; 
@@ -318,8 +346,8 @@ int cmrep_vskel_main(int argc, char *argv[])
   string fnImgRef, fnImgThick, fnImgDepth;
   string fnTetraMesh;
   double xPrune = 2.0, xSearchTol = 1e-6;
-  int nComp = 0, nDegrees = 0, nRandSamp = 0, nBins = 0;
-  bool flagGeodFull = false;
+  int nComp = 0, nDegrees = 0, nRandSamp = 0, nBins = 0, nThreads = 0;
+  bool flagGeodFull = false, flagBinaryMat = false;
   int subLevel = 0;
   SubMode subMode = LINEAR;
   bool skipCellDataToPointData = false;
@@ -403,10 +431,18 @@ int cmrep_vskel_main(int argc, char *argv[])
       fnXYZ = argv[++iArg];
       fnDist = argv[++iArg];
       }
+    else if(arg == "-B")
+      {
+      flagBinaryMat = true;
+      }
     else if(arg == "-d")
       {
       fnTetraMesh = argv[++iArg];
       }
+    else if(arg == "-n")
+      {
+      nThreads = atoi(argv[++iArg]);
+      }
     else
       {
       cerr << "Bad option " << arg << endl;
@@ -456,57 +492,72 @@ int cmrep_vskel_main(int argc, char *argv[])
   vtkBoundingBox fBoundBox;
   fBoundBox.SetBounds(bbBnd);
 
-  // Create temporary files for the points and for the output
-  FILE *f_qh_in = std::tmpfile();
-  FILE *f_qh_out = std::tmpfile();
+  // Pass the boundary coordinates to Qhull as an in-memory array
+  vtkIdType nbp = bnd->GetNumberOfPoints();
+  std::vector<coordT> qh_points(3 * nbp);
+  for(vtkIdType i = 0; i < nbp; i++)
+    bnd->GetPoint(i, &qh_points[3 * i]);
+
+  // Compute the Voronoi diagram with QHull (equivalent to qvoronoi)
+  VoronoiQhull vqh;
+  VoronoiRidges ridges;
+  vqh.ridges = &ridges;
+  qhT *qh = &vqh.qh;
+  qh_zero(qh, stderr);
+
+  cout << "Using Qhull to compute Voronoi diagram from " << nbp << " input points." << endl;
+  char qh_cmd[] = "qhull d v Qbb";
+  int qh_rc = qh_new_qhull(qh, 3, (int) nbp, qh_points.data(), False, qh_cmd, NULL, stderr);
+  if(qh_rc)
+    {
+    cerr << "Qhull failed with exit code " << qh_rc << endl;
+    qh_freeqhull(qh, !qh_ALL);
+    int curlong, totlong;
+    qh_memfreeshort(qh, &curlong, &totlong);
+    return -1;
+    }
 
-  fprintf(f_qh_in, "%d\n3\n", (int) bnd->GetNumberOfPoints());
-  for(vtkIdType i = 0; i < bnd->GetNumberOfPoints(); i++)
-    fprintf(f_qh_in, "%f %f %f\n", bnd->GetPoint(i)[0], bnd->GetPoint(i)[1], bnd->GetPoint(i)[2]);
-  rewind(f_qh_in);
+  // Walk the Voronoi ridges, i.e., the faces of the Voronoi diagram. This also
+  // assigns to each lower Delaunay facet its Voronoi vertex index (visitid),
+  // with index 0 reserved for the vertex at infinity
+  qh_eachvoronoi_all(qh, NULL, &VoronoiQhullRidgeCallback, False, qh_RIDGEall, True);
+
+  // Number of finite vertices in the Voronoi diagram
+  size_t nv = 0;
+  facetT *facet;
+  FORALLfacets
+    nv = std::max(nv, (size_t) facet->visitid);
+
+  // Get the coordinates of the Voronoi vertices, i.e., the circumcenters of 
+  // the Delaunay tetrahedra
+  std::vector<double> vcenter(3 * nv, 0.0);
+  FORALLfacets
+    {
+    if(facet->visitid > 0)
+      {
+      if(!facet->center)
+        facet->center = qh_facetcenter(qh, facet->vertices);
+      for(int d = 0; d < 3; d++)
+        vcenter[3 * (facet->visitid - 1) + d] = facet->center[d];
+      }
+    }
 
-  // Compute the Voronoi diagram with QHull
-  qhT qh;
-  const char *qh_argv[] = {"", "p", "Fv"};
-  qh_init_A(&qh, f_qh_in, f_qh_out, stderr, 3, (char **) qh_argv);
-  qh.DELAUNAY = true;
-  qh.VORONOI = true;
-  qh.NOerrexit= False;
-  qh.SCALElast= True;
-  char hidden_options[]=" d n m v H U Qb QB Qc Qf Qg Qi Qm Qr Qv Qx TR E V Fa FA FC FM Fp FS Ft FV Gt Pv Q0 Q1 Q2 Q3 Q4 Q5 Q6 Q7 Q8 Q9 Q10 Q11 Q17 ";
-  qh_checkflags(&qh, qh.qhull_command, hidden_options);
-  qh_initflags(&qh, qh.qhull_command);
-  qh_option(&qh, "voronoi  _bbound-last  _coplanar-keep", NULL, NULL);
-  qh_option(&qh, "Fpoint-intersect", NULL, NULL);
-
-  int numpoints, dim;
-  boolT ismalloc;
-  auto *points = qh_readpoints(&qh, &numpoints, &dim, &ismalloc);
-  qh_init_B(&qh, points, numpoints, dim, ismalloc);
-
-  // Run Qhull
-  cout << "Using Qhull to compute Voronoi diagram from " << numpoints << " input points." << endl;
-  qh_qhull(&qh);
-  qh_check_output(&qh);
-  qh_produce_output(&qh);
-  qh_freeqhull(&qh, qh_ALL);
-
-  // Done with input, rewind output
-  fclose(f_qh_in);
-  rewind(f_qh_out);
+  // Done with Qhull
+  int curlong, totlong;
+  qh_freeqhull(qh, !qh_ALL);
+  qh_memfreeshort(qh, &curlong, &totlong);
+  qh_points.clear();
+  qh_points.shrink_to_fit();
+
+  // Number of threads used in the parallel stages below
+  int nthreads = std::thread::hardware_concurrency();
+  if(nThreads > 0)
+    nthreads = std::min(nthreads, nThreads);
+  nthreads = std::max(nthreads, 1);
 
   // Array of generating points for each cell
   VertexPairArray pgen;
 
-  // Number of points in Voronoi mesh
-  int nv, np, junk;
-  fscanf(f_qh_out, "%d\n", &junk);
-  fscanf(f_qh_out, "%d\n", &nv);
-  
-  vtkSelectEnclosedPoints *sel = vtkSelectEnclosedPoints::New();
-  sel->SetTolerance(xSearchTol);
-  sel->Initialize(bnd);
-
   // Create an array of points
   vtkPoints *pts = vtkPoints::New();
   pts->SetNumberOfPoints(nv);
@@ -527,38 +578,64 @@ int cmrep_vskel_main(int argc, char *argv[])
   // Create an array of in/out flags
   bool *ptin = new bool[nv];
 
-  // Progress bar
-  cout << "Selecting points inside mesh (n = " << nv << ")" << endl;
-  cout << "|         |         |         |         |         |" << endl;
-  size_t next_prog_mark = nv / 50;
+  // Classify the Voronoi vertices against the boundary surface
+  cout << "Selecting points inside mesh (n = " << nv << ", threads = " << nthreads << ")" << endl;
+  if(xSearchTol > 0)
+    {
+    PointInMeshClassifier pimc(bnd, xSearchTol);
+    pimc.Classify(nv, vcenter.data(), ptin, nthreads);
+    }
+  else
+    {
+    std::fill(ptin, ptin + nv, true);
+    }
 
   for(size_t i = 0; i < nv; i++)
     {
-    double x,y,z;
-    fscanf(f_qh_out, "%lf %lf %lf\n", &x, &y, &z);
+    double x = vcenter[3*i], y = vcenter[3*i+1], z = vcenter[3*i+2];
     pts->SetPoint(i,x,y,z);
 
     // Is this point outside of the bounding box
-    if(xSearchTol > 0)
-      ptin[i] = fBoundBox.ContainsPoint(x,y,z) && sel->IsInsideSurface(x,y,z);
-    else
-      ptin[i] = fBoundBox.ContainsPoint(x,y,z);
+    ptin[i] = ptin[i] && fBoundBox.ContainsPoint(x,y,z);
+    }
+
+  // Select the faces of the Voronoi diagram that are finite and have all
+  // their vertices inside of the boundary. The vertices of the faces are 
+  // stored in a flat array, indexed by face_offset
+  size_t np = ridges.gen.size();
+  std::vector<VertexPair> face_gen;
+  std::vector<size_t> face_offset(1, 0);
+  std::vector<vtkIdType> face_ids;
+  face_gen.reserve(np);
+  face_offset.reserve(np + 1);
+
+  for(size_t j = 0; j < np; j++)
+    {
+    bool isinf = false;
+    bool isout = false;
     
-    if(i >= next_prog_mark)
+    vtkIdType *ids = ridges.ids.data() + ridges.offset[j];
+    size_t m = ridges.offset[j+1] - ridges.offset[j];
+    for(size_t k = 0; k < m; k++)
       {
-      cout << "." << flush;
-      next_prog_mark += nv / 50;
+      // Is this point at infinity?
+      if(ids[k] == 0) isinf = true; else ids[k]--;
+      if(!ptin[ids[k]]) isout = true;
+      }
+
+    if(!isinf && !isout)
+      {
+      face_gen.push_back(ridges.gen[j]);
+      face_ids.insert(face_ids.end(), ids, ids + m);
+      face_offset.push_back(face_ids.size());
       }
     }
-  cout << "." << endl;
 
-  // Read the number of cells
-  fscanf(f_qh_out, "%d\n", &np);
+  // The raw ridges are no longer needed
+  ridges = VoronoiRidges();
 
-  // Progress bar
-  cout << "Selecting faces using pruning criteria (n = " << np << ")" << endl;
-  cout << "|         |         |         |         |         |" << endl;
-  next_prog_mark = np / 50;
+  // Number of faces that are subject to pruning
+  size_t nf = face_gen.size();
 
   // Create and configure Dijkstra's alg for geodesic distance
   VTKMeshHalfEdgeWrapper hewrap_geo(bnd);
@@ -576,6 +653,98 @@ int cmrep_vskel_main(int argc, char *argv[])
   dijkstra_edge.SetEdgeWeightFunction(&wfunc_edge);
   dijkstra_edge.ComputeGraph();
 
+  // Results of the pruning tests for each face
+  enum FacePruneState { FACE_KEPT = 0, FACE_PRUNED_EDGE, FACE_PRUNED_GEO };
+  std::vector<unsigned char> face_state(nf, FACE_KEPT);
+  std::vector<double> face_r(nf, 0.0), face_dgeo(nf, 0.0);
+
+  // The pruning tests are independent across faces, so they are run in
+  // parallel, with each thread having its own Dijkstra workspaces
+  std::vector<VTKMeshShortestDistance::DijkstraAlgorithm *> ws_geo, ws_edge;
+  for(int it = 0; it < nthreads; it++)
+    {
+    ws_geo.push_back(dijkstra_geo.NewShortestPathWorkspace());
+    ws_edge.push_back(dijkstra_edge.NewShortestPathWorkspace());
+    }
+
+  // Progress bar
+  cout << "Selecting faces using pruning criteria (n = " << nf << ", threads = " << nthreads << ")" << endl;
+  cout << "|         |         |         |         |         |" << endl;
+  size_t next_prog_mark = nf / 50;
+
+  // Faces are handed out to the threads in small chunks, since the cost of
+  // the geodesic test varies a lot between faces
+  const size_t chunk_size = 256;
+  std::atomic<size_t> next_chunk(0);
+  std::mutex critical;
+  size_t n_done = 0;
+
+  std::vector<std::thread> threads;
+  for(int it = 0; it < nthreads; it++)
+    {
+    threads.push_back(std::thread([&](int it)
+      {
+      VTKMeshShortestDistance::DijkstraAlgorithm *sp_geo = ws_geo[it];
+      VTKMeshShortestDistance::DijkstraAlgorithm *sp_edge = ws_edge[it];
+
+      for(size_t j0 = next_chunk.fetch_add(chunk_size); j0 < nf; j0 = next_chunk.fetch_add(chunk_size))
+        {
+        size_t j1 = std::min(nf, j0 + chunk_size);
+        for(size_t j = j0; j < j1; j++)
+          {
+          vtkIdType ip1 = face_gen[j].first, ip2 = face_gen[j].second;
+
+          // Get the edge distance between generators
+          if(nDegrees > 0)
+            {
+            sp_edge->ComputePathsFromSource(ip1, nDegrees);
+            double elen = sp_edge->GetDistanceArray()[ip2];
+            if(elen < nDegrees)
+              {
+              face_state[j] = FACE_PRUNED_EDGE;
+              continue;
+              }
+            }
+
+          // Get the Euclidean distance between generator points
+          vnl_vector_fixed<double,3> p1, p2;
+          bnd->GetPoint(ip1, p1.data_block());
+          bnd->GetPoint(ip2, p2.data_block());
+          double r = (p1 - p2).magnitude();
+
+          // The geodesic distance between generators should exceed d * xPrune;
+          sp_geo->ComputePathsFromSource(ip1, r * xPrune + 1);
+
+          // Get the distance
+          double dgeo = sp_geo->GetDistanceArray()[ip2];
+          face_r[j] = r;
+          face_dgeo[j] = dgeo;
+
+          // If the geodesic is too short, don't insert point
+          if(dgeo < r * xPrune)
+            face_state[j] = FACE_PRUNED_GEO;
+          }
+
+        // Update the progress bar
+        std::lock_guard<std::mutex> guard(critical);
+        n_done += j1 - j0;
+        while(n_done >= next_prog_mark && next_prog_mark < nf)
+          {
+          cout << "." << flush;
+          next_prog_mark += std::max(nf / 50, (size_t) 1);
+          }
+        }
+      }, it));
+    }
+
+  // Wait for the threads to finish
+  std::for_each(threads.begin(),threads.end(),[](std::thread& x){x.join();});
+  for(int it = 0; it < nthreads; it++)
+    {
+    delete ws_geo[it];
+    delete ws_edge[it];
+    }
+
   // Keep track of number pruned
   size_t npruned_geo=0, npruned_edge=0;
 
@@ -597,101 +766,49 @@ int cmrep_vskel_main(int argc, char *argv[])
   daGeod->SetNumberOfComponents(1);
   daGeod->SetName("Geodesic");
 
-  for(size_t j = 0; j < np; j++)
+  // Insert the faces that survived pruning, in the original order
+  for(size_t j = 0; j < nf; j++)
     {
-    bool isinf = false;
-    bool isout = false;
-    
-    int m;
-    vtkIdType ip1, ip2;
-    fscanf(f_qh_out, "%d %lld %lld", &m, &ip1, &ip2);
-    m-=2;
-
-    vtkIdType *ids = new vtkIdType[m];
+    if(face_state[j] == FACE_PRUNED_EDGE)
+      { npruned_edge++; continue; }
+    if(face_state[j] == FACE_PRUNED_GEO)
+      { npruned_geo++; continue; }
+
+    vtkIdType ip1 = face_gen[j].first, ip2 = face_gen[j].second;
+    vtkIdType m = face_offset[j+1] - face_offset[j];
+    const vtkIdType *fids = face_ids.data() + face_offset[j];
+    double r = face_r[j], dgeo = face_dgeo[j];
+
+    // add the cell
+    cells->InsertNextCell(m, fids);
+    daRad->InsertNextTuple(&r);
+    daGeod->InsertNextTuple(&dgeo);
+    double ratio = dgeo / r;
+    daPrune->InsertNextTuple(&ratio);
+
+    // add the pair of generators
+    pgen.push_back(make_pair(ip1, ip2)); // TODO: is this numbering 0-based?
+
+    // For each vertex of the cell, add the generating points to its (tetra)hedra
     for(size_t k = 0; k < m; k++)
       {
-      if(k < m - 1)
-        fscanf(f_qh_out, "%lld ", ids + k);
-      else
-        fscanf(f_qh_out, "%lld\n", ids + k);
-
-      // Is this point at infinity?
-      if(ids[k] == 0) isinf = true; else ids[k]--;
-      if(!ptin[ids[k]]) isout = true;
-      }
-
-    if(!isinf && !isout)
-      {
-      bool pruned = false;
-      double r = 0, dgeo = 0;
-
-      // Get the edge distance between generators
-      dijkstra_edge.ComputeDistances(ip1, nDegrees);
-      double elen = dijkstra_edge.GetVertexDistance(ip2);
-      if(elen < nDegrees)
-        { pruned = true; npruned_edge++; }
-      else
-        {
-        // Get the Euclidean distance between generator points
-        vnl_vector_fixed<double,3> p1(bnd->GetPoint(ip1)); 
-        vnl_vector_fixed<double,3> p2(bnd->GetPoint(ip2)); 
-        r = (p1 - p2).magnitude();
-        
-        // The geodesic distance between generators should exceed d * xPrune;
-        dijkstra_geo.ComputeDistances(ip1, r * xPrune + 1);
-
-        // Get the distance
-        dgeo = dijkstra_geo.GetVertexDistance(ip2);
-
-        // If the geodesic is too short, don't insert point
-        if(dgeo < r * xPrune)
-          { pruned = true; npruned_geo++; }
-        }
-
-      if(!pruned)
-        {
-        // add the cell
-        cells->InsertNextCell(m, ids);
-        daRad->InsertNextTuple(&r);
-        daGeod->InsertNextTuple(&dgeo);
-        double ratio = dgeo / r;
-        daPrune->InsertNextTuple(&ratio);
-
-        // add the pair of generators
-        pgen.push_back(make_pair(ip1, ip2)); // TODO: is this numbering 0-based?
-
-
-        // For each vertex of the cell, add the generating points to its (tetra)hedra
-        for(size_t k = 0; k < m; k++)
-          {
-          hedra[ids[k]].insert(ip1);
-          hedra[ids[k]].insert(ip2);
-          }
-
-        // Compute the radius at each vertex of the cell
-        for(size_t k = 0; k < m; k++)
-          {
-          size_t v = ids[k];
-          vnl_vector_fixed<double, 3> Vk(pts->GetPoint(v));
-          vnl_vector_fixed<double, 3> G(bnd->GetPoint(ip1));
-          double r = (Vk - G).magnitude();
-          double r_old = daPointRadius->GetComponent(v, 0);
-          if(::isnan(r_old))
-            daPointRadius->SetComponent(v, 0, r);
-          }
-        }
+      hedra[fids[k]].insert(ip1);
+      hedra[fids[k]].insert(ip2);
       }
 
-    if(j >= next_prog_mark)
+    // Compute the radius at each vertex of the cell
+    for(size_t k = 0; k < m; k++)
       {
-      cout << "." << flush;
-      next_prog_mark += np / 50;
+      size_t v = fids[k];
+      vnl_vector_fixed<double, 3> Vk(pts->GetPoint(v));
+      vnl_vector_fixed<double, 3> G(bnd->GetPoint(ip1));
+      double r = (Vk - G).magnitude();
+      double r_old = daPointRadius->GetComponent(v, 0);
+      if(::isnan(r_old))
+        daPointRadius->SetComponent(v, 0, r);
       }
-
-    delete[] ids;
     }
 
-  fclose(f_qh_out);
   cout << "." << endl;
   cout << "Edge contraint pruned " << npruned_edge << " faces." << endl;
   cout << "Geodesic to Euclidean distance ratio contraint (" << xPrune << ") pruned " << npruned_geo << " faces." << endl;
@@ -1048,54 +1165,77 @@ int cmrep_vskel_main(int argc, char *argv[])
       iout[i]->FillBuffer(0.0);
       }
     
-    // Create locator for finding closest points
-    vtkCellLocator *loc = vtkCellLocator::New();
-    loc->SetDataSet(skelfinal);
-    loc->CacheCellBoundsOn();
-    loc->BuildLocator();
+    // Create locators for finding closest points. The cell locator keeps
+    // internal buffers during queries, so each thread gets its own. The
+    // locators are built identically, so the result does not depend on the
+    // number of threads
+    std::vector<vtkCellLocator *> locs(nthreads);
+    for(int it = 0; it < nthreads; it++)
+      {
+      locs[it] = vtkCellLocator::New();
+      locs[it]->SetDataSet(skelfinal);
+      locs[it]->CacheCellBoundsOn();
+      locs[it]->BuildLocator();
+      }
 
-    // Compute distance at each 1 voxel in the reference image
+    // Compute distance at each 1 voxel in the reference image. The image is
+    // split into slices along the last dimension that threads take in turn
     typedef itk::ImageRegionConstIteratorWithIndex<ImageType> RefIterator;
     typedef itk::ImageRegionIterator<FloatImageType> OutIterator;
-    RefIterator rit(ref, ref->GetBufferedRegion());
-    OutIterator itthick(iout[0], ref->GetBufferedRegion());
-    OutIterator itdepth(iout[1], ref->GetBufferedRegion());
-    for(; !rit.IsAtEnd(); ++rit, ++itthick, ++itdepth)
+    ImageType::RegionType region = ref->GetBufferedRegion();
+    std::atomic<long> next_slice(0);
+    long nslices = (long) region.GetSize()[2];
+
+    std::vector<std::thread> threads;
+    for(int it = 0; it < nthreads; it++)
       {
-      if(rit.Get())
+      threads.push_back(std::thread([&, it]()
         {
-        // Get the RAS coordinate of the voxel
-        ImageType::PointType p;
-        ref->TransformIndexToRASPhysicalPoint(rit.GetIndex(), p);
-        double pt[3]; pt[0] = p[0]; pt[1] = p[1]; pt[2] = p[2];
-
-        // Find closest point on the skeleton
-        double xs[3], d2, d, t;
-        int subid;
-        vtkIdType cellid;
-        
-        loc->FindClosestPoint(pt, xs, cellid, subid, d2);
-        d = sqrt(d2);
-
-        // Get thickness at that cell
-        t = finalRad->GetTuple1(cellid);
-
-        // Set thickness, depth
-        itthick.Set(t);
-        itdepth.Set(d / t);
-        /*
+        vtkCellLocator *loc = locs[it];
+        long slice;
+        while((slice = next_slice++) < nslices)
           {
-          cout << "Index: " << rit.GetIndex() << endl;
-          cout << "Point: " << p << endl;
-          cout << "Distance: " << d << endl;
-          cout << "Thickness: " << t << endl;
-          cout << "Matching cell: " << cellid << endl;
-          cout << "Corr.Point: " << xs[0] << " " << xs[1] << " " << xs[2] << endl;
+          ImageType::RegionType rslice = region;
+          rslice.SetIndex(2, region.GetIndex()[2] + slice);
+          rslice.SetSize(2, 1);
+
+          RefIterator rit(ref, rslice);
+          OutIterator itthick(iout[0], rslice);
+          OutIterator itdepth(iout[1], rslice);
+          for(; !rit.IsAtEnd(); ++rit, ++itthick, ++itdepth)
+            {
+            if(rit.Get())
+              {
+              // Get the RAS coordinate of the voxel
+              ImageType::PointType p;
+              ref->TransformIndexToRASPhysicalPoint(rit.GetIndex(), p);
+              double pt[3]; pt[0] = p[0]; pt[1] = p[1]; pt[2] = p[2];
+
+              // Find closest point on the skeleton
+              double xs[3], d2, d, t;
+              int subid;
+              vtkIdType cellid;
+
+              loc->FindClosestPoint(pt, xs, cellid, subid, d2);
+              d = sqrt(d2);
+
+              // Get thickness at that cell
+              t = finalRad->GetComponent(cellid, 0);
+
+              // Set thickness, depth
+              itthick.Set(t);
+              itdepth.Set(d / t);
+              }
+            }
           }
-        */
-        }
+        }));
       }
 
+    std::for_each(threads.begin(), threads.end(), [](std::thread &t) { t.join(); });
+
+    for(int it = 0; it < nthreads; it++)
+      locs[it]->Delete();
+
     // Write output images
     typedef itk::ImageFileWriter<FloatImageType> WriterType;
     for(size_t i = 0; i < 2; i++)
@@ -1168,45 +1308,66 @@ int cmrep_vskel_main(int argc, char *argv[])
 
     // Compute distances between landmarks
     typedef DijkstraShortestPath<double> Dijkstra;
-    unsigned int *row_index = new unsigned int[M.GetNumberOfRows()];
-    for(size_t q = 0; q < M.GetNumberOfRows(); q++)
+    unsigned int *row_index = new unsigned int[M.GetNumberOfRows() + 1];
+    for(size_t q = 0; q <= M.GetNumberOfRows(); q++)
       row_index[q] = M.GetRowIndex()[q];
     unsigned int *col_index = new unsigned int[M.GetNumberOfSparseValues()];
     for(size_t q = 0; q < M.GetNumberOfSparseValues(); q++)
       col_index[q] = M.GetColIndex()[q];
 
-    Dijkstra dijk(np, row_index, col_index, M.GetSparseData());
-
     // Initialize the distance matrix
     vnl_matrix<double> mDist(nRandSamp, nRandSamp, 0.0);
 
-    // Using the brute force approach
-    for(int i = 0; i < (int) nRandSamp; i++)
-      {
-      // Compute all pairs shortest paths
-      dijk.ComputePathsFromSource(xLandmarks[i]);
-      const double *xDist = dijk.GetDistanceArray();
+    // The sources are independent, so they are distributed between threads,
+    // each thread using its own Dijkstra instance over the shared graph
+    int nthreads_dist = std::min(nthreads, nRandSamp);
+    std::atomic<int> next_source(0);
+    std::mutex critical_dist;
+    int n_done_dist = 0;
 
-      // Get the landmark-to-landmark distances
-      for(int j = 0; j < (int) nRandSamp; j++)
+    std::vector<std::thread> threads_dist;
+    for(int it = 0; it < nthreads_dist; it++)
+      {
+      threads_dist.push_back(std::thread([&]()
         {
-        double d = xDist[xLandmarks[j]];
-        mDist[i][j] = d * d;
-        }
+        Dijkstra dijk(np, row_index, col_index, M.GetSparseData());
+        for(int i = next_source++; i < nRandSamp; i = next_source++)
+          {
+          // Compute all pairs shortest paths
+          dijk.ComputePathsFromSource(xLandmarks[i]);
+          const double *xDist = dijk.GetDistanceArray();
 
-      cout << ".";
-      if( ((i+1) % 64) == 0 || i + 1 == (int) nRandSamp )
-        cout << " n = " << i+1 << endl;
-      else
-        cout << flush;
+          // Get the landmark-to-landmark distances
+          for(int j = 0; j < (int) nRandSamp; j++)
+            {
+            double d = xDist[xLandmarks[j]];
+            mDist[i][j] = d * d;
+            }
+
+          std::lock_guard<std::mutex> guard(critical_dist);
+          n_done_dist++;
+          cout << ".";
+          if( (n_done_dist % 64) == 0 || n_done_dist == (int) nRandSamp )
+            cout << " n = " << n_done_dist << endl;
+          else
+            cout << flush;
+          }
+        }));
       }
+    std::for_each(threads_dist.begin(),threads_dist.end(),[](std::thread& x){x.join();});
 
     // Save the distance matrix
-    ofstream of1(fnDist.c_str());
-    of1 << mDist << endl;
-    of1.close();
-    // vnl_matlab_filewrite exporter(argv[3]);
-    // exporter.write(mDist, "dist");
+    if(flagBinaryMat)
+      {
+      vnl_matlab_filewrite exporter(fnDist.c_str());
+      exporter.write(mDist, "dist");
+      }
+    else
+      {
+      ofstream of1(fnDist.c_str());
+      of1 << mDist << endl;
+      of1.close();
+      }
 
     // Save the coordinates of the landmarks
     vnl_matrix<double> mCoord(nRandSamp, 3, 0.0);
@@ -1218,12 +1379,18 @@ int cmrep_vskel_main(int argc, char *argv[])
       mCoord[i][2] = xPoint[2];
       }
 
-    // Save the distance matrix
-    ofstream of2(fnXYZ.c_str());
-    of2 << mCoord << endl;
-    of2.close();
-    // vnl_matlab_filewrite exporter2(argv[2]);
-    // exporter2.write(mCoord, "xyz");
+    // Save the coordinate matrix
+    if(flagBinaryMat)
+      {
+      vnl_matlab_filewrite exporter(fnXYZ.c_str());
+      exporter.write(mCoord, "xyz");
+      }
+    else
+      {
+      ofstream of2(fnXYZ.c_str());
+      of2 << mCoord << endl;
+      of2.close();
+      }
 
     delete[] xLandmarks;
     delete[] row_index;
@@ -3,6 +3,7 @@
 
 #include "BinaryHeap.h"
 #include <limits>
+#include <vector>
 
 /**
  * This class implements the classic shortest path algorithm by the
@@ -76,7 +77,7 @@ public:
    * will be computed, and the rest will be set to infinity. This way, we can 
    * compute the distances a lot faster in certain applications
    */
-  void ComputePathsFromSource(unsigned int iSource, double xMaxDistance = INFINITE_WEIGHT)
+  virtual void ComputePathsFromSource(unsigned int iSource, double xMaxDistance = INFINITE_WEIGHT)
     {
     unsigned int i;
 
@@ -170,7 +171,6 @@ public:
     Superclass(nVertices, xAdjacencyIndex, xAdjacency, xEdgeLen)
     {
       m_Source = new unsigned int[nVertices];
-      std::cout << "GVD : " << nVertices << " " << xAdjacency[nVertices] << std::endl;
     }
 
   virtual ~GraphVoronoiDiagram()
@@ -178,7 +178,7 @@ public:
 
   /** Compute paths from multiple sources. Use this method to construct a
    * sort of a Voronoi diagram of the graph */ 
-  void ComputePathsFromManySources(unsigned int nSources, unsigned int *lSources)
+  virtual void ComputePathsFromManySources(unsigned int nSources, unsigned int *lSources)
     {
     unsigned int i;
 
@@ -249,10 +249,117 @@ public:
   unsigned int GetVertexSource(unsigned int iVertex) const
     { return m_Source[iVertex]; }
 
-private:
+protected:
   unsigned int *m_Source;
 };
 
+/**
+ * A specialization of the graph Voronoi diagram for graphs in which every
+ * edge has unit weight, i.e., distances count the number of edges. Instead
+ * of a priority queue, it uses breadth-first search with a FIFO queue, and
+ * instead of resetting all the vertices before each search, it only resets
+ * the vertices reached by the previous search. This makes depth-limited
+ * searches proportional to the size of the neighborhood explored, not to
+ * the size of the graph.
+ *
+ * The distances are the same as those computed by the superclass, including
+ * the vertices one step past the threshold xMaxDistance. The edge weight
+ * array is ignored.
+ */
+template<class TWeight>
+class UnitWeightGraphVoronoiDiagram : public GraphVoronoiDiagram<TWeight>
+{
+public:
+  typedef GraphVoronoiDiagram<TWeight> Superclass;
+  typedef DijkstraShortestPath<TWeight> ShortestPathType;
+
+  UnitWeightGraphVoronoiDiagram(
+    unsigned int nVertices, unsigned int *xAdjacencyIndex,
+    unsigned int *xAdjacency, TWeight *xEdgeLen) :
+    Superclass(nVertices, xAdjacencyIndex, xAdjacency, xEdgeLen)
+    {
+    // All vertices start out unreached, after this only the vertices in the
+    // queue need to be reset
+    for(unsigned int i = 0; i < nVertices; i++)
+      {
+      this->m_Distance[i] = ShortestPathType::INFINITE_WEIGHT;
+      this->m_Predecessor[i] = ShortestPathType::NO_PATH;
+      this->m_Source[i] = ShortestPathType::NO_PATH;
+      }
+    m_Queue.reserve(nVertices);
+    }
+
+  virtual ~UnitWeightGraphVoronoiDiagram() {}
+
+  /** Compute the number of edges on the shortest path to each vertex */
+  virtual void ComputePathsFromSource(
+    unsigned int iSource, double xMaxDistance = ShortestPathType::INFINITE_WEIGHT)
+    {
+    ResetVisited();
+    Visit(iSource, iSource, iSource, 0);
+    Search(xMaxDistance);
+    }
+
+  /** Compute the number of edges to the closest of multiple sources */
+  virtual void ComputePathsFromManySources(unsigned int nSources, unsigned int *lSources)
+    {
+    ResetVisited();
+    for(unsigned int iSource = 0; iSource < nSources; iSource++)
+      {
+      unsigned int id = lSources[iSource];
+      if(this->m_Distance[id] != 0)
+        Visit(id, id, id, 0);
+      }
+    Search(ShortestPathType::INFINITE_WEIGHT);
+    }
+
+protected:
+
+  // Vertices in the order in which they were reached. The queue is never
+  // popped, so after the search it lists all the vertices that were touched
+  std::vector<unsigned int> m_Queue;
+
+  void ResetVisited()
+    {
+    for(unsigned int k = 0; k < m_Queue.size(); k++)
+      {
+      unsigned int v = m_Queue[k];
+      this->m_Distance[v] = ShortestPathType::INFINITE_WEIGHT;
+      this->m_Predecessor[v] = ShortestPathType::NO_PATH;
+      this->m_Source[v] = ShortestPathType::NO_PATH;
+      }
+    m_Queue.clear();
+    }
+
+  void Visit(unsigned int v, unsigned int iPred, unsigned int iSource, TWeight d)
+    {
+    this->m_Distance[v] = d;
+    this->m_Predecessor[v] = iPred;
+    this->m_Source[v] = iSource;
+    m_Queue.push_back(v);
+    }
+
+  void Search(double xMaxDistance)
+    {
+    for(unsigned int head = 0; head < m_Queue.size(); head++)
+      {
+      unsigned int w = m_Queue[head];
+      TWeight dw = this->m_Distance[w];
+
+      // Vertices are reached in order of distance, so once a vertex past
+      // the threshold is reached, no other vertices need to be expanded
+      if(dw > xMaxDistance) break;
+
+      for(unsigned int i = this->m_AdjacencyIndex[w]; i < this->m_AdjacencyIndex[w+1]; i++)
+        {
+        unsigned int iNbr = this->m_Adjacency[i];
+        if(this->m_Predecessor[iNbr] == ShortestPathType::NO_PATH)
+          Visit(iNbr, w, this->m_Source[w], dw + 1);
+        }
+      }
+    }
+};
+
 template<class TWeight>
 const TWeight
 DijkstraShortestPath<TWeight>
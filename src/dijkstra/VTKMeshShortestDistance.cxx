@@ -59,7 +59,24 @@ VTKMeshShortestDistance
     }
 
   // Create the shortest path object
-  m_ShortestPath = new DijkstraAlgorithm( 
+  m_ShortestPath = NewShortestPathWorkspace();
+}
+
+VTKMeshShortestDistance::DijkstraAlgorithm *
+VTKMeshShortestDistance
+::NewShortestPathWorkspace() const
+{
+  // Edge counting does not need a priority queue
+  if(dynamic_cast<UnitLengthMeshEdgeWeightFunction *>(m_WeightFunctionPtr))
+    {
+    return new UnitWeightGraphVoronoiDiagram<float>(
+      m_NumberOfVertices,
+      m_HalfEdge->GetAdjacencyIndex(),
+      m_HalfEdge->GetAdjacency(),
+      m_EdgeWeights);
+    }
+
+  return new DijkstraAlgorithm( 
     m_NumberOfVertices, 
     m_HalfEdge->GetAdjacencyIndex(), 
     m_HalfEdge->GetAdjacency(), 
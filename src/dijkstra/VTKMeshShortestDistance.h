@@ -122,6 +122,9 @@ public:
   // type definitions
   typedef vnl_vector_fixed<double,3> Vec;
 
+  // The structure used to compute the shortest paths on the mesh
+  typedef GraphVoronoiDiagram<float> DijkstraAlgorithm;
+
   /** A callback interface used in conjunction with point checking */
   class ICellChecher { 
   public:
@@ -152,6 +155,17 @@ public:
   /** Compute the shortest distance from a list of start nodes */
   void ComputeDistances(const list<vtkIdType> &iStartNodes);
 
+  /** 
+   * Create an additional shortest path workspace over the graph computed by
+   * ComputeGraph(). The workspace shares the adjacency and edge weights with
+   * this object but has its own distance, predecessor and heap arrays, so 
+   * separate workspaces can be queried concurrently from different threads.
+   * The caller must delete the workspace before this object is destroyed.
+   * When the edge weight function is UnitLengthMeshEdgeWeightFunction, the
+   * workspace uses breadth-first search instead of Dijkstra's algorithm.
+   */
+  DijkstraAlgorithm *NewShortestPathWorkspace() const;
+
   /** Get the distance between start node and given node */
   float GetVertexDistance(vtkIdType iNode) const 
     { return m_ShortestPath->GetDistanceArray()[iNode]; }
@@ -224,7 +238,6 @@ private:
   float *m_EdgeWeights;
 
   // The structure used to compute the shortest paths on the mesh
-  typedef GraphVoronoiDiagram<float> DijkstraAlgorithm;
   DijkstraAlgorithm *m_ShortestPath;
 
   // VTK filters
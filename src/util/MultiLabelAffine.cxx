@@ -375,10 +375,9 @@ public:
   {
     m_Problem->SetVariableValues(x.data_block());
     if(f)
-      *f = m_Problem->GetObjective()->Evaluate();
+      *f = m_Problem->EvaluateObjective();
     if(g)
-      for(unsigned int i = 0; i < g->size(); i++)
-        (*g)[i] = m_Problem->GetObjectivePD(i)->Evaluate();
+      m_Problem->EvaluateObjectiveGradient(g->data_block());
   }
 
 protected:
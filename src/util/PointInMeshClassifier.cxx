@@ -0,0 +1,261 @@
+#include "PointInMeshClassifier.h"
+#include <vtkPolyData.h>
+#include <vtkCellType.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+PointInMeshClassifier
+::PointInMeshClassifier(vtkPolyData *mesh, double xTol)
+{
+  // Copy the triangle coordinates
+  for(vtkIdType iCell = 0; iCell < mesh->GetNumberOfCells(); iCell++)
+    {
+    if(mesh->GetCellType(iCell) != VTK_TRIANGLE)
+      continue;
+
+    vtkIdType nPoints;
+    const vtkIdType *xPoints;
+    mesh->GetCellPoints(iCell, nPoints, xPoints);
+    for(int j = 0; j < 3; j++)
+      {
+      double *p = mesh->GetPoint(xPoints[j]);
+      m_Tri.insert(m_Tri.end(), p, p + 3);
+      }
+    }
+
+  unsigned int nt = m_Tri.size() / 9;
+  m_TriIndex.resize(nt);
+  vector<double> centroid(3 * nt);
+  for(unsigned int t = 0; t < nt; t++)
+    {
+    m_TriIndex[t] = t;
+    for(int d = 0; d < 3; d++)
+      centroid[3*t+d] = (m_Tri[9*t+d] + m_Tri[9*t+3+d] + m_Tri[9*t+6+d]) / 3.0;
+    }
+
+  // Build the tree
+  m_Nodes.resize(1);
+  BuildNode(0, 0, nt, centroid);
+
+  // Scale the tolerance by the bounding box diagonal
+  double diag2 = 0.0;
+  for(int d = 0; d < 3; d++)
+    diag2 += (m_Nodes[0].bmax[d] - m_Nodes[0].bmin[d]) * (m_Nodes[0].bmax[d] - m_Nodes[0].bmin[d]);
+  m_Tol = xTol * sqrt(diag2);
+}
+
+void
+PointInMeshClassifier
+::BuildNode(unsigned int iNode, unsigned int i0, unsigned int i1,
+            const vector<double> &centroid)
+{
+  // Compute the bounds of the triangles and of their centroids
+  double cmin[3], cmax[3], bmin[3], bmax[3];
+  for(int d = 0; d < 3; d++)
+    {
+    bmin[d] = cmin[d] = std::numeric_limits<double>::max();
+    bmax[d] = cmax[d] = -std::numeric_limits<double>::max();
+    }
+
+  for(unsigned int i = i0; i < i1; i++)
+    {
+    unsigned int t = m_TriIndex[i];
+    for(int d = 0; d < 3; d++)
+      {
+      for(int k = 0; k < 3; k++)
+        {
+        bmin[d] = std::min(bmin[d], m_Tri[9*t+3*k+d]);
+        bmax[d] = std::max(bmax[d], m_Tri[9*t+3*k+d]);
+        }
+      cmin[d] = std::min(cmin[d], centroid[3*t+d]);
+      cmax[d] = std::max(cmax[d], centroid[3*t+d]);
+      }
+    }
+
+  for(int d = 0; d < 3; d++)
+    {
+    m_Nodes[iNode].bmin[d] = bmin[d];
+    m_Nodes[iNode].bmax[d] = bmax[d];
+    }
+
+  // Small ranges become leaves
+  if(i1 - i0 <= 4)
+    {
+    m_Nodes[iNode].iFirst = i0;
+    m_Nodes[iNode].nTri = i1 - i0;
+    return;
+    }
+
+  // Split at the median along the longest extent of the centroids
+  int axis = 0;
+  for(int d = 1; d < 3; d++)
+    if(cmax[d] - cmin[d] > cmax[axis] - cmin[axis])
+      axis = d;
+
+  unsigned int im = (i0 + i1) / 2;
+  std::nth_element(m_TriIndex.begin() + i0, m_TriIndex.begin() + im, m_TriIndex.begin() + i1,
+                   [&centroid, axis](unsigned int a, unsigned int b)
+                   { return centroid[3*a+axis] < centroid[3*b+axis]; });
+
+  // Children are stored next to each other
+  unsigned int iChild = m_Nodes.size();
+  m_Nodes[iNode].iFirst = iChild;
+  m_Nodes[iNode].nTri = 0;
+  m_Nodes.resize(iChild + 2);
+  BuildNode(iChild, i0, im, centroid);
+  BuildNode(iChild + 1, im, i1, centroid);
+}
+
+int
+PointInMeshClassifier
+::CountCrossings(const double *x, const double *d) const
+{
+  const double eps = 1.0e-9;
+  double dinv[3] = { 1.0 / d[0], 1.0 / d[1], 1.0 / d[2] };
+  int nCross = 0;
+
+  unsigned int stack[128];
+  int nStack = 0;
+  stack[nStack++] = 0;
+  while(nStack > 0)
+    {
+    const Node &node = m_Nodes[stack[--nStack]];
+
+    // Slab test against the node bounding box
+    double tmin = 0.0, tmax = std::numeric_limits<double>::max();
+    for(int k = 0; k < 3; k++)
+      {
+      double t0 = (node.bmin[k] - m_Tol - x[k]) * dinv[k];
+      double t1 = (node.bmax[k] + m_Tol - x[k]) * dinv[k];
+      if(t0 > t1) std::swap(t0, t1);
+      tmin = std::max(tmin, t0);
+      tmax = std::min(tmax, t1);
+      }
+    if(tmin > tmax)
+      continue;
+
+    if(node.nTri == 0)
+      {
+      stack[nStack++] = node.iFirst;
+      stack[nStack++] = node.iFirst + 1;
+      continue;
+      }
+
+    // Moller-Trumbore intersection with each triangle in the leaf
+    for(unsigned int i = node.iFirst; i < node.iFirst + node.nTri; i++)
+      {
+      const double *v0 = &m_Tri[9 * m_TriIndex[i]], *v1 = v0 + 3, *v2 = v0 + 6;
+      double e1[3], e2[3], s[3], p[3], q[3];
+      for(int k = 0; k < 3; k++)
+        {
+        e1[k] = v1[k] - v0[k];
+        e2[k] = v2[k] - v0[k];
+        s[k] = x[k] - v0[k];
+        }
+
+      p[0] = d[1] * e2[2] - d[2] * e2[1];
+      p[1] = d[2] * e2[0] - d[0] * e2[2];
+      p[2] = d[0] * e2[1] - d[1] * e2[0];
+      double det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+
+      // Rays parallel to the triangle do not cross it
+      if(det == 0.0)
+        continue;
+      double idet = 1.0 / det;
+
+      double u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * idet;
+      if(u < -eps || u > 1.0 + eps)
+        continue;
+
+      q[0] = s[1] * e1[2] - s[2] * e1[1];
+      q[1] = s[2] * e1[0] - s[0] * e1[2];
+      q[2] = s[0] * e1[1] - s[1] * e1[0];
+      double v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * idet;
+      if(v < -eps || u + v > 1.0 + eps)
+        continue;
+
+      double t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * idet;
+      if(t < -m_Tol)
+        continue;
+
+      // The point is on the surface, or the ray grazes an edge or vertex
+      if(t < m_Tol || u < eps || v < eps || u + v > 1.0 - eps)
+        return -1;
+
+      nCross++;
+      }
+    }
+
+  return nCross;
+}
+
+bool
+PointInMeshClassifier
+::IsInside(const double *x) const
+{
+  if(m_TriIndex.size() == 0)
+    return false;
+
+  // Points outside of the bounding box are outside
+  const Node &root = m_Nodes[0];
+  for(int k = 0; k < 3; k++)
+    if(x[k] < root.bmin[k] || x[k] > root.bmax[k])
+      return false;
+
+  // Fixed ray directions that are unlikely to be aligned with mesh features
+  static const double dirs[][3] = {
+    {  0.5773502692,  0.5773502692,  0.5773502692 },
+    { -0.7071067812,  0.4082482905,  0.5773502692 },
+    {  0.2672612419, -0.5345224838,  0.8017837257 },
+    { -0.4558423059, -0.5698028824, -0.6837634588 },
+    {  0.8164965809, -0.4082482905, -0.4082482905 }
+  };
+
+  // Majority vote over three rays that give a clean answer
+  int nIn = 0, nOut = 0;
+  for(int r = 0; r < 5 && nIn + nOut < 3; r++)
+    {
+    int nc = CountCrossings(x, dirs[r]);
+    if(nc >= 0)
+      {
+      if(nc % 2) nIn++; else nOut++;
+      }
+    }
+
+  return nIn > nOut;
+}
+
+void
+PointInMeshClassifier
+::Classify(size_t n, const double *x, bool *inside, int nThreads) const
+{
+  int nthreads = std::thread::hardware_concurrency();
+  if(nThreads > 0)
+    nthreads = std::min(nthreads, nThreads);
+  nthreads = std::max(nthreads, 1);
+
+  // Threads take chunks of points from a shared counter
+  const size_t chunk = 4096;
+  std::atomic<size_t> next_chunk(0);
+  std::vector<std::thread> threads;
+  for(int it = 0; it < nthreads; it++)
+    {
+    threads.push_back(std::thread([&]()
+      {
+      size_t i0;
+      while((i0 = next_chunk.fetch_add(chunk)) < n)
+        {
+        size_t i1 = std::min(i0 + chunk, n);
+        for(size_t i = i0; i < i1; i++)
+          inside[i] = IsInside(x + 3 * i);
+        }
+      }));
+    }
+
+  std::for_each(threads.begin(), threads.end(), [](std::thread &t) { t.join(); });
+}
@@ -0,0 +1,74 @@
+#ifndef __PointInMeshClassifier_h_
+#define __PointInMeshClassifier_h_
+
+#include <vector>
+#include <cstddef>
+
+class vtkPolyData;
+
+/**
+ * Classifies points as inside or outside of a closed triangle mesh by ray
+ * parity. The triangles are stored in a bounding volume hierarchy, so each
+ * query costs a logarithmic number of ray-triangle tests. Several rays with
+ * fixed directions are cast from each point and the result is decided by
+ * majority vote, ignoring rays that pass within numerical precision of an
+ * edge or vertex of the mesh, or that start within the tolerance of the
+ * surface. This replaces vtkSelectEnclosedPoints, which uses a cell locator
+ * one point at a time.
+ *
+ * Once constructed, the classifier is read-only and IsInside() can be called
+ * from multiple threads. Classify() processes a large array of points using
+ * a pool of threads.
+ */
+class PointInMeshClassifier
+{
+public:
+
+  /**
+   * Build the hierarchy for the triangles in the mesh (other cells are
+   * ignored). The tolerance is a fraction of the bounding box diagonal, as in
+   * vtkSelectEnclosedPoints
+   */
+  PointInMeshClassifier(vtkPolyData *mesh, double xTol = 0.001);
+
+  /** Check if a point is inside of the mesh */
+  bool IsInside(const double *x) const;
+
+  /**
+   * Classify n points stored in a flat array of coordinates. If nThreads is
+   * zero, all available cores are used
+   */
+  void Classify(size_t n, const double *x, bool *inside, int nThreads = 0) const;
+
+private:
+
+  // A node in the hierarchy. Leaf nodes have nTri > 0 and point to a range
+  // in m_TriIndex, internal nodes have their children at iFirst, iFirst+1
+  struct Node
+    {
+    double bmin[3], bmax[3];
+    unsigned int iFirst, nTri;
+    };
+
+  // Build a subtree for the triangles m_TriIndex[i0 ... i1-1]
+  void BuildNode(unsigned int iNode, unsigned int i0, unsigned int i1,
+                 const std::vector<double> &centroid);
+
+  // Count intersections of the ray x + t d, t > 0 with the mesh. Returns -1
+  // if the ray hits the mesh too close to an edge to be trusted
+  int CountCrossings(const double *x, const double *d) const;
+
+  // Triangle vertex coordinates, 9 values per triangle
+  std::vector<double> m_Tri;
+
+  // Permutation of triangles produced when building the tree
+  std::vector<unsigned int> m_TriIndex;
+
+  // Nodes of the tree, with the root at index 0
+  std::vector<Node> m_Nodes;
+
+  // Tolerance in world units
+  double m_Tol;
+};
+
+#endif // __PointInMeshClassifier_h_
@@ -26,20 +26,25 @@
 #include "vtkSmartPointer.h"
 #include "vtkCellCenters.h"
 #include "vnl/vnl_file_matrix.h"
+#include "vnl/vnl_matrix_ref.h"
 #include "vnl/vnl_vector_fixed.h"
 #include "vnl/vnl_rank.h"
 #include "vnl/vnl_math.h"
 #include "vnl/algo/vnl_matrix_inverse.h"
 #include "VTKMeshHalfEdgeWrapper.h"
+#include "SparseSolver.h"
+#include "MedialException.h"
 
 #include <string>
 #include <iostream>
 #include <vector>
 #include <algorithm>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <random>
-#include <deque>
+#include <limits>
+#include <memory>
 
 #include <vtksys/SystemTools.hxx>
 
@@ -50,6 +55,21 @@
 #include <thread>
 #include <mutex>
 #include <functional>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 const double glm_NAN = std::numeric_limits<double>::quiet_NaN();
 
@@ -127,6 +147,14 @@ const char *usage_text =
   "                 the mean edge length on the mesh.\n"
   "  --delta-t DT\n"
   "                 Specify a different step size for diffusion (default: 0.01).\n"
+  "  --diffusion-solver explicit|euler|cn\n"
+  "                 Scheme used to integrate the heat equation. The default explicit\n"
+  "                 scheme takes T/DT small steps. The implicit schemes (backward Euler\n"
+  "                 and Crank-Nicolson) factor the graph Laplacian once and take a few\n"
+  "                 large steps, which is much faster for large T. They require cmrep\n"
+  "                 to be built with a sparse solver.\n"
+  "  --diffusion-steps N\n"
+  "                 Number of steps taken by the implicit schemes (default: 8).\n"
   "  -e / --edges   \n"
   "                 Generate separate output files containing cluster edges.\n"
   "                 The file names are derived from the -m output parameters.\n"
@@ -164,7 +192,28 @@ const char *usage_text =
   "  --tfce-e <val> Set the value of the exponent applied to the cluster extent, default 0.5\n"
   "  --threads <n>  Set the number of threads used in parallel\n"
   "  -z             Standardize the dependent variable and predictors before running GLM\n"
-  "                 This way standardized betas can be obtained from the model\n";
+  "                 This way standardized betas can be obtained from the model\n"
+  "  -Y / --ydata <file>\n"
+  "                 Binary data file for the mesh given by the preceding -m option. The\n"
+  "                 data matrix is memory-mapped from this file and shared by all threads,\n"
+  "                 and the -a array is not read from the mesh. The file is created with\n"
+  "                 --convert-data using the same design matrix and row mask. Options\n"
+  "                 -X, -d and -D are only used during conversion. The data in the file\n"
+  "                 are already masked (-M) and standardized (-z), but -M and -z must\n"
+  "                 be given again with the same values since they also affect the GLM.\n"
+  "                 The file records these options and a mismatch is an error\n"
+  "  --convert-data Instead of running the GLM, write the data (after applying -R, -X,\n"
+  "                 -d, -D, -M and -z) to the files given by -Y, and write each mesh\n"
+  "                 without the data array to the -m output\n"
+  "  --seed <n>     Seed for generating random permutations (default: 0). Each permutation\n"
+  "                 is generated from the seed and its index, so results do not depend on\n"
+  "                 the number of threads\n"
+  "  --checkpoint <file>\n"
+  "                 Periodically save the results of completed permutations to this file.\n"
+  "                 If the file exists, the permutations recorded in it are not repeated,\n"
+  "                 so an interrupted run can be resumed with the same command\n"
+  "  --checkpoint-interval <sec>\n"
+  "                 How often the checkpoint file is written (default: 300 seconds)\n";
 
 int usage()
 {
@@ -274,6 +323,14 @@ vtkDataArray * GetArrayFromMesh(vtkDataSet *t, Domain dom, const char *name)
 vtkDataArray * GetArrayFromMesh(vtkDataSet *t, Domain dom, const string &name)
 { return GetArrayFromMesh(t, dom, name.c_str()); }
 
+void RemoveArrayFromMesh(vtkDataSet *t, Domain dom, const string &name)
+{
+  if(dom == POINT)
+    t->GetPointData()->RemoveArray(name.c_str());
+  else
+    t->GetCellData()->RemoveArray(name.c_str());
+}
+
 vtkDataArray * GetScalarsFromMesh(vtkDataSet *t, Domain dom)
 {
   vtkDataArray * data;
@@ -394,43 +451,250 @@ public:
   Edge(vtkIdType a, vtkIdType b) : std::pair<vtkIdType,vtkIdType>(min(a,b), max(a,b)) {}
 };
 
-void PointDataDiffusion(vtkDataSet *mesh, double scale, double dt, bool scale_is_mm, const char *array)
+typedef std::vector<Edge> EdgeList;
+
+// Method used to integrate the heat equation
+enum DiffusionSolverType { DIFFUSION_EXPLICIT, DIFFUSION_BACKWARD_EULER, DIFFUSION_CRANK_NICOLSON };
+
+// Sort a list of edges and remove the duplicates
+void MakeEdgesUnique(EdgeList &edges)
+{
+  std::sort(edges.begin(), edges.end());
+  edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+}
+
+// Explicit Euler integration of the heat equation. The update is applied one
+// edge at a time, in place, and nans do not propagate to their neighbors
+void ExplicitDiffusion(vtkDataArray *f, const EdgeList &edges, double time, double dt)
+{
+  // Count the number of neighbors of each node
+  std::vector<int> nbr(f->GetNumberOfTuples(), 0);
+  for(const Edge &e : edges)
+    {
+    nbr[e.first]++;
+    nbr[e.second]++;
+    }
+
+  // Copy f to the update array
+  unsigned int ncomp = f->GetNumberOfComponents();
+  std::vector<float> f_upd(f->GetNumberOfTuples() * ncomp);
+  for(int i = 0; i < f->GetNumberOfTuples(); i++)
+    for(int j = 0; j < ncomp; j++)
+      f_upd[i * ncomp + j] = f->GetComponent(i, j);
+
+  // Iterate
+  unsigned int jt = 0;
+  for(double t = 0; t < time - dt/2; t+=dt)
+    {
+    // Update f_upd
+    for(const Edge &e : edges)
+      {
+      double wa = dt / nbr[e.first];
+      double wb = dt / nbr[e.second];
+      float *val_a = &f_upd[e.first * ncomp];
+      float *val_b = &f_upd[e.second * ncomp];
+      for(int j = 0; j < ncomp; j++)
+        {
+        if(!vnl_math::isnan(val_b[j]))
+          val_a[j] += wa * (val_b[j] - val_a[j]);
+
+        if(!vnl_math::isnan(val_a[j]))
+          val_b[j] += wb * (val_a[j] - val_b[j]);
+        }
+      }
+
+    cout << "." << flush;
+    if((++jt) % 100 == 0 || t+dt >= time - 0.5 * dt)
+      cout << " t = " << t+dt << endl;
+    }
+
+  // Copy f_upd to f
+  for(int i = 0; i < f->GetNumberOfTuples(); i++)
+    for(int j = 0; j < ncomp; j++)
+      f->SetComponent(i, j, f_upd[i * ncomp + j]);
+}
+
+// Implicit integration of the heat equation dF/dt = -D^{-1} L F, where L = D - A
+// is the graph Laplacian and D holds the node degrees. Each step solves
+//   (D + a h L) F_new = (D - (1 - a) h L) F_old
+// with a = 1 (backward Euler) or a = 1/2 (Crank-Nicolson). The matrix on the
+// left is symmetric positive definite, so it is factored once and all the
+// components are solved for as multiple right hand sides. Nodes where any
+// component is nan are left out of the graph and keep their values
+void ImplicitDiffusion(vtkDataArray *f, const EdgeList &edges, double time,
+                       DiffusionSolverType solver, int n_steps)
+{
+  size_t n = f->GetNumberOfTuples(), ncomp = f->GetNumberOfComponents();
+
+  // Number the nodes that have no nans
+  std::vector<int> idx(n, -1);
+  size_t m = 0;
+  for(size_t i = 0; i < n; i++)
+    {
+    bool valid = true;
+    for(size_t j = 0; j < ncomp; j++)
+      if(vnl_math::isnan(f->GetComponent(i, j)))
+        valid = false;
+    if(valid)
+      idx[i] = m++;
+    }
+
+  if(m == 0)
+    return;
+
+  // Build the adjacency in compressed row form. Because the edges are sorted,
+  // the columns in each row come out sorted as well
+  std::vector<size_t> row_ptr(m + 1, 0), col;
+  for(const Edge &e : edges)
+    {
+    if(idx[e.first] >= 0 && idx[e.second] >= 0)
+      {
+      row_ptr[idx[e.first] + 1]++;
+      row_ptr[idx[e.second] + 1]++;
+      }
+    }
+  for(size_t k = 0; k < m; k++)
+    row_ptr[k + 1] += row_ptr[k];
+
+  col.resize(row_ptr[m]);
+  std::vector<size_t> fill(row_ptr.begin(), row_ptr.end() - 1);
+  for(const Edge &e : edges)
+    {
+    int a = idx[e.first], b = idx[e.second];
+    if(a >= 0 && b >= 0)
+      {
+      col[fill[a]++] = b;
+      col[fill[b]++] = a;
+      }
+    }
+
+  // Isolated nodes get a unit mass so that their rows are not singular
+  std::vector<double> deg(m);
+  for(size_t k = 0; k < m; k++)
+    deg[k] = std::max((size_t) 1, row_ptr[k + 1] - row_ptr[k]);
+
+  // Assemble the upper triangle of D + a h L
+  double h = time / n_steps;
+  double a = (solver == DIFFUSION_CRANK_NICOLSON) ? 0.5 : 1.0;
+  ImmutableSparseMatrix<double>::STLSourceType src(m);
+  for(size_t k = 0; k < m; k++)
+    {
+    size_t nk = row_ptr[k + 1] - row_ptr[k];
+    src[k].push_back(make_pair(k, deg[k] + a * h * nk));
+    for(size_t q = row_ptr[k]; q < row_ptr[k + 1]; q++)
+      if(col[q] > k)
+        src[k].push_back(make_pair(col[q], -a * h));
+    }
+
+  ImmutableSparseMatrix<double> M;
+  M.SetFromSTL(src, m);
+
+  // Factor the system
+  std::unique_ptr<SparseSolver> ss;
+  try
+    {
+    ss.reset(SparseSolver::MakeSolver(true));
+    ss->SymbolicFactorization(M);
+    ss->NumericFactorization(M);
+    }
+  catch(MedialModelException &exc)
+    {
+    throw MCException("Implicit diffusion failed: %s", exc.what());
+    }
+
+  // Components are stored one after another
+  std::vector<double> u(m * ncomp), rhs(m * ncomp);
+  for(size_t i = 0; i < n; i++)
+    if(idx[i] >= 0)
+      for(size_t j = 0; j < ncomp; j++)
+        u[j * m + idx[i]] = f->GetComponent(i, j);
+
+  for(int it = 0; it < n_steps; it++)
+    {
+    // Right hand side (D - (1 - a) h L) u
+    double b = (1.0 - a) * h;
+    for(size_t j = 0; j < ncomp; j++)
+      {
+      const double *uj = &u[j * m];
+      double *rj = &rhs[j * m];
+      for(size_t k = 0; k < m; k++)
+        {
+        double Lu = (row_ptr[k + 1] - row_ptr[k]) * uj[k];
+        for(size_t q = row_ptr[k]; q < row_ptr[k + 1]; q++)
+          Lu -= uj[col[q]];
+        rj[k] = deg[k] * uj[k] - b * Lu;
+        }
+      }
+
+    ss->Solve(ncomp, rhs.data(), u.data());
+    cout << "." << flush;
+    }
+  cout << " t = " << time << endl;
+
+  for(size_t i = 0; i < n; i++)
+    if(idx[i] >= 0)
+      for(size_t j = 0; j < ncomp; j++)
+        f->SetComponent(i, j, u[j * m + idx[i]]);
+}
+
+// Apply diffusion to an array on the graph defined by a list of unique edges
+void DiffuseOnGraph(vtkDataArray *f, const EdgeList &edges, double time, double dt,
+                    DiffusionSolverType solver, int n_steps)
+{
+  switch(solver)
+    {
+    case DIFFUSION_EXPLICIT:
+      ExplicitDiffusion(f, edges, time, dt);
+      break;
+    case DIFFUSION_BACKWARD_EULER:
+      printf("  Backward Euler integration with %d steps\n", n_steps);
+      ImplicitDiffusion(f, edges, time, solver, n_steps);
+      break;
+    case DIFFUSION_CRANK_NICOLSON:
+      printf("  Crank-Nicolson integration with %d steps\n", n_steps);
+      ImplicitDiffusion(f, edges, time, solver, n_steps);
+      break;
+    }
+}
+
+void PointDataDiffusion(vtkDataSet *mesh, double scale, double dt, bool scale_is_mm, const char *array,
+                        DiffusionSolverType solver, int n_steps)
 {
   // Diffusion simulates heat equation, dF/dt = -Laplacian(F), for t = time
   // We use the most basic approximation of the laplacian L(F) = [Sum_{j\in N(i)} F(j) - F(i)] / |N(i)|
 
-  // Create a set of all edges in the mesh
-  typedef set<Edge> EdgeSet;
-  EdgeSet edges;
+  // Create a list of all edges in the mesh
+  EdgeList edges;
 
   // Source array
   vtkDataArray *f = mesh->GetPointData()->GetArray(array);
 
-  // Get all edges into the edge set
+  // Get all edges into the edge list
   for(int i = 0; i < mesh->GetNumberOfCells(); i++)
     {
     vtkCell *cell = mesh->GetCell(i);
     vtkIdType *p = cell->GetPointIds()->GetPointer(0);
     if(cell->GetCellType() == VTK_TRIANGLE)
       {
-      edges.insert(Edge(p[0], p[1]));
-      edges.insert(Edge(p[1], p[2]));
-      edges.insert(Edge(p[0], p[2]));
+      edges.push_back(Edge(p[0], p[1]));
+      edges.push_back(Edge(p[1], p[2]));
+      edges.push_back(Edge(p[0], p[2]));
       }
     else if(cell->GetCellType() == VTK_TETRA)
       {
-      edges.insert(Edge(p[0], p[1]));
-      edges.insert(Edge(p[0], p[2]));
-      edges.insert(Edge(p[0], p[3]));
-      edges.insert(Edge(p[1], p[2]));
-      edges.insert(Edge(p[1], p[3]));
-      edges.insert(Edge(p[2], p[3]));
+      edges.push_back(Edge(p[0], p[1]));
+      edges.push_back(Edge(p[0], p[2]));
+      edges.push_back(Edge(p[0], p[3]));
+      edges.push_back(Edge(p[1], p[2]));
+      edges.push_back(Edge(p[1], p[3]));
+      edges.push_back(Edge(p[2], p[3]));
       }
     }
+  MakeEdgesUnique(edges);
 
   // Calculate the average length of each edge
   double sum_l = 0, sum_l2 = 0, n_edges = 0;
-  for(EdgeSet::iterator it = edges.begin(); it!=edges.end(); ++it)
+  for(EdgeList::iterator it = edges.begin(); it!=edges.end(); ++it)
   {
     vnl_vector_fixed<double, 3> x0, x1;
     mesh->GetPoint(it->first, x0.data_block());
@@ -448,79 +712,13 @@ void PointDataDiffusion(vtkDataSet *mesh, double scale, double dt, bool scale_is
     time = 0.5 * (scale / mean_edge_len) * (scale / mean_edge_len);
 
   // Report
-  printf("Performing diffusion on point data (t = %f, delta_t = %f)\n", time, dt);
+  printf("Performing diffusion on point data (t = %f, delta_t = %f)\n", time, 
+         solver == DIFFUSION_EXPLICIT ? dt : time / n_steps);
   printf("  Average edge length %6.4f ± %6.4f mm\n", mean_edge_len, std_edge_len);
   printf("  Estimated smoothing kernel σ = %6.4f mm\n", mean_edge_len * sqrt(2 * time));
 
-  // Count the number of neighbors of each vertex
-  std::vector<int> nbr(mesh->GetNumberOfPoints(), 0);
-  for(EdgeSet::iterator it = edges.begin(); it!=edges.end(); ++it)
-    {
-    nbr[it->first]++; 
-    nbr[it->second]++;
-    }
-
-  // Create an array for the updates
-  vtkFloatArray *f_upd = vtkFloatArray::New();
-  f_upd->SetNumberOfComponents(f->GetNumberOfComponents());
-  f_upd->SetNumberOfTuples(f->GetNumberOfTuples());
-
-  // Copy f to f_upd
-  for(int i = 0; i < f->GetNumberOfTuples(); i++)
-    for(int j = 0; j < f->GetNumberOfComponents(); j++)
-      f_upd->SetComponent(i, j, f->GetComponent(i, j));
-
   // Iterate
-  unsigned int ncomp = f->GetNumberOfComponents();
-  unsigned int jt = 0;
-  for(double t = 0; t < time - dt/2; t+=dt)
-    {
-    // Update f_upd
-    for(EdgeSet::iterator it = edges.begin(); it!=edges.end(); ++it)
-      {
-      double wa = dt / nbr[it->first];
-      double wb = dt / nbr[it->second];
-      int ia = it->first;
-      int ib = it->second;
-      float *val_a = f_upd->GetPointer(ia * ncomp);
-      float *val_b = f_upd->GetPointer(ib * ncomp);
-      for(int j = 0; j < ncomp; j++)
-        {
-        if(!vnl_math::isnan(val_b[j]))
-          val_a[j] += wa * (val_b[j] - val_a[j]);
-
-        if(!vnl_math::isnan(val_a[j]))
-          val_b[j] += wb * (val_a[j] - val_b[j]);
-        }
-      /*
-      double wa = dt / nbr[it->first];
-      double wb = dt / nbr[it->second];
-      int ia = it->first;
-      int ib = it->second;
-
-      for(int j = 0; j < f->GetNumberOfComponents(); j++)
-        {
-        double val_a_j = f->GetComponent(ia,j);
-        double val_b_j = f->GetComponent(ib,j);
-
-        if(!vnl_math::isnan(val_b_j))
-          f_upd->SetComponent(ia, j, f_upd->GetComponent(ia, j) + wa * (val_b_j - val_a_j));
-
-        if(!vnl_math::isnan(val_a_j))
-          f_upd->SetComponent(ib, j, f_upd->GetComponent(ib, j) + wb * (val_a_j - val_b_j));
-        }
-      */
-      }
-
-    // Copy f_upd to f
-    for(int i = 0; i < f->GetNumberOfTuples(); i++)
-      for(int j = 0; j < f->GetNumberOfComponents(); j++)
-        f->SetComponent(i, j, f_upd->GetComponent(i, j));
-
-    cout << "." << flush;
-    if((++jt) % 100 == 0 || t+dt >= time - 0.5 * dt)
-      cout << " t = " << t+dt << endl;
-    }
+  DiffuseOnGraph(f, edges, time, dt, solver, n_steps);
 }
 
 vnl_vector_fixed<double, 3> GetCellCenter(vtkDataSet *mesh, vtkCell *cell)
@@ -548,7 +746,8 @@ vnl_vector_fixed<double, 3> GetCellCenter(vtkDataSet *mesh, vtkCell *cell)
   return vnl_vector_fixed<double, 3>(0.0);
 }
 
-void CellDataDiffusion(vtkDataSet *mesh, double scale, double dt, bool scale_is_mm, const char *array)
+void CellDataDiffusion(vtkDataSet *mesh, double scale, double dt, bool scale_is_mm, const char *array,
+                       DiffusionSolverType solver, int n_steps)
 {
   // Diffusion, but between cells. This is really pretty ad hoc now
   
@@ -563,12 +762,11 @@ void CellDataDiffusion(vtkDataSet *mesh, double scale, double dt, bool scale_is_
   else 
     throw MCException("Unexpected mesh type in CellDataDiffusion");
 
-  // Create a set of all edges in the mesh. These are pairs of adjacent cells that
+  // Create a list of all edges in the mesh. These are pairs of adjacent cells that
   // share an edge
-  typedef set<Edge> EdgeSet;
-  EdgeSet edges;
+  EdgeList edges;
 
-  // Get all edges into the edge set
+  // Get all edges into the edge list
   for(int i = 0; i < mesh->GetNumberOfCells(); i++)
     {
     vtkCell *cell = mesh->GetCell(i);
@@ -580,7 +778,7 @@ void CellDataDiffusion(vtkDataSet *mesh, double scale, double dt, bool scale_is_
         vtkCell *face = cell->GetFace(j);
         mesh->GetCellNeighbors(i, face->GetPointIds(), nbr);
         for(int k = 0; k < nbr->GetNumberOfIds(); k++)
-          edges.insert(Edge(i, nbr->GetId(k)));
+          edges.push_back(Edge(i, nbr->GetId(k)));
         }
       }
     else if(cell->GetCellType() == VTK_TRIANGLE)
@@ -591,15 +789,16 @@ void CellDataDiffusion(vtkDataSet *mesh, double scale, double dt, bool scale_is_
         vtkCell *edge = cell->GetEdge(j);
         mesh->GetCellNeighbors(i, edge->GetPointIds(), nbr);
         for(int k = 0; k < nbr->GetNumberOfIds(); k++)
-          edges.insert(Edge(i, nbr->GetId(k)));
+          edges.push_back(Edge(i, nbr->GetId(k)));
         }
       }
     else throw MCException("Wrong cell type in CellDataDiffusion");
     }
+  MakeEdgesUnique(edges);
 
     // Calculate the average length of each edge
     double sum_l = 0, sum_l2 = 0, n_edges = 0;
-    for(EdgeSet::iterator it = edges.begin(); it!=edges.end(); ++it)
+    for(EdgeList::iterator it = edges.begin(); it!=edges.end(); ++it)
     {
       vnl_vector_fixed<double, 3> x0 = GetCellCenter(mesh, mesh->GetCell(it->first));
       vnl_vector_fixed<double, 3> x1 = GetCellCenter(mesh, mesh->GetCell(it->second));
@@ -616,62 +815,15 @@ void CellDataDiffusion(vtkDataSet *mesh, double scale, double dt, bool scale_is_
       time = 0.5 * (scale * mean_edge_len) * (scale * mean_edge_len);
 
     // Report
-    printf("Performing diffusion on cell data (t = %f, delta_t = %f)\n", time, dt);
+    printf("Performing diffusion on cell data (t = %f, delta_t = %f)\n", time,
+           solver == DIFFUSION_EXPLICIT ? dt : time / n_steps);
     printf("  There are %d pairs of adjacent cells\n", (int) edges.size());
     printf("  Average edge length %6.4f ± %6.4f mm\n", mean_edge_len, std_edge_len);
     printf("  Estimated smoothing kernel σ = %6.4f mm\n", mean_edge_len * sqrt(2 * time));
 
-  // Count the number of neighbors of each cell
-  std::vector<int> nbr(mesh->GetNumberOfCells(), 0);
-  for(EdgeSet::iterator it = edges.begin(); it!=edges.end(); ++it)
-    {
-    nbr[it->first]++; 
-    nbr[it->second]++;
-    }
-
-  // Create an array for the updates
+  // Iterate
   vtkDataArray *f = mesh->GetCellData()->GetArray(array);
-  vtkFloatArray *f_upd = vtkFloatArray::New();
-  f_upd->SetNumberOfComponents(f->GetNumberOfComponents());
-  f_upd->SetNumberOfTuples(f->GetNumberOfTuples());
-
-  // Copy f to f_upd
-  for(int i = 0; i < f->GetNumberOfTuples(); i++)
-    for(int j = 0; j < f->GetNumberOfComponents(); j++)
-      f_upd->SetComponent(i, j, f->GetComponent(i, j));
-
-  unsigned int ncomp = f->GetNumberOfComponents();
-  unsigned int jt = 0;
-  for(double t = 0; t < time - dt/2; t+=dt)
-    {
-    // Update f_upd
-    for(EdgeSet::iterator it = edges.begin(); it!=edges.end(); ++it)
-      {
-      double wa = dt / nbr[it->first];
-      double wb = dt / nbr[it->second];
-      int ia = it->first;
-      int ib = it->second;
-      float *val_a = f_upd->GetPointer(ia * ncomp);
-      float *val_b = f_upd->GetPointer(ib * ncomp);
-      for(int j = 0; j < ncomp; j++)
-        {
-        if(!vnl_math::isnan(val_b[j]))
-          val_a[j] += wa * (val_b[j] - val_a[j]);
-
-        if(!vnl_math::isnan(val_a[j]))
-          val_b[j] += wb * (val_a[j] - val_b[j]);
-        }
-      }
-
-    // Copy f_upd to f
-    for(int i = 0; i < f->GetNumberOfTuples(); i++)
-      for(int j = 0; j < f->GetNumberOfComponents(); j++)
-        f->SetComponent(i, j, f_upd->GetComponent(i, j));
-
-    cout << "." << flush;
-    if((++jt) % 100 == 0 || t+dt >= time - 0.5 * dt)
-      cout << " t = " << t+dt << endl;
-    }
+  DiffuseOnGraph(f, edges, time, dt, solver, n_steps);
 }
 
 template <class TDataset>
@@ -689,29 +841,55 @@ public:
   }
 };
 
+/**
+ * Threshold-free cluster enhancement on triangle meshes. At each level h = dh,
+ * 2dh, ... a face is above the threshold if its statistic (CELL domain) or the
+ * statistic at any of its vertices (POINT domain) is at least h. Faces above
+ * the threshold that share an edge form clusters, and every face in a cluster
+ * accumulates h^H * area^E, where in the POINT domain the area of each face is
+ * scaled by the fraction of its edges that is above the threshold.
+ *
+ * Rather than flooding the mesh at every level, the faces are sorted by the
+ * level at which they enter a cluster and at which they are entirely above the
+ * threshold, and the levels are swept from the top down. Clusters are merged
+ * with a union-find structure that keeps the area of the faces entirely above
+ * the threshold and the TFCE accumulated by the cluster, as an offset relative
+ * to the parent node. Only faces that are partially above the threshold need
+ * to be visited at each level, so the cost is O(F log F) plus the number of
+ * clusters and partial faces summed over the levels.
+ */
 template <>
 class TFCEComputer<vtkPolyData>
 {
 public:
   TFCEComputer(vtkPolyData *mesh, const char *arr_name, Domain dom, double dh, double E, double H)
-    : mesh(mesh), he(mesh), dom(dom), dh(dh), E(E), H(H),
-      triangle_queue(he.GetNumberOfFaces())
+    : mesh(mesh), dom(dom), dh(dh), E(E), H(H)
   {
     // Get the right array
     arr = dom == POINT ? mesh->GetPointData()->GetArray(arr_name) : mesh->GetCellData()->GetArray(arr_name);
 
-    // Triangles are assigned a cluster index
-    tri_cluster_idx.set_size(he.GetNumberOfFaces());
-
-    // Initialize the per-triangle tfce map
-    cluster_f.set_size(he.GetNumberOfFaces());
-    tri_tfce.set_size(he.GetNumberOfFaces());
+    // Store the vertices of each face in half-edge order, so that edge j joins
+    // vertices j and j+1, and the neighbor of the face across each edge
+    VTKMeshHalfEdgeWrapper he(mesh);
+    nf = he.GetNumberOfFaces();
+    tri_vtx.resize(3 * nf);
+    tri_nbr.resize(3 * nf);
+    for(unsigned int i = 0; i < nf; i++)
+      {
+      int he_curr = he.GetFaceHalfEdge(i);
+      for(unsigned int j = 0; j < 3; j++)
+        {
+        unsigned int f_nbr = he.GetHalfEdgeFace(he.GetHalfEdgeOpposite(he_curr));
+        tri_vtx[3 * i + j] = he.GetHalfEdgeTailVertex(he_curr);
+        tri_nbr[3 * i + j] = (f_nbr == VTKMeshHalfEdgeWrapper::NA) ? -1 : (int) f_nbr;
+        he_curr = he.GetHalfEdgeNext(he_curr);
+        }
+      }
 
     // Compute the area of each triangle
-    tri_area.set_size(he.GetNumberOfFaces());
-    for(unsigned int i = 0; i < he.GetNumberOfFaces(); i++)
+    tri_area.resize(nf);
+    for(unsigned int i = 0; i < nf; i++)
       {
-      // Compute the area of the triangle
       double p0[3], p1[3], p2[3];
       vtkCell *cell = mesh->GetCell(i);
       vtkIdType a0 = cell->GetPointId(0), a1 = cell->GetPointId(1), a2 = cell->GetPointId(2);
@@ -719,216 +897,225 @@ public:
       tri_area[i] = std::abs(vtkTriangle::TriangleArea(p0, p1, p2));
       }
 
-    // Initialize the partial area array
-    tri_supra_thresh_area.set_size(he.GetNumberOfFaces());
-
-    // Initialize the queue
-    triangle_queue.clear();
+    // Allocate the work arrays
+    events.reserve(2 * nf);
+    parent.resize(nf);
+    size.resize(nf);
+    full_area.resize(nf);
+    level_area.resize(nf);
+    tfce_offset.resize(nf);
+    active.resize(nf);
   }
 
   void Compute(vtkDataArray *tfce)
   {
-    // Reset the per-triangle TFCE map
-    tri_tfce.fill(0.0);
-
-    // Iterate over the levels
-    for(double h = dh; true; h += dh)
+    // Read the statistic
+    x.resize(arr->GetNumberOfTuples());
+    for(unsigned int i = 0; i < x.size(); i++)
+      x[i] = arr->GetTuple1(i);
+
+    // Each face enters at the largest value of the statistic at its vertices
+    // and is entirely above the threshold at the smallest one. NaNs are never
+    // above the threshold and do not clip the edges they belong to
+    events.clear();
+    double x_max = -std::numeric_limits<double>::infinity();
+    for(unsigned int i = 0; i < nf; i++)
       {
-      // Mark triangles as visitable (0) or not visitable (1) based on whether they
-      // are partially or fully above the threshold h
-      tri_cluster_idx.fill(-1);
-      unsigned int n_above = 0;
-
-      // Initialize the suprathreshold area array to the full area array
-      tri_supra_thresh_area.copy_in(tri_area.data_block());
-
+      double f_max = -std::numeric_limits<double>::infinity(), f_min = -f_max;
       if(dom == POINT)
         {
-        // Iterate over the half-edges. If one of the vertices in a half-edge is above
-        // the threshold, then the face associated with this half-edge should be
-        // assigned 0, i.e., it will be assigned to a cluster.
-        // Also compute the suprathreshold area of each face. This can be computed by
-        // scaling the area of the triangle by the proportion of each edge that is
-        // above the threshold.
-        for(unsigned int i = 0; i < he.GetNumberOfHalfEdges(); i++)
+        for(unsigned int j = 0; j < 3; j++)
           {
-          int v1 = he.GetHalfEdgeVertex(i), v0 = he.GetHalfEdgeTailVertex(i);
-          int f = he.GetHalfEdgeFace(i);
-          double h0 = arr->GetTuple1(v0), h1 = arr->GetTuple1(v1);
-          if(h0 >= h || h1 >= h)
+          double xj = x[tri_vtx[3 * i + j]];
+          if(!std::isnan(xj))
             {
-            tri_cluster_idx[he.GetHalfEdgeFace(i)] = 0;
-            n_above++;
-            if(h0 < h)
-              {
-              double t = (h - h0) / (h1 - h0);
-              tri_supra_thresh_area[f] *= 1 - t;
-              }
-            else if(h1 < h)
-              {
-              double t = (h - h0) / (h1 - h0);
-              tri_supra_thresh_area[f] *= t;
-              }
+            f_max = std::max(f_max, xj);
+            f_min = std::min(f_min, xj);
             }
           }
         }
       else
         {
-        // Just check each face - no need to check vertices
-        for(unsigned int i = 0; i < he.GetNumberOfFaces(); i++)
-          if(arr->GetTuple1(i) >= h)
-            {
-            tri_cluster_idx[i] = 0;
-            n_above++;
-            }
+        if(!std::isnan(x[i]))
+          f_max = f_min = x[i];
         }
 
-      // Zero out the area of faced that are not visited
-      for(unsigned int i = 0; i < he.GetNumberOfFaces(); i++)
-        if(tri_cluster_idx[i] < 0)
-          tri_supra_thresh_area[i] = 0.0;
+      if(f_max > -std::numeric_limits<double>::infinity())
+        {
+        events.push_back(Event(f_max, 2 * i));
+        events.push_back(Event(f_min, 2 * i + 1));
+        x_max = std::max(x_max, f_max);
+        }
+      }
 
-      // Check if any triangles are above the threshold, if not, quit
-      if(n_above == 0)
-        break;
-
-      // Initialize the per-cluster function f (h^H * area^E) for each cluster
-      cluster_f.fill(0.0);
-
-      // Now we need to perform fast marching over the triangles, grouping them into
-      // clusters and accumulating cluster areas. For this, we need some kind of a heap
-      // to keep track of all the "active" triangles, i.e., triangles that could be
-      // added to the current cluster.
-      int curr_cluster = 1;
-      double area = 0;
-      triangle_queue.clear();
-      for(unsigned int i = 0; i < he.GetNumberOfFaces(); i++)
-        {
-        // If a triangle is not on the candidate list, skip it, it has already been visited
-        // or it should not be visited (-1)
-        if(tri_cluster_idx[i] != 0) continue;
-
-        // Add the current vertex to the queue
-        triangle_queue.push_back(i);
-        while(triangle_queue.size() > 0)
-          {
-          // Look at the front of the queue, mark as part of current cluster, add area
-          unsigned int f = triangle_queue.front();
-          tri_cluster_idx[f] = curr_cluster;
-          area += tri_supra_thresh_area[f];
+    // Sort the events from the top down. When a face enters and is entirely
+    // above the threshold at the same value, it enters first
+    std::sort(events.begin(), events.end(), [](const Event &a, const Event &b)
+      { return a.first > b.first || (a.first == b.first && a.second < b.second); });
 
-          // Look at the neighbors of this triangle, add them to the queue if not visited
-          int he_start = he.GetFaceHalfEdge(f), he_curr = he_start;
+    // Generate the levels in the same way as stepping up from dh
+    levels.clear();
+    for(double h = dh; h <= x_max; h += dh)
+      levels.push_back(h);
+
+    // Reset the union-find structure
+    std::fill(active.begin(), active.end(), 0);
+    roots.clear();
+    partial.clear();
+
+    // Sweep the levels from the top down
+    size_t k_event = 0;
+    for(int k = (int) levels.size() - 1; k >= 0; k--)
+      {
+      double h = levels[k];
+
+      // Add the faces that cross the threshold at this level
+      for(; k_event < events.size() && events[k_event].first >= h; k_event++)
+        {
+        unsigned int f = events[k_event].second / 2;
+        if(events[k_event].second % 2 == 0)
+          {
+          // The face enters as a new cluster and joins its active neighbors
+          active[f] = 1;
+          parent[f] = f;
+          size[f] = 1;
+          full_area[f] = 0.0;
+          tfce_offset[f] = 0.0;
+          roots.push_back(f);
           for(unsigned int j = 0; j < 3; j++)
             {
-            unsigned int f_nbr = he.GetHalfEdgeFace(he.GetHalfEdgeOpposite(he_curr));
-            if(f_nbr == f)
-              throw std::string("wrong logic");
-            if(f_nbr != VTKMeshHalfEdgeWrapper::NA && tri_cluster_idx[f_nbr] == 0)
-              {
-              tri_cluster_idx[f_nbr] = curr_cluster;
-              triangle_queue.push_back(f_nbr);
-              }
-
-            he_curr = he.GetHalfEdgeNext(he_curr);
+            int f_nbr = tri_nbr[3 * f + j];
+            if(f_nbr >= 0 && active[f_nbr])
+              Union(f, f_nbr);
             }
-
-          // Pop the current triangle off the queue
-          triangle_queue.pop_front();
+          if(dom == POINT)
+            partial.push_back(f);
+          }
+        else
+          {
+          // The face is entirely above the threshold from now on
+          active[f] = 2;
+          full_area[FindRoot(f)] += tri_area[f];
           }
-
-        // Record the area of this cluster -> send it to the vertices.
-        cluster_f[curr_cluster] = std::pow(h, H) * std::pow(area, E);
-        // printf("h = %8.6f  cluster %03d  area = %8.6f  f = %8.6f\n", h, curr_cluster, area, cluster_f[curr_cluster]);
-
-        // Increase the cluster number, reset the area
-        curr_cluster++;
-        area = 0.0;
         }
 
-      // Iterate over the triangles. Each triangle should be assigned a cluster,
-      // except for triangles that are below the current height h, which will be
-      // given cluster value -1. We initialize the cluster array to 0, which means
-      // no triangle has been assigned yet
-      for(unsigned int i = 0; i < he.GetNumberOfFaces(); i++)
-        if(tri_cluster_idx[i] >= 0)
-          tri_tfce[i] += cluster_f[tri_cluster_idx[i]];
-
-      // Generate an output mesh
-      /*
-      char buffer[256];
-      snprintf(buffer, 256, "tfve_cluster_index_%6.4f", h);
-      vtkSmartPointer<vtkFloatArray> a_idx = AddArrayToMesh(mesh, CELL, buffer, 1, 0.0);
-      snprintf(buffer, 256, "tfve_cluster_parea_%6.4f", h);
-      vtkSmartPointer<vtkFloatArray> a_area = AddArrayToMesh(mesh, CELL, buffer, 1, 0.0);
-      snprintf(buffer, 256, "tfve_cluster_aratio_%6.4f", h);
-      vtkSmartPointer<vtkFloatArray> a_area_ratio = AddArrayToMesh(mesh, CELL, buffer, 1, 0.0);
-      snprintf(buffer, 256, "tfve_cluster_f_%6.4f", h);
-      vtkSmartPointer<vtkFloatArray> a_f = AddArrayToMesh(mesh, CELL, buffer, 1, 0.0);
-      for(unsigned int i = 0; i < he.GetNumberOfFaces(); i++)
-        {
-        a_idx->SetTuple1(i, tri_cluster_idx[i]);
-        a_area->SetTuple1(i, tri_supra_thresh_area[i]);
-        a_area_ratio->SetTuple1(i, tri_supra_thresh_area[i] / tri_area[i]);
-        a_f->SetTuple1(i, cluster_f[tri_cluster_idx[i]]);
-        }
-        */
+      // Keep only the current roots and the faces still partially above
+      roots.erase(std::remove_if(roots.begin(), roots.end(),
+                                 [this](int r) { return parent[r] != r; }), roots.end());
+      partial.erase(std::remove_if(partial.begin(), partial.end(),
+                                   [this](int f) { return active[f] == 2; }), partial.end());
+
+      // Compute the area of each cluster at this level
+      for(int r : roots)
+        level_area[r] = full_area[r];
+      for(int f : partial)
+        level_area[FindRoot(f)] += PartialArea(f, h);
+
+      // Every face in the cluster receives the same contribution, which is
+      // added to the root of the cluster
+      double h_pow = std::pow(h, H);
+      for(int r : roots)
+        tfce_offset[r] += h_pow * std::pow(level_area[r], E);
       }
 
     // The final TFCE array is on cells - it does not really make so much sense to
     // project back to vertex space based on how we compute it
     tfce->SetNumberOfComponents(1);
-    tfce->SetNumberOfTuples(he.GetNumberOfFaces());
-    for(unsigned int i = 0; i < he.GetNumberOfFaces(); i++)
-      tfce->SetTuple1(i, tri_tfce[i]);
+    tfce->SetNumberOfTuples(nf);
+    for(unsigned int i = 0; i < nf; i++)
+      {
+      double val = 0.0;
+      if(active[i])
+        {
+        int r = FindRoot(i);
+        val = (r == (int) i) ? tfce_offset[i] : tfce_offset[i] + tfce_offset[r];
+        }
+      tfce->SetTuple1(i, val);
+      }
+  }
+
+private:
 
-    /*
-    // Assign the tfce value to vertices or cells depending on what the use wants
-    if(dom == POINT)
+  // Area of a face above the threshold h, obtained by scaling the area of the
+  // face by the portion of each edge that is above the threshold
+  double PartialArea(int f, double h)
+  {
+    double area = tri_area[f];
+    for(unsigned int j = 0; j < 3; j++)
       {
-      tfce->SetNumberOfComponents(1);
-      tfce->SetNumberOfTuples(he.GetNumberOfVertices());
-      tfce->Fill(0.0);
-      for(unsigned int i = 0; i < he.GetNumberOfFaces(); i++)
+      double h0 = x[tri_vtx[3 * f + j]];
+      double h1 = x[tri_vtx[3 * f + (j + 1) % 3]];
+      if(h0 >= h || h1 >= h)
         {
-        // Split the tFCE between the vertices
-        vtkCell *cell = mesh->GetCell(i);
-        for(unsigned int j = 0; j < 3; j++)
-          {
-          auto pid = cell->GetPointId(j);
-          tfce->SetTuple1(pid, tfce->GetTuple1(pid) + tri_tfce[i] / 3.0);
-          }
+        if(h0 < h)
+          area *= (h1 - h) / (h1 - h0);
+        else if(h1 < h)
+          area *= (h0 - h) / (h0 - h1);
         }
       }
-    else
+    return area;
+  }
+
+  // Find the root of a face, compressing the path. The TFCE offset of each
+  // node on the path becomes relative to the root
+  int FindRoot(int f)
+  {
+    int r = f;
+    while(parent[r] != r)
+      r = parent[r];
+
+    // Collect the path, then fold the offsets from the top down
+    path.clear();
+    for(int g = f; parent[g] != r && g != r; g = parent[g])
+      path.push_back(g);
+    for(int q = (int) path.size() - 1; q >= 0; q--)
       {
-      tfce->SetNumberOfComponents(1);
-      tfce->SetNumberOfTuples(he.GetNumberOfFaces());
-      for(unsigned int i = 0; i < he.GetNumberOfFaces(); i++)
-        tfce->SetTuple1(i, tri_tfce[i]);
+      int g = path[q];
+      tfce_offset[g] += tfce_offset[parent[g]];
+      parent[g] = r;
       }
-    */
+    return r;
+  }
+
+  // Merge the clusters containing two faces, attaching the smaller tree
+  void Union(int a, int b)
+  {
+    int ra = FindRoot(a), rb = FindRoot(b);
+    if(ra == rb)
+      return;
+    if(size[ra] < size[rb])
+      std::swap(ra, rb);
+
+    parent[rb] = ra;
+    size[ra] += size[rb];
+    full_area[ra] += full_area[rb];
+    tfce_offset[rb] -= tfce_offset[ra];
   }
 
-private:
   vtkPolyData *mesh;
-  VTKMeshHalfEdgeWrapper he;
   Domain dom;
   double dh, E, H;
 
-  // Active data array
+  // Active data array and its values
   vtkDataArray *arr;
-
-  // For every triangle in the mesh, we need to keep track of a cluster index
-  // assigned to it.
-  vnl_vector<int> tri_cluster_idx;
-  vnl_vector<double> tri_area, tri_supra_thresh_area;
-
-  // For every vertex, associate it with a cluster
-  vnl_vector<double> cluster_f, tri_tfce;
-
-  // A queue used to manage the current cluster
-  std::deque<int> triangle_queue;
+  std::vector<double> x;
+
+  // Mesh structure: vertices and edge neighbors of each face
+  unsigned int nf;
+  std::vector<int> tri_vtx, tri_nbr;
+  std::vector<double> tri_area;
+
+  // Sorted events: the value of the statistic and 2 * face + (0 when the face
+  // enters a cluster, 1 when it is entirely above the threshold)
+  typedef std::pair<double, int> Event;
+  std::vector<Event> events;
+  std::vector<double> levels;
+
+  // Union-find structure over the faces. For each face, active is 0 if the
+  // face is below the threshold, 1 if partially and 2 if entirely above
+  std::vector<int> parent, size, path, roots, partial;
+  std::vector<char> active;
+  std::vector<double> full_area, level_area, tfce_offset;
 };
 
 class ClusterComputer
@@ -1101,23 +1288,6 @@ ClusterComputer::ComputeClusters(bool build_combo_mesh)
         }
       else
         throw MCException("Wrong cell type, should be VTK_TRIANGLE, VTK_TETRA or VTK_WEDGE");
-
-      // Compute the area of the triangle
-      double p0[3], p1[3], p2[3];
-      vtkIdType a0 = cell->GetPointId(0), a1 = cell->GetPointId(1), a2 = cell->GetPointId(2);
-      p->GetPoint(a0, p0); p->GetPoint(a1, p1); p->GetPoint(a2, p2);
-      double area = vtkTriangle::TriangleArea(p0, p1, p2);
-
-      if(dom == POINT)
-        {
-        // Split the volume between neighbors
-        daArea[a0] += area / 3.0; daArea[a1] += area / 3.0; daArea[a2] += area / 3.0;
-        }
-      else
-        {
-        // No need to split, working with cells
-        daArea[k] = area;
-        }
       }
 
     // Get the input statistic
@@ -1193,6 +1363,263 @@ ClusterComputer::ComputeClusters(bool build_combo_mesh)
   return ca;
 }
 
+/**
+ * A lightweight alternative to ClusterComputer for the permutation loop, where
+ * only the size and power of the clusters are needed. The cells of the mesh
+ * and their area elements are extracted once, and the clusters for each
+ * statistic map are labeled by a union-find pass over flat arrays, without
+ * running a VTK pipeline.
+ *
+ * In the CELL domain, cells with the statistic at or above the threshold are
+ * connected if they share a point, as in vtkConnectivityFilter. In the POINT
+ * domain (triangle meshes only), points above the threshold are connected if
+ * they share a triangle, and the area of each clipped triangle is computed in
+ * closed form, using the same triangulation of the clipped region as
+ * vtkTriangle::Clip. The cluster area and power match those computed by
+ * ClusterComputer, but in the POINT domain the cluster size n and the sum of
+ * the statistic only include the original mesh vertices.
+ */
+class FlatClusterComputer
+{
+public:
+  FlatClusterComputer(vtkDataSet *mesh, Domain dom, double thresh);
+
+  // Check if the cells of the mesh are supported for this domain
+  static bool CanHandle(vtkDataSet *mesh, Domain dom);
+
+  // Compute the clusters for a statistic array (NaNs are treated as zeros)
+  ClusterArray ComputeClusters(vtkDataArray *stat);
+
+private:
+  int FindRoot(int i);
+  void Union(int i, int j);
+  bool IsAbove(int i) const
+    { return dom == POINT ? x[i] > thresh : x[i] >= thresh; }
+
+  Domain dom;
+  double thresh;
+
+  // Point ids of the cells in compressed row form, and the area (or volume)
+  // element of each cell
+  vector<int> cell_ptr, cell_pts;
+  vector<double> cell_area;
+
+  // Work arrays, indexed by element (point or cell) except for the point owner
+  vector<double> x;
+  vector<int> parent, region, owner;
+};
+
+bool
+FlatClusterComputer::CanHandle(vtkDataSet *mesh, Domain dom)
+{
+  for(vtkIdType k = 0; k < mesh->GetNumberOfCells(); k++)
+    {
+    int type = mesh->GetCellType(k);
+    if(type != VTK_TRIANGLE && (dom == POINT || (type != VTK_TETRA && type != VTK_WEDGE)))
+      return false;
+    }
+  return true;
+}
+
+FlatClusterComputer
+::FlatClusterComputer(vtkDataSet *mesh, Domain dom, double thresh)
+{
+  this->dom = dom;
+  this->thresh = thresh;
+
+  // Extract the cells and compute their areas
+  int nc = mesh->GetNumberOfCells(), np = mesh->GetNumberOfPoints();
+  cell_ptr.reserve(nc + 1);
+  cell_ptr.push_back(0);
+  cell_area.reserve(nc);
+  for(int k = 0; k < nc; k++)
+    {
+    vtkCell *cell = mesh->GetCell(k);
+    for(int m = 0; m < cell->GetNumberOfPoints(); m++)
+      cell_pts.push_back(cell->GetPointId(m));
+    cell_ptr.push_back(cell_pts.size());
+
+    if(cell->GetCellType() == VTK_TRIANGLE)
+      {
+      double p0[3], p1[3], p2[3];
+      mesh->GetPoint(cell->GetPointId(0), p0);
+      mesh->GetPoint(cell->GetPointId(1), p1);
+      mesh->GetPoint(cell->GetPointId(2), p2);
+      cell_area.push_back(vtkTriangle::TriangleArea(p0, p1, p2));
+      }
+    else
+      {
+      cell_area.push_back(ComputeCellVolume(cell));
+      }
+    }
+
+  int nelt = (dom == POINT) ? np : nc;
+  x.resize(nelt);
+  parent.resize(nelt);
+  region.resize(nelt);
+  if(dom == CELL)
+    owner.resize(np);
+}
+
+int
+FlatClusterComputer::FindRoot(int i)
+{
+  while(parent[i] != i)
+    {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+    }
+  return i;
+}
+
+void
+FlatClusterComputer::Union(int i, int j)
+{
+  int ri = FindRoot(i), rj = FindRoot(j);
+  if(ri < rj)
+    parent[rj] = ri;
+  else if(rj < ri)
+    parent[ri] = rj;
+}
+
+ClusterArray
+FlatClusterComputer::ComputeClusters(vtkDataArray *stat)
+{
+  int nelt = x.size(), nc = cell_area.size();
+
+  // Read the statistic, replacing NaNs as copy_array_replace_nans does
+  for(int i = 0; i < nelt; i++)
+    {
+    double v = stat->GetComponent(i, 0);
+    x[i] = std::isnan(v) ? 0.0 : v;
+    parent[i] = i;
+    region[i] = -1;
+    }
+
+  // Join the elements above the threshold into connected components
+  if(dom == POINT)
+    {
+    for(int k = 0; k < nc; k++)
+      {
+      int first = -1;
+      for(int j = cell_ptr[k]; j < cell_ptr[k+1]; j++)
+        {
+        int v = cell_pts[j];
+        if(IsAbove(v))
+          {
+          if(first < 0)
+            first = v;
+          else
+            Union(first, v);
+          }
+        }
+      }
+    }
+  else
+    {
+    std::fill(owner.begin(), owner.end(), -1);
+    for(int k = 0; k < nc; k++)
+      {
+      if(!IsAbove(k))
+        continue;
+      for(int j = cell_ptr[k]; j < cell_ptr[k+1]; j++)
+        {
+        int &o = owner[cell_pts[j]];
+        if(o < 0)
+          o = k;
+        else
+          Union(o, k);
+        }
+      }
+    }
+
+  // Assign a cluster to each component
+  ClusterArray ca;
+  for(int i = 0; i < nelt; i++)
+    {
+    if(IsAbove(i))
+      {
+      int r = FindRoot(i);
+      if(region[r] < 0)
+        {
+        region[r] = ca.size();
+        ca.push_back(Cluster());
+        }
+      region[i] = region[r];
+
+      ca[region[i]].n++;
+      ca[region[i]].tvalue += x[i];
+      }
+    }
+
+  // Accumulate the area and power of the clusters
+  if(dom == CELL)
+    {
+    for(int k = 0; k < nc; k++)
+      {
+      if(region[k] >= 0)
+        {
+        ca[region[k]].area += cell_area[k];
+        ca[region[k]].power += cell_area[k] * x[k];
+        }
+      }
+    }
+  else
+    {
+    double t = thresh;
+    for(int k = 0; k < nc; k++)
+      {
+      const int *v = &cell_pts[cell_ptr[k]];
+      int mask = 0, n_above = 0;
+      for(int j = 0; j < 3; j++)
+        {
+        if(IsAbove(v[j]))
+          {
+          mask |= 1 << j;
+          n_above++;
+          }
+        }
+      if(n_above == 0)
+        continue;
+
+      // The points added by clipping have the threshold value, and the power
+      // assigns a third of each clipped triangle's area to each of its points
+      double A = cell_area[k], area, power;
+      if(n_above == 3)
+        {
+        area = A;
+        power = A * (x[v[0]] + x[v[1]] + x[v[2]]) / 3.0;
+        }
+      else if(n_above == 1)
+        {
+        // Triangle formed by the vertex a and the two crossing points
+        int a = (mask == 1) ? 0 : (mask == 2 ? 1 : 2);
+        double xa = x[v[a]], xb = x[v[(a+1) % 3]], xc = x[v[(a+2) % 3]];
+        area = A * ((xa - t) / (xa - xb)) * ((xa - t) / (xa - xc));
+        power = area * (xa + 2 * t) / 3.0;
+        }
+      else
+        {
+        // Quadrilateral split by the diagonal from the vertex a following the
+        // vertex o below the threshold to the crossing point on the edge (b,o)
+        int o = (mask == 6) ? 0 : (mask == 5 ? 1 : 2);
+        double xo = x[v[o]], xa = x[v[(o+1) % 3]], xb = x[v[(o+2) % 3]];
+        double sa = (t - xo) / (xa - xo), sb = (t - xo) / (xb - xo);
+        double area_1 = A * (1.0 - sb);
+        double area_2 = A * (1.0 - sa * sb) - area_1;
+        area = area_1 + area_2;
+        power = area_1 * (xa + xb + t) / 3.0 + area_2 * (xa + 2 * t) / 3.0;
+        }
+
+      int r = region[v[(mask & 1) ? 0 : ((mask & 2) ? 1 : 2)]];
+      ca[r].area += area;
+      ca[r].power += power;
+      }
+    }
+
+  return ca;
+}
+
 class GeneralLinearModel
 {
 public:
@@ -1202,36 +1629,133 @@ public:
     const vnl_matrix<double> &design_matrix,
     const vnl_matrix<double> &contrast_vector);
 
-  // Make a deep copy of another GLM
+  // Create a GLM for a data matrix stored elsewhere (e.g., memory-mapped from a
+  // file or owned by another GLM). The data are n_subjects x nelt, row-major,
+  // and must remain valid for the lifetime of the GLM
+  GeneralLinearModel(
+    const double *ydata, int nelt, vtkFloatArray *contrast,
+    vtkFloatArray *tstat, vtkFloatArray *pval, vtkFloatArray *beta, vtkFloatArray *residual, vtkFloatArray *dfarray,
+    const vnl_matrix<double> &design_matrix,
+    const vnl_matrix<double> &contrast_vector);
+
+  // Make a deep copy of another GLM. The data matrix is shared with the source
   GeneralLinearModel(const GeneralLinearModel *src);
 
   void Compute(const vnl_matrix<double> &Yperm, bool need_t, bool need_p, bool need_res);
   void ComputeWithMissingData(const vnl_matrix<double> &Yperm, bool need_t, bool need_p, bool need_res);
+
+  // Compute the GLM for Y with rows shuffled by the permutation, i.e., row i
+  // of the permuted data is row perm[i] of Y. The data are not copied
+  void ComputePermuted(const vector<int> &perm, bool need_t, bool need_p);
+
+  // Same as above, for data with missing values
+  void ComputePermutedWithMissingData(const vector<int> &perm, bool need_t, bool need_p);
+
   //int compute_rank(vnl_matrix <double> D); 
   double PtoT(double p);
-  vnl_matrix<double> Y; // data matrix for permutations
+
+  // The data matrix for permutations (subjects x elements), which is not copied
+  vnl_matrix_ref<double> GetY() const
+    { return vnl_matrix_ref<double>(X.rows(), nelt, const_cast<double *>(Y_ptr)); }
+
+  // Pointer to the data matrix, which can be shared with other GLMs
+  const double *GetYData() const
+    { return Y_ptr; }
 
 private:
   void CommonInit();
   vtkSmartPointer<vtkFloatArray> DeepCopyArray(vtkFloatArray *src);
 
+  // GLM on the data matrix given as an array of pointers to its rows
+  void ComputeFromRows(const double * const *rows, bool need_t, bool need_p, bool need_res);
+
+  // Elements of the data matrix that have the same pattern of missing values
+  struct NaNPatternGroup
+    {
+    // For each row of Y, whether the data are present
+    vector<char> valid;
+
+    // The elements in the group
+    vector<int> elements;
+    };
+
+  struct NaNPatternHash
+    {
+    size_t operator()(const vector<uint64_t> &mask) const;
+    };
+
+  // Group the elements of the data matrix (given by its rows) by the pattern
+  // of missing values
+  void GroupByNaNPattern(const double * const *rows, vector<NaNPatternGroup> &groups);
+
+  // GLM with missing data, processing each group with a single factorization
+  // of the design. If perm is given, row k of the data is row perm[k] of the
+  // data used to compute the groups
+  void ComputeGroupsWithMissingData(
+    const double * const *rows, const vector<NaNPatternGroup> &groups, const vector<int> *perm,
+    bool need_t, bool need_p, bool need_res);
+
   // Pointers to the data arrays
-  vtkSmartPointer<vtkFloatArray> data, contrast, tstat, pval, beta, residual, dfarray;
+  vtkSmartPointer<vtkFloatArray> contrast, tstat, pval, beta, residual, dfarray;
+
+  // The data matrix, either owned (Y_own) or stored elsewhere
+  vnl_matrix<double> Y_own;
+  const double *Y_ptr;
 
   // Copies of the matrix, other data
   vnl_matrix<double> X,cv;
   int nelt, rank, df;
+
+  // Operators that depend only on the design: A = (X^T X)^+, A X^T and
+  // the scalar cv A cv^T used in the t-statistic denominator
+  vnl_matrix<double> A, AXT;
+  double cv_A_cvT;
+
+  // Work buffers reused between calls
+  vnl_matrix<double> bhat;
+  vnl_vector<double> con_buf, fit_buf, rss_buf;
+  vector<const double *> row_ptr;
+
+  // Grouping of the elements of Y by missing data pattern, computed on demand
+  vector<NaNPatternGroup> nan_groups;
 };
 
 GeneralLinearModel::GeneralLinearModel(
-    vtkFloatArray *data, vtkFloatArray *contrast,
+    vtkFloatArray *data, vtkFloatArray *contrast,
+    vtkFloatArray *tstat, vtkFloatArray *pval, vtkFloatArray *beta,
+    vtkFloatArray *residual, vtkFloatArray *dfarray,
+    const vnl_matrix<double> &design_matrix, 
+    const vnl_matrix<double> &contrast_vector)
+{
+  // Copy input
+  this->contrast = contrast;
+  this->tstat = tstat;
+  this->pval = pval;
+  this->beta = beta;
+  this->X = design_matrix;
+  this->cv = contrast_vector;
+  this->residual = residual;
+  this->dfarray = dfarray;
+
+  // Copy the data into the Y matrix
+  nelt = data->GetNumberOfTuples();
+  Y_own.set_size(X.rows(), nelt);
+  for(size_t i = 0; i < X.rows(); i++)
+    for(int j = 0; j < nelt; j++)
+      Y_own(i,j) = data->GetComponent(j,i);
+  Y_ptr = Y_own.data_block();
+
+  this->CommonInit();
+  }
+
+GeneralLinearModel::GeneralLinearModel(
+    const double *ydata, int nelt, vtkFloatArray *contrast,
     vtkFloatArray *tstat, vtkFloatArray *pval, vtkFloatArray *beta,
     vtkFloatArray *residual, vtkFloatArray *dfarray,
-    const vnl_matrix<double> &design_matrix, 
+    const vnl_matrix<double> &design_matrix,
     const vnl_matrix<double> &contrast_vector)
 {
   // Copy input
-  this->data = data;
   this->contrast = contrast;
   this->tstat = tstat;
   this->pval = pval;
@@ -1240,13 +1764,16 @@ GeneralLinearModel::GeneralLinearModel(
   this->cv = contrast_vector;
   this->residual = residual;
   this->dfarray = dfarray;
+  this->nelt = nelt;
+  this->Y_ptr = ydata;
   this->CommonInit();
-  }
+}
 
 GeneralLinearModel::GeneralLinearModel(const GeneralLinearModel *src)
 {
   // Copy input
-  this->data = DeepCopyArray(src->data);
+  this->nelt = src->nelt;
+  this->Y_ptr = src->Y_ptr;
   this->contrast = DeepCopyArray(src->contrast);
   this->tstat = DeepCopyArray(src->tstat);
   this->pval = DeepCopyArray(src->pval);
@@ -1273,56 +1800,92 @@ GeneralLinearModel
 
 void
 GeneralLinearModel::Compute(const vnl_matrix<double> &Yperm, bool need_t, bool need_p, bool need_res)
-  {
+{
+  for(size_t i = 0; i < X.rows(); i++)
+    row_ptr[i] = Yperm[i];
+  ComputeFromRows(row_ptr.data(), need_t, need_p, need_res);
+}
+
+void
+GeneralLinearModel::ComputePermuted(const vector<int> &perm, bool need_t, bool need_p)
+{
+  for(size_t i = 0; i < X.rows(); i++)
+    row_ptr[i] = Y_ptr + (size_t) perm[i] * nelt;
+  ComputeFromRows(row_ptr.data(), need_t, need_p, false);
+}
 
-  // Shuffle the rows according to current permutan_resr (size_t i = 0; i < permutation.size(); i++)
-  //  for (size_t j = 0; j < X.cols(); j++)
-  //    	Xperm[i][j] = X[permutation[i]][j];
+void
+GeneralLinearModel::ComputeFromRows(const double * const *rows, bool need_t, bool need_p, bool need_res)
+{
+  int n = X.rows(), m = X.cols();
+
+  // Standard GLM calculation, bhat = (A * X^T) * Yperm. The product is
+  // accumulated one row of Yperm at a time so that the data are read in
+  // memory order and never copied
+  bhat.fill(0.0);
+  for(int i = 0; i < n; i++)
+    {
+    const double *y_i = rows[i];
+    for(int k = 0; k < m; k++)
+      {
+      double a_ki = AXT(k,i);
+      double *b_k = bhat[k];
+      for(int j = 0; j < nelt; j++)
+        b_k[j] += a_ki * y_i[j];
+      }
+    }
 
-  // Standard GLM calculation
-  vnl_matrix<double> A = vnl_matrix_inverse<double>(X.transpose() * X).pinverse(rank);
-  vnl_matrix<double> bhat = (A * X.transpose()) * Yperm;
-  
   // Compute the contrast
-  vnl_matrix<double> res = cv * bhat;
+  con_buf.fill(0.0);
+  for(int k = 0; k < m; k++)
+    {
+    double c_k = cv(0,k);
+    const double *b_k = bhat[k];
+    for(int j = 0; j < nelt; j++)
+      con_buf[j] += c_k * b_k[j];
+    }
 
   // Copy the betas and the contrast to the output vector
+  float *p_beta = beta->GetPointer(0);
   for (int j = 0; j < nelt; j++)
     {
-    contrast->SetTuple1(j, res(0,j));
-    beta->SetTuple(j, bhat.get_column(j).data_block());
+    contrast->SetTuple1(j, con_buf[j]);
+    for(int k = 0; k < m; k++)
+      p_beta[j * m + k] = bhat(k,j);
     }
 
   // The rest only if we need the t-stat
   if(need_t)
     {
-    vnl_matrix<double> errmat = Yperm - X * bhat;
-    
-    // Residual variance
-    vnl_matrix<double> resvar(1, nelt);
-    resvar.fill(0.0);
-    for(int j = 0; j < nelt; j++)
+    // Residual sum of squares, computing the fitted values one row at a time
+    float *p_res = need_res ? residual->GetPointer(0) : NULL;
+    rss_buf.fill(0.0);
+    for(int i = 0; i < n; i++)
       {
-      for(size_t i = 0; i < X.rows(); i++)
-        resvar(0, j) += errmat(i,j) * errmat(i,j);
-      resvar(0, j) = resvar(0, j) / (double) df;
-      }
+      fit_buf.fill(0.0);
+      for(int k = 0; k < m; k++)
+        {
+        double x_ik = X(i,k);
+        const double *b_k = bhat[k];
+        for(int j = 0; j < nelt; j++)
+          fit_buf[j] += x_ik * b_k[j];
+        }
 
-    //if we need the residual, copy to the output vector
-    if(need_res)
-      {
-      for (int j = 0; j< nelt; j++)
+      const double *y_i = rows[i];
+      for(int j = 0; j < nelt; j++)
         {
-        residual->SetTuple(j, errmat.get_column(j).data_block());
+        double e = y_i[j] - fit_buf[j];
+        rss_buf[j] += e * e;
+        if(p_res)
+          p_res[j * n + i] = e;
         }
       }
 
     // Compute t-stat / p-value
-    vnl_matrix<double> den(1, nelt);
-    den = (cv * (A * cv.transpose())) * resvar;
     for (int j = 0; j < nelt; j++)
       {
-      double t = den(0, j) > 0 ? res(0, j) / sqrt(den(0, j)) : 0.0;
+      double den = cv_A_cvT * (rss_buf[j] / (double) df);
+      double t = den > 0 ? con_buf[j] / sqrt(den) : 0.0;
       tstat->SetTuple1(j, t);
       dfarray->SetTuple1(j, (double) df);
       if(need_p)
@@ -1332,8 +1895,7 @@ GeneralLinearModel::Compute(const vnl_matrix<double> &Yperm, bool need_t, bool n
         }
       }
     }
-
-  }
+}
 
 template <typename TDataArray> void set_tuple_to_nan(TDataArray *arr, int j)
 {
@@ -1351,134 +1913,192 @@ template <typename TDataArray> void set_tuple_to_zero(TDataArray *arr, int j)
 void
 GeneralLinearModel::ComputeWithMissingData(const vnl_matrix<double> &Yperm, bool need_t, bool need_p, bool need_res)
 {
-  // Shuffle the rows according to current permutation
-  //for (size_t i = 0; i < permutation.size(); i++)
-  //  for (size_t j = 0; j < X.cols(); j++)
-  //    Xperm[i][j] = X[permutation[i]][j];
+  for(size_t i = 0; i < X.rows(); i++)
+    row_ptr[i] = Yperm[i];
 
-  // Number of subjects
-  int ns = Yperm.rows();
+  // The elements are grouped by the pattern of missing values in Yperm
+  vector<NaNPatternGroup> groups;
+  GroupByNaNPattern(row_ptr.data(), groups);
+  ComputeGroupsWithMissingData(row_ptr.data(), groups, nullptr, need_t, need_p, need_res);
+}
 
-  // Matrix A
-  vnl_matrix<double> A, Xj, AXjT;
-  vnl_vector<double> Yj;
-  double cv_A_cvT;
+void
+GeneralLinearModel::ComputePermutedWithMissingData(const vector<int> &perm, bool need_t, bool need_p)
+{
+  // Permuting the subjects does not change which elements share a pattern of
+  // missing values, so the grouping of the unpermuted data is reused
+  if(nan_groups.empty())
+    {
+    for(size_t i = 0; i < X.rows(); i++)
+      row_ptr[i] = Y_ptr + i * nelt;
+    GroupByNaNPattern(row_ptr.data(), nan_groups);
+    }
 
-  // Iterate over all the elements
-  for (int j = 0; j < nelt; j++)
+  for(size_t i = 0; i < X.rows(); i++)
+    row_ptr[i] = Y_ptr + (size_t) perm[i] * nelt;
+  ComputeGroupsWithMissingData(row_ptr.data(), nan_groups, &perm, need_t, need_p, false);
+}
+
+size_t
+GeneralLinearModel::NaNPatternHash::operator()(const vector<uint64_t> &mask) const
+{
+  uint64_t h = 14695981039346656037ULL;
+  for(uint64_t w : mask)
+    h = (h ^ w) * 1099511628211ULL;
+  return (size_t) h;
+}
+
+void
+GeneralLinearModel::GroupByNaNPattern(const double * const *rows, vector<NaNPatternGroup> &groups)
+{
+  int ns = X.rows(), nw = (ns + 63) / 64;
+
+  // Encode the pattern of missing values at each element as a bit mask
+  vector<uint64_t> mask((size_t) nelt * nw, 0);
+  for(int k = 0; k < ns; k++)
     {
-    
-    bool same_pattern = true;
-    int n_nans = 0;
+    uint64_t bit = ((uint64_t) 1) << (k % 64);
+    uint64_t *mask_k = mask.data() + k / 64;
+    for(int j = 0; j < nelt; j++)
+      if(vnl_math::isnan(rows[k][j]))
+        mask_k[(size_t) j * nw] |= bit;
+    }
 
-    // Determine which elements have missing data (nan) and if that matches the last element we processed
-    for(int k = 0; k < ns; k++)
+  // Elements with the same mask are placed in the same group
+  groups.clear();
+  std::unordered_map<vector<uint64_t>, int, NaNPatternHash> group_index;
+  for(int j = 0; j < nelt; j++)
+    {
+    const uint64_t *mask_j = mask.data() + (size_t) j * nw;
+    auto ins = group_index.insert(std::make_pair(vector<uint64_t>(mask_j, mask_j + nw), (int) groups.size()));
+    if(ins.second)
       {
-      if(vnl_math::isnan(Yperm(k, j)))
-        {
-        n_nans++;
-        if(j == 0 || !vnl_math::isnan(Yperm(k,j-1)))
-          same_pattern = false;
-        }
-      else
-        {
-        if(j == 0 || vnl_math::isnan(Yperm(k,j-1)))
-          same_pattern = false;
-        }
+      groups.push_back(NaNPatternGroup());
+      groups.back().valid.resize(ns);
+      for(int k = 0; k < ns; k++)
+        groups.back().valid[k] = !((mask_j[k / 64] >> (k % 64)) & 1);
       }
+    groups[ins.first->second].elements.push_back(j);
+    }
+}
+
+void
+GeneralLinearModel::ComputeGroupsWithMissingData(
+  const double * const *rows, const vector<NaNPatternGroup> &groups, const vector<int> *perm,
+  bool need_t, bool need_p, bool need_res)
+{
+  int ns = X.rows(), m = X.cols();
+
+  // Elements in a group are processed in blocks to limit the size of the copy
+  // of the data
+  const size_t block_size = 1024;
 
-    // If the number of nans equals the number of observations, we cannot do any stats and we
-    // should just assign NaN to everything in the output
-    if(n_nans == ns)
+  vector<int> rows_valid;
+  vnl_matrix<double> Xj, AXjT, Yg, Bg, Rg;
+  vnl_vector<double> beta_j(m), res_j_ns(ns);
+  for(const NaNPatternGroup &g : groups)
+    {
+    // Find the rows of the data that are not missing for this group
+    rows_valid.clear();
+    for(int k = 0; k < ns; k++)
+      if(g.valid[perm ? (*perm)[k] : k])
+        rows_valid.push_back(k);
+    int nv = rows_valid.size();
+
+    // If all observations are missing, we cannot do any stats and we should
+    // just assign NaN to everything in the output
+    if(nv == 0)
       {
-      set_tuple_to_nan(beta.GetPointer(), j);
-      set_tuple_to_nan(contrast.GetPointer(), j);
-      if(need_t)
+      for(int j : g.elements)
         {
-        set_tuple_to_nan(tstat.GetPointer(), j);
-        dfarray->SetTuple1(j, 0);
-        if(residual)
-          set_tuple_to_nan(residual.GetPointer(), j);
+        set_tuple_to_nan(beta.GetPointer(), j);
+        set_tuple_to_nan(contrast.GetPointer(), j);
+        if(need_t)
+          {
+          set_tuple_to_nan(tstat.GetPointer(), j);
+          dfarray->SetTuple1(j, 0);
+          if(residual)
+            set_tuple_to_nan(residual.GetPointer(), j);
 
-        if(need_p)
-          set_tuple_to_nan(pval.GetPointer(), j);
+          if(need_p)
+            set_tuple_to_nan(pval.GetPointer(), j);
+          }
         }
       continue;
       }
 
-    // If the pattern is changed, we need to compute the new A matrix
-    if(!same_pattern)
-      {
-      // Copy rows from Xperm into Xj
-      Xj.set_size(ns - n_nans, X.cols());
-      for(int k = 0, p = 0; k < ns; k++)
-        if(!vnl_math::isnan(Yperm(k,j)))
-          {
-          assert(p < Xj.rows());
-          Xj.set_row(p++, X.get_row(k));
-          }
-      // Compute A - should be Xj?
-      A = vnl_matrix_inverse<double>(Xj.transpose() * Xj).pinverse(rank);
-      AXjT = A * Xj.transpose();
-
-      // Compute cv * A * cv^T
-      cv_A_cvT = (cv * (A * cv.transpose()))(0,0);
+    // Compute the A matrix for the rows of the design with observations. This
+    // is done once for all the elements in the group
+    Xj.set_size(nv, m);
+    for(int p = 0; p < nv; p++)
+      Xj.set_row(p, X.get_row(rows_valid[p]));
+    vnl_matrix<double> Aj = vnl_matrix_inverse<double>(Xj.transpose() * Xj).pinverse(rank);
+    AXjT = Aj * Xj.transpose();
+    double cv_Aj_cvT = (cv * (Aj * cv.transpose()))(0,0);
 
-      // Resize Y
-      Yj.set_size(ns - n_nans);
-      }
+    // Compute the degrees of freedom
+    int df_j = nv - rank;
 
-    // Copy the Y vector's elements into Yk
-    for(int k = 0, p = 0; k < ns; k++)
-      if(!vnl_math::isnan(Yperm(k,j)))
+    for(size_t b0 = 0; b0 < g.elements.size(); b0 += block_size)
+      {
+      // Copy the observations for a block of elements
+      int nb = std::min(block_size, g.elements.size() - b0);
+      const int *elt = g.elements.data() + b0;
+      Yg.set_size(nv, nb);
+      for(int p = 0; p < nv; p++)
         {
-        assert(p < Yj.size());
-        Yj[p++] = Yperm(k,j);
+        const double *y_p = rows[rows_valid[p]];
+        for(int q = 0; q < nb; q++)
+          Yg(p,q) = y_p[elt[q]];
         }
-    
-    // Compute the estimated betas
-    vnl_vector<double> beta_j = AXjT * Yj;
 
-    // Store in output array
-    beta->SetTuple(j, beta_j.data_block());
-
-    // Compute the contrast - con_j same as res
-    vnl_vector<double> con_j = cv * beta_j;
-    contrast->SetTuple1(j, con_j[0]);
+      // Compute the estimated betas and residuals for the whole block
+      Bg = AXjT * Yg;
+      if(need_t)
+        Rg = Yg - Xj * Bg;
 
-    //Compute the degrees of freedom
-    int df_j = Xj.rows()-rank;
+      for(int q = 0; q < nb; q++)
+        {
+        int j = elt[q];
 
-    // The rest only if we need the t-stat
-    if(need_t)
-      {
-      vnl_vector<double> Xj_beta = Xj * beta_j;
-      vnl_vector<double> res_j = Yj - Xj * beta_j;
+        // Store the betas and the contrast
+        double con_j = 0.0;
+        for(int k = 0; k < m; k++)
+          {
+          beta_j[k] = Bg(k,q);
+          con_j += cv(0,k) * Bg(k,q);
+          }
+        beta->SetTuple(j, beta_j.data_block());
+        contrast->SetTuple1(j, con_j);
 
-      double resvar = res_j.squared_magnitude() / (double) df_j;
+        // The rest only if we need the t-stat
+        if(need_t)
+          {
+          double rss = 0.0;
+          for(int p = 0; p < nv; p++)
+            rss += Rg(p,q) * Rg(p,q);
+          double resvar = rss / (double) df_j;
 
-      //if needed, copy the residuals to the output array
-      if(need_res)
-        {
-        vnl_vector<double> res_j_ns;
-        res_j_ns.set_size(ns);
-        for(int k = 0, p = 0; k < ns; k++)
-          if(!vnl_math::isnan(Yperm(k,j)))
-            res_j_ns[k] = res_j[p++];
-          else
-            res_j_ns[k] = NAN;
-        residual->SetTuple(j,res_j_ns.data_block());
-        }
+          // If needed, copy the residuals to the output array
+          if(need_res)
+            {
+            res_j_ns.fill(NAN);
+            for(int p = 0; p < nv; p++)
+              res_j_ns[rows_valid[p]] = Rg(p,q);
+            residual->SetTuple(j, res_j_ns.data_block());
+            }
 
-      // Compute t-stat / p-value
-      double den = cv_A_cvT * resvar;
-      double t = (den > 0) ? con_j[0] / sqrt(den) : 0.0;
-      tstat->SetTuple1(j, t);
-      dfarray->SetTuple1(j, (double) df_j);
-      if(need_p)
-        {
-        int dummy;
-        pval->SetTuple1(j, 1.0 - tnc(t, df_j, 0.0, &dummy));
+          // Compute t-stat / p-value
+          double den = cv_Aj_cvT * resvar;
+          double t = (den > 0) ? con_j / sqrt(den) : 0.0;
+          tstat->SetTuple1(j, t);
+          dfarray->SetTuple1(j, (double) df_j);
+          if(need_p)
+            {
+            int dummy;
+            pval->SetTuple1(j, 1.0 - tnc(t, df_j, 0.0, &dummy));
+            }
+          }
         }
       }
     }
@@ -1546,19 +2166,23 @@ GeneralLinearModel::PtoT(double p)
 
 void GeneralLinearModel::CommonInit()
 {
-  // Initialize other stuff
-  nelt = data->GetNumberOfTuples();
-
   // Rank and degrees of freedom
   // rank = vnl_rank(X.transpose() * X, vnl_rank_row);
   rank = X.columns();
   df = X.rows() - rank;
 
-  // Y matrix
-  Y.set_size(X.rows(), nelt);
-  for(size_t i = 0; i < X.rows(); i++)
-    for(int j = 0; j < nelt; j++)
-      Y(i,j) = data->GetComponent(j,i);
+  // The design does not change between permutations, so the operators
+  // applied to the data are computed once
+  A = vnl_matrix_inverse<double>(X.transpose() * X).pinverse(rank);
+  AXT = A * X.transpose();
+  cv_A_cvT = (cv * (A * cv.transpose()))(0,0);
+
+  // Allocate work buffers
+  bhat.set_size(X.columns(), nelt);
+  con_buf.set_size(nelt);
+  fit_buf.set_size(nelt);
+  rss_buf.set_size(nelt);
+  row_ptr.resize(X.rows());
 }
 
 /*
@@ -1648,6 +2272,17 @@ struct Parameters
   // Input and output meshes
   vector<string> fn_mesh_input, fn_mesh_output;
 
+  // Binary data files for the meshes, and whether they should be created
+  vector<string> fn_data;
+  bool flag_convert_data = false;
+
+  // Seed for the random permutations
+  unsigned long seed = 0;
+
+  // Checkpoint file for permutation testing and how often it is written (sec)
+  string fn_checkpoint;
+  double checkpoint_interval = 300.0;
+
   // Number of permutations
   size_t np;
   
@@ -1675,6 +2310,10 @@ struct Parameters
   // Whether diffusion is specified in time units or mm units
   bool diffusion_in_mm;
 
+  // Integration scheme for diffusion and number of steps for implicit schemes
+  DiffusionSolverType diffusion_solver = DIFFUSION_EXPLICIT;
+  int diffusion_steps = 8;
+
   // Whether tubes are being used
   bool flag_edges;
 
@@ -1867,6 +2506,144 @@ void read_vector(const std::string &fn, const std::string &desc, vnl_vector<doub
   }
 }
 
+/**
+ * A binary file holding the data matrix for the GLM (subjects x elements) as
+ * row-major doubles, which is memory-mapped so that it can be used as Y
+ * without parsing or copying. The file starts with a 64-byte header. Values
+ * are stored in the byte order of the machine that wrote the file.
+ */
+class MappedDataMatrix
+{
+public:
+  MappedDataMatrix(const char *fn);
+  ~MappedDataMatrix();
+
+  // Write a data array (one tuple per element, one component per subject).
+  // The missing data (-M) and standardization (-z) settings used to prepare
+  // the data are stored with it
+  static void Write(const char *fn, Domain dom, vtkDataArray *data, const Parameters &p);
+
+  size_t GetRows() const { return header.rows; }
+  size_t GetColumns() const { return header.cols; }
+  Domain GetDomain() const { return header.domain ? CELL : POINT; }
+  bool GetMissingData() const { return header.missing_data != 0; }
+  double GetMinValidObs() const { return header.min_valid_obs; }
+  bool GetZTransform() const { return header.z_transform != 0; }
+  const double *GetData() const { return (const double *)((const char *) base + sizeof(Header)); }
+
+private:
+  void Unmap();
+
+  struct Header
+    {
+    char magic[8];
+    uint32_t version, domain;
+    uint64_t rows, cols;
+    uint32_t missing_data, z_transform;
+    double min_valid_obs;
+    char pad[16];
+    };
+
+  static constexpr const char *magic_string = "MESHGLMD";
+
+  Header header;
+  void *base;
+  size_t length;
+#ifdef WIN32
+  HANDLE hFile, hMapping;
+#endif
+};
+
+void
+MappedDataMatrix::Write(const char *fn, Domain dom, vtkDataArray *data, const Parameters &p)
+{
+  FILE *f = fopen(fn, "wb");
+  if(!f)
+    throw MCException("Unable to open %s for writing", fn);
+
+  Header h;
+  memset(&h, 0, sizeof(Header));
+  memcpy(h.magic, magic_string, 8);
+  h.version = 2;
+  h.domain = (dom == CELL) ? 1 : 0;
+  h.rows = data->GetNumberOfComponents();
+  h.cols = data->GetNumberOfTuples();
+  h.missing_data = p.flag_missing_data ? 1 : 0;
+  h.z_transform = p.flag_z_transform ? 1 : 0;
+  h.min_valid_obs = p.min_valid_obs;
+  bool ok = fwrite(&h, sizeof(Header), 1, f) == 1;
+
+  // Write one subject at a time
+  vector<double> row(h.cols);
+  for(uint64_t i = 0; i < h.rows && ok; i++)
+    {
+    for(uint64_t j = 0; j < h.cols; j++)
+      row[j] = data->GetComponent(j, i);
+    ok = fwrite(row.data(), sizeof(double), h.cols, f) == h.cols;
+    }
+
+  if(fclose(f) != 0 || !ok)
+    throw MCException("Error writing data to %s", fn);
+}
+
+MappedDataMatrix::MappedDataMatrix(const char *fn)
+{
+#ifdef WIN32
+  hFile = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(hFile == INVALID_HANDLE_VALUE)
+    throw MCException("Unable to open data file %s", fn);
+  LARGE_INTEGER size;
+  GetFileSizeEx(hFile, &size);
+  length = (size_t) size.QuadPart;
+  hMapping = length ? CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+  base = hMapping ? MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if(!base)
+    {
+    if(hMapping) CloseHandle(hMapping);
+    CloseHandle(hFile);
+    throw MCException("Unable to map data file %s", fn);
+    }
+#else
+  int fd = open(fn, O_RDONLY);
+  if(fd < 0)
+    throw MCException("Unable to open data file %s", fn);
+  struct stat st;
+  fstat(fd, &st);
+  length = st.st_size;
+  base = length ? mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if(base == MAP_FAILED)
+    throw MCException("Unable to map data file %s", fn);
+#endif
+
+  // Check the header
+  if(length >= sizeof(Header))
+    memcpy(&header, base, sizeof(Header));
+  if(length < sizeof(Header) || memcmp(header.magic, magic_string, 8) || header.version != 2
+     || length < sizeof(Header) + header.rows * header.cols * sizeof(double))
+    {
+    Unmap();
+    throw MCException("File %s is not a valid meshglm data file", fn);
+    }
+}
+
+MappedDataMatrix::~MappedDataMatrix()
+{
+  Unmap();
+}
+
+void
+MappedDataMatrix::Unmap()
+{
+#ifdef WIN32
+  UnmapViewOfFile(base);
+  CloseHandle(hMapping);
+  CloseHandle(hFile);
+#else
+  munmap(base, length);
+#endif
+}
+
 void copy_array_replace_nans(vtkDataArray *src, vtkDataArray *trg, float nan_value = 0.0)
 {
   for(int j = 0; j < src->GetNumberOfTuples(); j++)
@@ -1879,6 +2656,164 @@ void copy_array_replace_nans(vtkDataArray *src, vtkDataArray *trg, float nan_val
     }
 }
 
+// Generate the permutation with index ip for a given seed. Each permutation
+// has its own generator, so the permutations do not depend on the order in
+// which they are computed. The Fisher-Yates shuffle is written out because
+// std::shuffle differs between standard libraries
+void random_permutation(unsigned long seed, size_t ip, vector<int> &perm)
+{
+  std::seed_seq seq { (uint32_t) seed, (uint32_t) ((uint64_t) seed >> 32),
+                      (uint32_t) ip, (uint32_t) ((uint64_t) ip >> 32) };
+  std::mt19937_64 rng(seq);
+  for(size_t i = perm.size(); i > 1; i--)
+    {
+    // Draw uniformly from [0, i) by rejection
+    uint64_t r, lim = std::numeric_limits<uint64_t>::max();
+    lim -= lim % i;
+    do { r = rng(); } while(r >= lim);
+    std::swap(perm[i-1], perm[r % i]);
+    }
+}
+
+// Add raw bytes to a 64-bit FNV-1a hash
+void fingerprint_add(uint64_t &h, const void *data, size_t n)
+{
+  const unsigned char *b = static_cast<const unsigned char *>(data);
+  for(size_t i = 0; i < n; i++)
+    {
+    h ^= b[i];
+    h *= 1099511628211ull;
+    }
+}
+
+void fingerprint_add(uint64_t &h, const vnl_matrix<double> &m)
+{
+  uint64_t dim[] = { m.rows(), m.cols() };
+  fingerprint_add(h, dim, sizeof(dim));
+  fingerprint_add(h, m.data_block(), m.size() * sizeof(double));
+}
+
+void fingerprint_add(uint64_t &h, const string &str)
+{
+  uint64_t n = str.size();
+  fingerprint_add(h, &n, sizeof(n));
+  fingerprint_add(h, str.data(), str.size());
+}
+
+// Fingerprint of everything that determines the permutation maxima, so that
+// a checkpoint is not resumed with a different analysis. The data matrices
+// are hashed after diffusion, exclusion and standardization
+template <class TMeshType>
+uint64_t checkpoint_fingerprint(const Parameters &p,
+                                const vnl_matrix<double> &mat, const vnl_matrix<double> &con,
+                                const vnl_vector<double> &row_mask,
+                                const vector<vtkSmartPointer<TMeshType> > &mesh,
+                                const vector<GeneralLinearModel *> &glm)
+{
+  uint64_t h = 14695981039346656037ull;
+  fingerprint_add(h, mat);
+  fingerprint_add(h, con);
+  uint64_t n_mask = row_mask.size();
+  fingerprint_add(h, &n_mask, sizeof(n_mask));
+  fingerprint_add(h, row_mask.data_block(), row_mask.size() * sizeof(double));
+
+  double par[] = { p.threshold, p.tfce_delta_h, p.tfce_E, p.tfce_H };
+  fingerprint_add(h, par, sizeof(par));
+  int32_t type[] = { (int32_t) p.ttype, (int32_t) p.dom };
+  fingerprint_add(h, type, sizeof(type));
+
+  // GLM and preprocessing settings
+  double glm_par[] = { p.min_valid_obs, p.diffusion, p.delta_t };
+  fingerprint_add(h, glm_par, sizeof(glm_par));
+  int32_t flags[] = { p.flag_freedman_lane, p.flag_missing_data, p.diffusion_in_mm,
+                      (int32_t) p.diffusion_solver, p.diffusion_steps, p.flag_z_transform };
+  fingerprint_add(h, flags, sizeof(flags));
+  fingerprint_add(h, p.array_name);
+  fingerprint_add(h, p.exclusion_array_name);
+  fingerprint_add(h, p.fl_nuissance);
+
+  for(auto &m : mesh)
+    {
+    uint64_t count[] = { (uint64_t) m->GetNumberOfPoints(), (uint64_t) m->GetNumberOfCells() };
+    fingerprint_add(h, count, sizeof(count));
+    }
+
+  for(auto *g : glm)
+    {
+    vnl_matrix_ref<double> Y = g->GetY();
+    uint64_t dim[] = { Y.rows(), Y.cols() };
+    fingerprint_add(h, dim, sizeof(dim));
+    fingerprint_add(h, Y.data_block(), Y.size() * sizeof(double));
+    }
+  return h;
+}
+
+// Write the maxima of the statistics for the completed permutations. The file
+// is replaced atomically, so that it is valid if the program is killed
+void write_checkpoint(const Parameters &p, uint64_t fingerprint, const vector<char> &done,
+                      const vector<double> &hArea, const vector<double> &hPower,
+                      const vector<double> &hStat, const vector<double> &hTFCE)
+{
+  string fn_tmp = p.fn_checkpoint + ".tmp";
+  FILE *f = fopen(fn_tmp.c_str(), "wt");
+  if(!f)
+    throw MCException("Unable to write checkpoint file %s", fn_tmp.c_str());
+
+  fprintf(f, "meshglm_checkpoint 2\n");
+  fprintf(f, "np %lu seed %lu fingerprint %016llx\n",
+          (unsigned long) p.np, p.seed, (unsigned long long) fingerprint);
+  for(size_t ip = 0; ip < p.np; ip++)
+    if(done[ip])
+      fprintf(f, "%lu %.17g %.17g %.17g %.17g\n", (unsigned long) ip, hArea[ip], hPower[ip], hStat[ip], hTFCE[ip]);
+
+  if(fclose(f) != 0 || !vtksys::SystemTools::RenameFile(fn_tmp, p.fn_checkpoint))
+    throw MCException("Unable to write checkpoint file %s", p.fn_checkpoint.c_str());
+}
+
+// Read the completed permutations from a checkpoint file, if it exists
+void read_checkpoint(const Parameters &p, uint64_t fingerprint, vector<char> &done,
+                     vector<double> &hArea, vector<double> &hPower,
+                     vector<double> &hStat, vector<double> &hTFCE)
+{
+  FILE *f = fopen(p.fn_checkpoint.c_str(), "rt");
+  if(!f)
+    return;
+
+  int version = 0;
+  unsigned long np = 0, seed = 0;
+  unsigned long long fp = 0;
+  if(fscanf(f, "meshglm_checkpoint %d", &version) != 1 || version != 2 ||
+     fscanf(f, " np %lu seed %lu fingerprint %llx", &np, &seed, &fp) != 3)
+    {
+    fclose(f);
+    throw MCException("File %s is not a meshglm checkpoint", p.fn_checkpoint.c_str());
+    }
+  if(np != p.np || seed != p.seed)
+    {
+    fclose(f);
+    throw MCException("Checkpoint %s was created with %lu permutations and seed %lu",
+                      p.fn_checkpoint.c_str(), np, seed);
+    }
+  if(fp != fingerprint)
+    {
+    fclose(f);
+    throw MCException("Checkpoint %s was created with different data or analysis settings",
+                      p.fn_checkpoint.c_str());
+    }
+
+  unsigned long ip;
+  double area, power, stat, tfce;
+  while(fscanf(f, "%lu %lf %lf %lf %lf", &ip, &area, &power, &stat, &tfce) == 5)
+    {
+    if(ip < p.np)
+      {
+      done[ip] = 1;
+      hArea[ip] = area; hPower[ip] = power; hStat[ip] = stat; hTFCE[ip] = tfce;
+      }
+    }
+  fclose(f);
+}
+
 template <class TMeshType>
 int meshcluster(Parameters &p, bool isPolyData)
 {
@@ -2029,9 +2964,19 @@ int meshcluster(Parameters &p, bool isPolyData)
     nuiss_con.fill(1);
     }
 
+  // Check the data files
+  bool use_mapped_data = p.fn_data.size() && !p.flag_convert_data;
+  if(p.fn_data.size() && p.fn_data.size() != p.fn_mesh_input.size())
+    throw MCException("The number of data files (-Y) must match the number of meshes (-m)");
+  if(p.flag_convert_data && p.fn_data.size() == 0)
+    throw MCException("Data files (-Y) must be specified with --convert-data");
+  if(use_mapped_data && (p.exclusion_array_name.length() || p.diffusion > 0))
+    throw MCException("Options -X, -d and -D must be applied with --convert-data, not to a data file");
+
   // Read the meshes and initialize statistics arrays
   typedef vtkSmartPointer<TMeshType> MeshPointer;
   vector<MeshPointer> mesh;
+  vector<std::unique_ptr<MappedDataMatrix> > mapped_data;
   for(size_t i = 0; i < p.fn_mesh_input.size(); i++)
     {
     // Read mesh and optionally triangulate
@@ -2047,15 +2992,41 @@ int meshcluster(Parameters &p, bool isPolyData)
       mesh.push_back(mi);
       }
 
-    // Get the data array from the mesh and error check
-    vtkFloatArray *data = vtkArrayDownCast<vtkFloatArray>(GetArrayFromMesh(mesh[i], p.dom, p.array_name));
-    if(!data)
-      throw MCException("Array %s is missing in mesh %s",
-                        p.array_name.c_str(), p.fn_mesh_input[i].c_str());
-    if(data->GetNumberOfComponents() != (int) n_rows_before_cleanup)
-      throw MCException("Wrong number of components (%d) in array %s in mesh %s. Should be %d.",
-                        data->GetNumberOfComponents(), p.array_name.c_str(),
-                        p.fn_mesh_input[i].c_str(), mat.rows());
+    // Number of elements in the mesh
+    int nelt = (p.dom == POINT) ? mesh[i]->GetNumberOfPoints() : mesh[i]->GetNumberOfCells();
+
+    // Map the data matrix from the data file, or get the data array from the mesh
+    vtkFloatArray *data = nullptr;
+    if(use_mapped_data)
+      {
+      cout << "Mapping data file " << p.fn_data[i] << endl;
+      mapped_data.push_back(std::make_unique<MappedDataMatrix>(p.fn_data[i].c_str()));
+      const MappedDataMatrix &md = *mapped_data.back();
+      if(md.GetDomain() != p.dom || md.GetColumns() != (size_t) nelt)
+        throw MCException("Data file %s has %d %s values, but mesh %s has %d %s",
+                          p.fn_data[i].c_str(), (int) md.GetColumns(),
+                          md.GetDomain() == POINT ? "point" : "cell", p.fn_mesh_input[i].c_str(),
+                          nelt, p.dom == POINT ? "points" : "cells");
+      if(md.GetRows() != mat.rows())
+        throw MCException("Data file %s has %d subjects, design matrix has %d rows after applying the row mask",
+                          p.fn_data[i].c_str(), (int) md.GetRows(), (int) mat.rows());
+      if(md.GetMissingData() != p.flag_missing_data || md.GetMinValidObs() != p.min_valid_obs
+         || md.GetZTransform() != p.flag_z_transform)
+        throw MCException("Data file %s was created with different -M or -z options. These options "
+                          "must be the same when the data file is created and when it is used",
+                          p.fn_data[i].c_str());
+      }
+    else
+      {
+      data = vtkArrayDownCast<vtkFloatArray>(GetArrayFromMesh(mesh[i], p.dom, p.array_name));
+      if(!data)
+        throw MCException("Array %s is missing in mesh %s",
+                          p.array_name.c_str(), p.fn_mesh_input[i].c_str());
+      if(data->GetNumberOfComponents() != (int) n_rows_before_cleanup)
+        throw MCException("Wrong number of components (%d) in array %s in mesh %s. Should be %d.",
+                          data->GetNumberOfComponents(), p.array_name.c_str(),
+                          p.fn_mesh_input[i].c_str(), mat.rows());
+      }
 
     // Check if there is an exclusion array
     if(p.exclusion_array_name.length())
@@ -2088,7 +3059,7 @@ int meshcluster(Parameters &p, bool isPolyData)
       }
 
     // Clean the data if necessary
-    if(rows_kept.size() < n_rows_before_cleanup)
+    if(data && rows_kept.size() < n_rows_before_cleanup)
       {
       vtkDataArray *rawData = data;
       char newName[1024];
@@ -2109,14 +3080,16 @@ int meshcluster(Parameters &p, bool isPolyData)
     if(p.diffusion > 0)
       {
       if(p.dom == POINT)
-        PointDataDiffusion(mesh[i], p.diffusion, p.delta_t, p.diffusion_in_mm, p.array_name.c_str());
+        PointDataDiffusion(mesh[i], p.diffusion, p.delta_t, p.diffusion_in_mm, p.array_name.c_str(),
+                           p.diffusion_solver, p.diffusion_steps);
       else
-        CellDataDiffusion(mesh[i], p.diffusion, p.delta_t, p.diffusion_in_mm, p.array_name.c_str());
+        CellDataDiffusion(mesh[i], p.diffusion, p.delta_t, p.diffusion_in_mm, p.array_name.c_str(),
+                          p.diffusion_solver, p.diffusion_steps);
       }
 
     // If missing data is specified, check for number of nans at each vertex, and if the number
     // is too low, replace all values in that column with NaNs
-    if(p.min_valid_obs > 0.0)
+    if(data && p.min_valid_obs > 0.0)
       {
       int min_not_nan = p.min_valid_obs < 1.0
                         ? int(data->GetNumberOfComponents() * p.min_valid_obs)
@@ -2138,7 +3111,7 @@ int meshcluster(Parameters &p, bool isPolyData)
       }
 
     // Perform z-transformation
-    if(p.flag_z_transform)
+    if(data && p.flag_z_transform)
       {
       // Standardize the dependent variable
       int n_standardized = 0;
@@ -2173,6 +3146,17 @@ int meshcluster(Parameters &p, bool isPolyData)
       printf("Standardized %d of %d dependent variables\n", n_standardized, (int) data->GetNumberOfTuples());
       }
 
+    // When converting, save the data and the mesh without the data arrays
+    if(p.flag_convert_data)
+      {
+      cout << "Writing data file " << p.fn_data[i] << endl;
+      MappedDataMatrix::Write(p.fn_data[i].c_str(), p.dom, data, p);
+      RemoveArrayFromMesh(mesh[i], p.dom, p.array_name);
+      RemoveArrayFromMesh(mesh[i], p.dom, "MissingRows_" + p.array_name);
+      WriteMesh<TMeshType>(mesh[i], p.fn_mesh_output[i].c_str(), p.flag_write_binary);
+      continue;
+      }
+
     // Add the statistics array for output. The actual permutation testing always uses
     // CONTRAST or TSTAT, never the PVALUE (as that would waste time computing tcdf)
     vtkFloatArray * contrast = AddArrayToMesh(mesh[i], p.dom, an_contrast, 1, 0, false);
@@ -2187,17 +3171,27 @@ int meshcluster(Parameters &p, bool isPolyData)
     vtkFloatArray * beta_nuiss {0};
 
     // Create new GLM
-    glm.push_back(new GeneralLinearModel(data, contrast, tstat, pval, beta, residual, dfarray, mat, con));
+    if(use_mapped_data)
+      glm.push_back(new GeneralLinearModel(mapped_data[i]->GetData(), nelt,
+                                           contrast, tstat, pval, beta, residual, dfarray, mat, con));
+    else
+      glm.push_back(new GeneralLinearModel(data, contrast, tstat, pval, beta, residual, dfarray, mat, con));
 
     // For FL, create a reduced GLM
     if(p.flag_freedman_lane)
       {
       residual = AddArrayToMesh(mesh[i], p.dom, an_res, mat.rows(), NAN, false);
       beta_nuiss = AddArrayToMesh(mesh[i], p.dom, an_betan, nuiss_mat.cols(), 0, false);
-      glm_reduced.push_back(new GeneralLinearModel(data, contrast, tstat, pval, beta_nuiss, residual, dfarray, nuiss_mat, nuiss_con));
+      glm_reduced.push_back(new GeneralLinearModel(glm.back()->GetYData(), nelt,
+                                                   contrast, tstat, pval, beta_nuiss, residual, dfarray,
+                                                   nuiss_mat, nuiss_con));
       }
     }
 
+  // Nothing else to do when converting data
+  if(p.flag_convert_data)
+    return 0;
+
   // If the threshold is on the p-value, convert it to a threshold on T-statistic
   if(p.ttype == PVALUE)
     {
@@ -2216,9 +3210,9 @@ int meshcluster(Parameters &p, bool isPolyData)
     for(size_t i = 0; i < mesh.size(); i++)
       {
       if(p.flag_missing_data)
-        glm_reduced[i]->ComputeWithMissingData(glm_reduced[i]->Y,true, false, true );
+        glm_reduced[i]->ComputeWithMissingData(glm_reduced[i]->GetY(),true, false, true );
       else
-        glm_reduced[i]->Compute(glm_reduced[i]->Y,true, false, true);
+        glm_reduced[i]->Compute(glm_reduced[i]->GetY(),true, false, true);
       }
     }
 
@@ -2237,44 +3231,120 @@ int meshcluster(Parameters &p, bool isPolyData)
   // Perform permutation test
   if(p.np > 0)
     {
+    // Load the permutations completed in an earlier run
+    vector<char> done(p.np, 0);
+    uint64_t fingerprint = 0;
+    if(p.fn_checkpoint.size())
+      {
+      fingerprint = checkpoint_fingerprint<TMeshType>(p, mat, con, row_mask, mesh, glm);
+      read_checkpoint(p, fingerprint, done, hArea, hPower, hStat, hTFCE);
+      }
+
+    vector<unsigned int> todo;
+    for(unsigned int ip = 0; ip < p.np; ip++)
+      if(!done[ip])
+        todo.push_back(ip);
+
+    // The remaining permutations are split into chunks that the threads take
+    // from a shared counter, so that faster threads do more of the work
+    size_t n_chunks = 0, chunk_size = 1;
+    if(todo.size())
+      {
+      int nthreads_max = std::thread::hardware_concurrency();
+      if(p.max_threads > 0)
+        nthreads_max = std::min(nthreads_max, p.max_threads);
+      nthreads_max = std::max(nthreads_max, 1);
+      chunk_size = std::max((size_t) 1, std::min((size_t) 64, todo.size() / (8 * nthreads_max)));
+      n_chunks = (todo.size() + chunk_size - 1) / chunk_size;
+      }
+
     // Parallelize over threads
     int nthreads = std::thread::hardware_concurrency();
     if(p.max_threads > 0)
       nthreads = std::min(nthreads, p.max_threads);
+    nthreads = std::max(1, std::min(nthreads, (int) n_chunks));
 
     std::vector<std::thread> threads;
     printf("Executing GLM on %d random permutations using %d threads\n", (int) p.np, (int) nthreads);
+    if(todo.size() < p.np)
+      printf("  %d permutations loaded from checkpoint %s\n", (int) (p.np - todo.size()), p.fn_checkpoint.c_str());
 
-    // Mutex for printing dots
+    // Mutex for printing dots and writing the checkpoint
     std::mutex critical;
-    int n_done = 0;
+    int n_done = p.np - todo.size();
+    std::atomic<size_t> next_chunk(0);
+    auto t_checkpoint = std::chrono::steady_clock::now();
+
+    // Under Freedman-Lane, the residuals and the fitted values of the reduced
+    // model do not change between permutations, so they are computed once and
+    // shared by the threads
+    vector<vnl_matrix<double> > fl_res, fl_fit;
+    if(p.flag_freedman_lane)
+      {
+      for(size_t i = 0; i < mesh.size(); i++)
+        {
+        vtkDataArray *res = GetArrayFromMesh(mesh[i], p.dom, an_res);
+        vtkDataArray *beta_n = GetArrayFromMesh(mesh[i], p.dom, an_betan);
+        int nelt = res->GetNumberOfTuples();
+
+        vnl_matrix<double> res_mat(mat.rows(), nelt), beta_nuiss(nuiss_mat.cols(), nelt);
+        for(size_t k = 0; k < res_mat.rows(); k++)
+          for(int j = 0; j < nelt; j++)
+            res_mat(k,j) = res->GetComponent(j,k);
+        for(size_t k = 0; k < beta_nuiss.rows(); k++)
+          for(int j = 0; j < nelt; j++)
+            beta_nuiss(k,j) = beta_n->GetComponent(j,k);
+
+        fl_res.push_back(res_mat);
+        fl_fit.push_back(nuiss_mat * beta_nuiss);
+        }
+      }
+
+    // The threads share the data matrices of the GLMs and the matrices above, so
+    // the large input and Freedman-Lane arrays are detached from the meshes
+    // while the threads make their copies
+    vector<string> detached_names = { p.array_name, "MissingRows_" + p.array_name, an_res, an_betan };
+    vector<vtkSmartPointer<vtkDataArray> > detached;
+    for(size_t i = 0; i < mesh.size(); i++)
+      {
+      vtkDataSetAttributes *attr = (p.dom == POINT)
+          ? (vtkDataSetAttributes *) mesh[i]->GetPointData() : mesh[i]->GetCellData();
+      for(const string &name : detached_names)
+        {
+        vtkSmartPointer<vtkDataArray> arr = attr->GetArray(name.c_str());
+        detached.push_back(arr);
+        if(arr)
+          attr->RemoveArray(name.c_str());
+        }
+      }
 
-    // For each thread, give it a set of permutations to run
-    for(int it = 0; it < nthreads; it++)
+    // Create the threads, unless all permutations have been loaded
+    for(int it = 0; it < nthreads && n_chunks > 0; it++)
       {
-      int ip_start = ceil(p.np / nthreads) * it;
-      int ip_end = std::min((int) p.np, (int) ceil(p.np / nthreads) * (it + 1));
-      threads.push_back(std::thread(std::bind([&](const int ip_start, const int ip_end)
+      threads.push_back(std::thread([&]()
         {
-        // Create thread's copy of permutations
-        vector<int> permutation = true_order;
+        // Thread's copy of the permutation
+        vector<int> permutation(true_order.size());
 
         // We need to create a copy of the meshes for this thread because the GLM
         // class updates arrays in the mesh
         vector<MeshPointer> mesh_t;
         vector<GeneralLinearModel *> glm_t;
         vector<ClusterComputer *> clustcomp_t;
+        vector<FlatClusterComputer *> flatcomp_t;
         vector<TFCEComputer<TMeshType> *> tfcecomp_t;
-        for(auto &m : mesh)
+        vector<vnl_matrix<double> > Yperm_t;
+        for(size_t i = 0; i < mesh.size(); i++)
           {
           // Create a copy of the mesh
           vtkNew<TMeshType> m_copy;
-          m_copy->DeepCopy(m);
+          m_copy->DeepCopy(mesh[i]);
           mesh_t.push_back(m_copy);
 
-          // Create a copy of the GLM
+          // Create a copy of the GLM that shares the data matrix
           glm_t.push_back(new GeneralLinearModel(
-                            vtkArrayDownCast<vtkFloatArray>(GetArrayFromMesh(m_copy, p.dom, p.array_name)),
+                            glm[i]->GetYData(),
+                            (p.dom == POINT) ? m_copy->GetNumberOfPoints() : m_copy->GetNumberOfCells(),
                             vtkArrayDownCast<vtkFloatArray>(GetArrayFromMesh(m_copy, p.dom, an_contrast)),
                             vtkArrayDownCast<vtkFloatArray>(GetArrayFromMesh(m_copy, p.dom, an_tstat)),
                             vtkArrayDownCast<vtkFloatArray>(GetArrayFromMesh(m_copy, p.dom, an_pval)),
@@ -2283,22 +3353,39 @@ int meshcluster(Parameters &p, bool isPolyData)
                             vtkArrayDownCast<vtkFloatArray>(GetArrayFromMesh(m_copy, p.dom, an_dfarray)),
                             mat, con));
 
-          // Create a cluster computer
-          clustcomp_t.push_back(new ClusterComputer(m_copy, p.dom, p.threshold));
+          // Create a cluster computer. The VTK pipeline is only used for meshes
+          // with cells that the union-find computer does not support
+          if(FlatClusterComputer::CanHandle(m_copy, p.dom))
+            {
+            flatcomp_t.push_back(new FlatClusterComputer(m_copy, p.dom, p.threshold));
+            clustcomp_t.push_back(nullptr);
+            }
+          else
+            {
+            flatcomp_t.push_back(nullptr);
+            clustcomp_t.push_back(new ClusterComputer(m_copy, p.dom, p.threshold));
+            }
 
           // Create a TFCE computer
           if(p.tfce_delta_h > 0.0)
             {
             tfcecomp_t.push_back(new TFCEComputer<TMeshType>(m_copy, an_ttype.c_str(), p.dom, p.tfce_delta_h, p.tfce_E, p.tfce_H));
             }
+
+          // Allocate the buffer for the Freedman-Lane permuted data
+          if(p.flag_freedman_lane)
+            Yperm_t.push_back(vnl_matrix<double>(fl_res[i].rows(), fl_res[i].cols()));
           }
 
-        // Perform permutations for this thread
-        for(unsigned int ip = ip_start; ip < ip_end; ip++)
+        // Perform permutations in chunks until none are left
+        size_t ic;
+        while((ic = next_chunk++) < n_chunks)
+          for(size_t k = ic * chunk_size; k < std::min(todo.size(), (ic + 1) * chunk_size); k++)
           {
-          // Shuffle the permutation
-          std::mt19937 rng(std::time(nullptr));
-          std::shuffle(permutation.begin(), permutation.end(), rng);
+          // Generate the permutation from its index
+          unsigned int ip = todo[k];
+          permutation = true_order;
+          random_permutation(p.seed, ip, permutation);
 
           // Initialize the histogram at zero
           hArea[ip] = 0; hPower[ip] = 0; hStat[ip] = 0; hTFCE[ip] = 0;
@@ -2306,53 +3393,48 @@ int meshcluster(Parameters &p, bool isPolyData)
           // Build up the histogram of cluster areas (and powers)
           for(size_t i = 0; i < mesh_t.size(); i++)
             {
-            vnl_matrix <double> Ytrue = glm_t[i]->Y;
-            vnl_matrix<double> Yperm = Ytrue;
-
-            if(p.flag_freedman_lane) // Permute Y using nuissance model
+            // Without Freedman-Lane, the GLM reads the rows of Y in permuted
+            // order directly
+            if(!p.flag_freedman_lane)
               {
-              // Read residual array from mesh
-              vtkDataArray * res = GetArrayFromMesh(mesh_t[i], p.dom, an_res);
-              vtkDataArray * beta_n = GetArrayFromMesh(mesh_t[i], p.dom, an_betan);
-              vnl_matrix <double> res_mat;
-              res_mat.set_size(Ytrue.rows(), Ytrue.cols());
-
-              // Shuffle the residuals according to the current permutation
-              for(size_t i = 0; i < res_mat.rows(); i++)
-                for(int j = 0; j < res_mat.cols(); j++)
-                  res_mat(i,j) = res->GetComponent(j,i);
-
-              vnl_matrix <double> res_matperm = res_mat;
-              for (size_t i = 0; i < permutation.size(); i++)
-                res_matperm.set_row(i,res_mat.get_row(permutation[i]));
-
-              // Read the nuissance model beta values from the mesh
-              vnl_matrix <double> beta_nuiss;
-              beta_nuiss.set_size(nuiss_mat.cols(), Ytrue.cols());
-              for(size_t i = 0; i < beta_nuiss.rows(); i++)
-                for(int j = 0; j < beta_nuiss.cols(); j++)
-                  beta_nuiss(i,j) = beta_n->GetComponent(j,i);
-
-              // Compute the permuted values
-              Yperm = res_matperm + nuiss_mat * beta_nuiss;
+              if(p.flag_missing_data)
+                glm_t[i]->ComputePermutedWithMissingData(permutation, p.ttype != CONTRAST, p.ttype == PVALUE);
+              else
+                glm_t[i]->ComputePermuted(permutation, p.ttype != CONTRAST, p.ttype == PVALUE);
               }
             else
               {
-              for (size_t i = 0; i < permutation.size(); i++)
-                Yperm.set_row(i,Ytrue.get_row(permutation[i]));
-              }
+              // Permute the residuals of the reduced model and add back the
+              // nuisance fit, gathering the rows into the thread's buffer
+              vnl_matrix<double> &Yperm = Yperm_t[i];
+              for(size_t k = 0; k < Yperm.rows(); k++)
+                {
+                const double *r_k = fl_res[i][permutation[k]], *f_k = fl_fit[i][k];
+                double *y_k = Yperm[k];
+                for(size_t j = 0; j < Yperm.cols(); j++)
+                  y_k[j] = r_k[j] + f_k[j];
+                }
 
-            if(p.flag_missing_data)
-              glm_t[i]->ComputeWithMissingData(Yperm, p.ttype != CONTRAST, p.ttype == PVALUE, false);
-            else
-              glm_t[i]->Compute(Yperm, p.ttype != CONTRAST, p.ttype == PVALUE, false);
+              if(p.flag_missing_data)
+                glm_t[i]->ComputeWithMissingData(Yperm, p.ttype != CONTRAST, p.ttype == PVALUE, false);
+              else
+                glm_t[i]->Compute(Yperm, p.ttype != CONTRAST, p.ttype == PVALUE, false);
+              }
 
             // Generate a list of clusters (based on current scalars)
             if(p.threshold > 0)
               {
-              copy_array_replace_nans(GetArrayFromMesh(mesh_t[i], p.dom, an_ttype),
-                                      GetArrayFromMesh(mesh_t[i], p.dom, an_cluster_array), 0);
-              ClusterArray ca = clustcomp_t[i]->ComputeClusters(false);
+              ClusterArray ca;
+              if(flatcomp_t[i])
+                {
+                ca = flatcomp_t[i]->ComputeClusters(GetArrayFromMesh(mesh_t[i], p.dom, an_ttype));
+                }
+              else
+                {
+                copy_array_replace_nans(GetArrayFromMesh(mesh_t[i], p.dom, an_ttype),
+                                        GetArrayFromMesh(mesh_t[i], p.dom, an_cluster_array), 0);
+                ca = clustcomp_t[i]->ComputeClusters(false);
+                }
 
               // Now find the largest cluster
               for(size_t c = 0; c < ca.size(); c++)
@@ -2366,7 +3448,7 @@ int meshcluster(Parameters &p, bool isPolyData)
             if(p.tfce_delta_h > 0.0)
               {
               // Compute TFCE
-              vtkDataArray *arr_tfce = GetArrayFromMesh(mesh[i], CELL, an_tfce);
+              vtkDataArray *arr_tfce = GetArrayFromMesh(mesh_t[i], CELL, an_tfce);
               tfcecomp_t[i]->Compute(arr_tfce);
               double tfce_stat_max = arr_tfce->GetMaxNorm();
               if(tfce_stat_max > hTFCE[ip])
@@ -2381,17 +3463,43 @@ int meshcluster(Parameters &p, bool isPolyData)
             }
 
           std::lock_guard<std::mutex> guard(critical);
+          done[ip] = 1;
           n_done++;
           cout << "." << flush;
           if(n_done % 100 == 0 || n_done == p.np)
             cout << " " << n_done << endl;
+
+          // Save the completed permutations periodically
+          auto t_now = std::chrono::steady_clock::now();
+          if(p.fn_checkpoint.size() &&
+             std::chrono::duration<double>(t_now - t_checkpoint).count() >= p.checkpoint_interval)
+            {
+            // A failed write should not stop the permutations
+            try { write_checkpoint(p, fingerprint, done, hArea, hPower, hStat, hTFCE); }
+            catch(MCException &exc) { cerr << "Warning: " << exc.what() << endl; }
+            t_checkpoint = t_now;
+            }
           }
-        }, ip_start, ip_end))); // End of in-thread permutation loop
+        })); // End of in-thread permutation loop
       } // Threads have been created
 
     // Run the threads
     std::for_each(threads.begin(),threads.end(),[](std::thread& x){x.join();});
 
+    // Save the final checkpoint
+    if(p.fn_checkpoint.size())
+      write_checkpoint(p, fingerprint, done, hArea, hPower, hStat, hTFCE);
+
+    // Reattach the data arrays
+    for(size_t i = 0; i < mesh.size(); i++)
+      {
+      vtkDataSetAttributes *attr = (p.dom == POINT)
+          ? (vtkDataSetAttributes *) mesh[i]->GetPointData() : mesh[i]->GetCellData();
+      for(size_t k = 0; k < detached_names.size(); k++)
+        if(detached[i * detached_names.size() + k])
+          attr->AddArray(detached[i * detached_names.size() + k]);
+      }
+
     // Sort the histograms
     sort(hArea.begin(), hArea.end());
     sort(hPower.begin(), hPower.end());
@@ -2427,9 +3535,9 @@ int meshcluster(Parameters &p, bool isPolyData)
 
     // Compute GLM (get all arrays, this is for keeps)
     if(p.flag_missing_data)
-      glm[i]->ComputeWithMissingData(glm[i]->Y, true, true, false);
+      glm[i]->ComputeWithMissingData(glm[i]->GetY(), true, true, false);
     else
-      glm[i]->Compute(glm[i]->Y, true, true, false);
+      glm[i]->Compute(glm[i]->GetY(), true, true, false);
     }
 
 
@@ -2731,6 +3839,24 @@ int main(int argc, char *argv[])
         {
         p.delta_t = atof(argv[++i]);
         }
+      else if(arg == "--diffusion-solver")
+        {
+        string solver = argv[++i];
+        if(solver == "explicit")
+          p.diffusion_solver = DIFFUSION_EXPLICIT;
+        else if(solver == "euler")
+          p.diffusion_solver = DIFFUSION_BACKWARD_EULER;
+        else if(solver == "cn")
+          p.diffusion_solver = DIFFUSION_CRANK_NICOLSON;
+        else
+          throw MCException("Unknown diffusion solver %s", solver.c_str());
+        }
+      else if(arg == "--diffusion-steps")
+        {
+        p.diffusion_steps = atoi(argv[++i]);
+        if(p.diffusion_steps < 1)
+          throw MCException("Number of diffusion steps must be positive");
+        }
       else if(arg == "-e" || arg == "--edges")
         {
         p.flag_edges = true;
@@ -2777,6 +3903,26 @@ int main(int argc, char *argv[])
         {
         p.max_threads = atof(argv[++i]);
         }
+      else if(arg == "-Y" || arg == "--ydata")
+        {
+        p.fn_data.push_back(argv[++i]);
+        }
+      else if(arg == "--convert-data")
+        {
+        p.flag_convert_data = true;
+        }
+      else if(arg == "--seed")
+        {
+        p.seed = strtoul(argv[++i], NULL, 10);
+        }
+      else if(arg == "--checkpoint")
+        {
+        p.fn_checkpoint = argv[++i];
+        }
+      else if(arg == "--checkpoint-interval")
+        {
+        p.checkpoint_interval = atof(argv[++i]);
+        }
       else throw MCException("Unknown command line switch %s", arg.c_str());
       }
 